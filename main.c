@@ -1,8 +1,267 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
 #include <raylib.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
+#include <unistd.h>
+
+/* How many seconds of ticks the rewind history remembers at most */
+#define HISTORY_SECONDS 60
+
+/* How many changed cells the rewind history can hold across all its ticks */
+#define HISTORY_RECORDS (1 << 20)
+
+/* How many bytes of everything else the rewind history can hold (extras_t) */
+#define HISTORY_EXTRA_BYTES (64 << 20)
+
+/* Ticks between rewind keyframes and how many keyframes are kept */
+#define HISTORY_KEYFRAME_TICKS 600
+#define HISTORY_KEYFRAMES (HISTORY_SECONDS * 60 / HISTORY_KEYFRAME_TICKS)
+
+/* How many rows of the grid are stored together in one chunk (1 << shift) */
+#define CHUNK_SHIFT 4
+#define CHUNK_ROWS (1 << CHUNK_SHIFT)
+
+/* What cells that aren't in a region hold while a chunk is being labelled */
+#define REGION_NONE UINT32_MAX
+
+/* Rows start on a multiple of this many bytes */
+#define CACHE_LINE 64
+
+/**
+ * Building with -DGRID_TILED stores the grid in square tiles of
+ * (1 << TILE_SHIFT) x (1 << TILE_SHIFT) particles instead of row by row. A
+ * particle's neighbors are then usually in the same tile, which is a lot
+ * closer in memory than a whole row away. Look at get_index for the layout
+ */
+#ifdef GRID_TILED
+#define TILE_SHIFT 3
+#define GRID_LAYOUT_NAME "tiled"
+#else
+#define TILE_SHIFT 0
+#define GRID_LAYOUT_NAME "row-major"
+#endif
+
+#if TILE_SHIFT > CHUNK_SHIFT
+#error "A chunk has to hold whole rows of tiles"
+#endif
+
+/* The parts of a particle's state byte (look at the particle_t definition) */
+#define STATE_ELEM_MASK 0x07
+#define STATE_HAS_VELOCITY 0x08
+
+/**
+ * The timer wheel has TIMER_LEVELS levels of TIMER_SLOTS slots each, so it can
+ * hold timers up to TIMER_SLOTS ^ TIMER_LEVELS ticks away (look at the
+ * timer_wheel_t definition)
+ */
+#define TIMER_LEVELS 4
+#define TIMER_SLOT_BITS 8
+#define TIMER_SLOTS (1 << TIMER_SLOT_BITS)
+
+/* The handle that means no timer, and the end of a timer list */
+#define TIMER_NONE 0
+
+/**
+ * Which of a chunk's bit planes says whether a cell has a particle in it. It
+ * takes the empty element's spot (look at the chunk_t definition)
+ */
+#define PLANE_OCCUPIED 0
+
+/**
+ * The plane of sand that update_sand_word can move, which comes after the
+ * element planes, the planes of everything that conducts electricity and of
+ * what powers it, and how many planes there are in all
+ */
+#define PLANE_SAND ELEM_COUNT
+#define PLANE_CONDUCTOR (ELEM_COUNT + 1)
+#define PLANE_SOURCE (ELEM_COUNT + 2)
+#define PLANE_COUNT (ELEM_COUNT + 3)
+
+/* How much faster a flying particle falls every tick, in cells per tick */
+#define GRAVITY 0.25f
+
+/* The fastest a particle can fly along either axis, in cells per tick */
+#define MAX_SPEED 8.0f
+
+/* The fastest ejecta can fall, in cells per tick */
+#define EJECTA_MAX_SPEED 32.0f
+
+/* How fast a flying particle has to hit a liquid to splash some of it up */
+#define SPLASH_SPEED 4.0f
+
+/* The most cells any liquid can flow sideways in a tick (see find_dispersal) */
+#define MAX_DISPERSION 6
+
+/**
+ * How much more water a cell can hold than the cell above it in pressure mode
+ * (see update_pressure). A full cell holds 1
+ */
+#define PRESSURE_COMPRESSION 0.02f
+
+/* The least water a cell can have in pressure mode to show up as water */
+#define PRESSURE_MIN_MASS 0.01f
+
+/**
+ * How far past even pressure mode moves water between two cells each time.
+ * Anything between 1 and 2 works, and closer to 2 levels out faster
+ */
+#define PRESSURE_RELAXATION 1.9f
+
+/* How many rounds of flow pressure mode does each tick */
+#define PRESSURE_STEPS 8
+
+/**
+ * The heat and smoke fields and the light map are this many times coarser
+ * than the grid along each axis
+ */
+#define FIELD_SHIFT 2
+
+/* How much heat each burning particle adds to its heat cell every tick */
+#define HEAT_FIRE 1.0f
+
+/**
+ * How much of the difference to each neighbor a heat cell evens out every
+ * tick. It has to stay under 0.25 or the diffusion blows up
+ */
+#define HEAT_DIFFUSION 0.2f
+
+/* How much heat a heat cell keeps every tick */
+#define HEAT_COOLING 0.97f
+
+/* Heat under this rounds down to none, so it cools off completely */
+#define HEAT_MIN 0.05f
+
+/* How hot it has to get for wood and oil to catch fire on their own */
+#define HEAT_IGNITION 40.0f
+
+/* Once it's hot enough, one tick in this many something catches fire */
+#define HEAT_IGNITION_ODDS 16
+
+/* Powered wire sets what's next to it alight one tick in this many */
+#define SPARK_ODDS 8
+
+/* How many rows of heat cells each worker diffuses at a time */
+#define HEAT_BAND_ROWS 16
+
+/**
+ * How much smoke a smoke field cell needs, in particles, for the smoke in it
+ * to count as thick (see update_smoke_field)
+ */
+#define SMOKE_DENSE 4.0f
+
+/**
+ * How many of the particles in a field cell have to be gas for the smoke in
+ * it to turn into the smoke field
+ */
+#define SMOKE_PACKED 12
+
+/* Smoke field cells with less than this let all of their smoke out */
+#define SMOKE_THIN 1.0f
+
+/* How much of the smoke field is left after each tick */
+#define SMOKE_DISSIPATION 0.985f
+
+/* How much smoke a smoke field cell needs to be drawn solid */
+#define SMOKE_FULL 16.0f
+
+/* How much of its smoke a cell at the edge of the smoke field lets out */
+#define SMOKE_RELEASE 0.05f
+
+/* The wind field is this many times coarser than the grid along each axis */
+#define WIND_SHIFT 3
+
+/* How much faster hot air rises every tick for each unit of heat */
+#define WIND_BUOYANCY 0.002f
+
+/* How much of its speed the wind keeps every tick */
+#define WIND_DAMPING 0.96f
+
+/* The fastest the wind blows, in cells per tick */
+#define WIND_MAX_SPEED 4.0f
+
+/* Wind slower than this doesn't move gas and dies down to nothing */
+#define WIND_MIN_SPEED 0.05f
+
+/* How many rounds the wind solver spends evening out the pressure */
+#define WIND_PRESSURE_STEPS 20
+
+/**
+ * How far a blast reaches through open air, in cells. A blast's rays start
+ * out this strong and every cell they go through takes one off
+ */
+#define BLAST_RADIUS 12
+
+/* How much of a ray's strength each wall it goes through takes */
+#define BLAST_WALL_COST 6.0f
+
+/* How much of a ray's strength anything else it breaks through takes */
+#define BLAST_CELL_COST 1.5f
+
+/* How fast a blast throws what's right next to it, in cells per tick */
+#define BLAST_SPEED 6.0f
+
+/* How much heat a blast leaves in its heat cell */
+#define BLAST_HEAT 120.0f
+
+/* How many rays a blast casts, one to each cell around the edge of its reach */
+#define BLAST_RAYS (8 * BLAST_RADIUS)
+
+/* The most cells one blast's rays can hit, which is every cell in reach */
+#define BLAST_MAX_HITS ((2 * BLAST_RADIUS + 1) * (2 * BLAST_RADIUS + 1))
+
+/**
+ * The brightest light gets. Light is one dimmer for every light map cell it
+ * spreads across, so it also reaches this many cells
+ */
+#define LIGHT_MAX 15
+
+/**
+ * How bright a light map cell with anything burning in it is, plus one for
+ * each burning particle, up to LIGHT_MAX
+ */
+#define LIGHT_EMIT 8
+
+/**
+ * How many of a light map cell's particles have to be static or solid for it
+ * to block light
+ */
+#define LIGHT_OPAQUE 8
+
+/* How bright things are with no light on them, out of 255 */
+#define LIGHT_AMBIENT 112
+
+/* The largest number grid_rand can return */
+#define GRID_RAND_MAX 0x7fffffff
+
+/* Height of the UI bar under the grid in pixels */
+#define UI_HEIGHT 66
+
+/* The biggest the window gets on either side unless it's set with --window */
+#define MAX_DEFAULT_WINDOW 1024
+
+/**
+ * The biggest a grid or the window can be on either side, which keeps the
+ * number of cells, and the window at any scale, well inside an int
+ */
+#define MAX_SIZE 16384
+
+/* The most pixels a particle can be drawn across with --scale */
+#define MAX_SCALE 64
+
+/* How many cells the view moves per frame when panning */
+#define PAN_SPEED 8
+
+/* The smallest batch world build_scenario can lay a scene out in */
+#define BATCH_MIN_SIZE 4
 
 /**
  * @note ALL x- and y-coordinates in function definitions refer to the particle
@@ -12,7 +271,444 @@
 
 typedef struct grid_t grid_t;
 typedef struct particle_t particle_t;
+typedef struct history_t history_t;
+typedef struct chunk_t chunk_t;
+typedef struct velocity_table_t velocity_table_t;
+typedef struct timer_wheel_t timer_wheel_t;
+typedef struct ejecta_t ejecta_t;
+typedef struct region_piece_t region_piece_t;
+typedef struct region_link_t region_link_t;
+typedef struct region_chunk_t region_chunk_t;
+typedef struct regions_t regions_t;
+typedef struct field_block_t field_block_t;
+typedef struct coarse_field_t coarse_field_t;
+typedef struct wind_block_t wind_block_t;
+typedef struct wind_field_t wind_field_t;
+typedef struct blasts_t blasts_t;
+typedef struct light_block_t light_block_t;
+typedef struct light_map_t light_map_t;
 typedef void (*update_funcptr)(grid_t *, int, int);
+typedef void (*task_funcptr)(void *, int);
+
+/**
+ * One entry in the velocity table. index is the particle's index into the
+ * particle array, or SIZE_MAX if the slot is free
+ */
+typedef struct velocity_entry_t
+{
+    size_t index;
+    Vector2 velocity;
+} velocity_entry_t;
+
+/**
+ * A hash table from particle index to velocity. Almost nothing has a velocity,
+ * so instead of every particle carrying one around, the ones that do are kept
+ * here. It uses open addressing with linear probing and the capacity is always
+ * a power of two
+ */
+struct velocity_table_t
+{
+    velocity_entry_t *entries;
+    size_t capacity;
+    size_t count;
+};
+
+/**
+ * A pending timer. index is the particle it belongs to and due is the tick it
+ * goes off on. Timers that are waiting are in a doubly linked list per slot of
+ * the wheel, and bucket is which slot's list it's in (levels one after the
+ * other), or -1 if it isn't in one. Free timers are kept in a list through
+ * next
+ */
+typedef struct timer_event_t
+{
+    size_t index;
+    uint32_t due;
+    int bucket;
+    uint32_t prev;
+    uint32_t next;
+} timer_event_t;
+
+/**
+ * A hierarchical timer wheel that schedules when particles expire, so that
+ * particles which are waiting to burn out don't cost anything until they do.
+ *
+ * Level 0 has a slot for each of the next TIMER_SLOTS ticks. Each level up
+ * has slots that are TIMER_SLOTS times longer, and a timer goes in the lowest
+ * level that reaches its due tick. Whenever now gets to the start of a slot on
+ * a higher level, that slot's timers are put back in, which moves them down a
+ * level (see advance_timers). A timer only goes off when now is its due tick,
+ * so now is also allowed to go backwards when rewinding.
+ *
+ * Timers are referred to by their handle, which is their spot in events.
+ * Handle TIMER_NONE is never used, so events[0] is left empty
+ */
+struct timer_wheel_t
+{
+    timer_event_t *events;
+    uint32_t capacity;
+    uint32_t free_list;
+    uint32_t count;
+    uint32_t now;
+    uint32_t slots[TIMER_LEVELS * TIMER_SLOTS];
+};
+
+/**
+ * Particles that have been thrown out of the grid (see launch_particle). Fast
+ * particles would have to be moved through lots of cells every tick, so they
+ * leave the grid and fly here with float positions and velocities until they
+ * hit something, then they're put back (see update_ejecta).
+ *
+ * The arrays are all count long and one particle's data is at the same spot
+ * in each, so the integration step is a straight run over floats. cell_x and
+ * cell_y are the cell the particle was in after its last step, which is where
+ * its next step starts from. expires is the tick the particle's timer was due
+ * on when it was thrown, or 0 if it didn't have one. The arrays are all cut
+ * out of one allocation, block
+ */
+struct ejecta_t
+{
+    void *block;
+    float *x;
+    float *y;
+    float *vx;
+    float *vy;
+    int *cell_x;
+    int *cell_y;
+    uint32_t *expires;
+    particle_t *particles;
+    size_t count;
+    size_t capacity;
+};
+
+/* Where a blast is going off */
+typedef struct blast_t
+{
+    int x;
+    int y;
+} blast_t;
+
+/**
+ * A cell one of a blast's rays broke through and the velocity it throws what
+ * was there with
+ */
+typedef struct blast_hit_t
+{
+    int x;
+    int y;
+    Vector2 velocity;
+} blast_hit_t;
+
+/**
+ * One of the rays every blast casts. x and y are how far it is from the blast
+ * after each step, cost is how much of its strength each step takes and
+ * direction is which way it throws things. Each step is one cell along the
+ * axis the ray goes further on, so diagonal steps are longer and cost more
+ */
+typedef struct blast_ray_t
+{
+    signed char x[BLAST_RADIUS];
+    signed char y[BLAST_RADIUS];
+    float cost;
+    Vector2 direction;
+} blast_ray_t;
+
+/**
+ * The blasts waiting to go off (see update_blasts). Explosives that go off
+ * during a tick are queued up and all blow up together at the end of it.
+ * Casting rays only reads the grid, so every queued blast's rays are cast at
+ * once on the worker pool, each blast into its own BLAST_MAX_HITS long stretch
+ * of hits with hit_counts saying how much of it was used. The hits are only
+ * applied after that, one blast at a time, so it plays out the same with or
+ * without the pool. hit_capacity is how many blasts hits has room for.
+ * rays are the same for every blast, so they're only worked out once
+ */
+struct blasts_t
+{
+    blast_ray_t rays[BLAST_RAYS];
+    blast_t *queue;
+    size_t count;
+    size_t capacity;
+    blast_hit_t *hits;
+    int *hit_counts;
+    size_t hit_capacity;
+};
+
+/**
+ * A piece of a region, which is the cells of it in one chunk that are joined
+ * up without leaving the chunk. size is how many cells it has and sourced is
+ * whether any of them is in the source plane
+ *
+ * parent joins it up with the pieces in the other chunks. It's a piece id,
+ * which is the chunk in the top 32 bits and the index of the piece in the
+ * rest, so ids are in the same order as the pieces' first cells. Once the
+ * regions are up to date it points straight at the region's first piece (its
+ * root), where volume is how many cells the whole region has, high is the
+ * last chunk it reaches, grounded is whether it touches the bottom row and
+ * powered is whether any of its pieces is sourced
+ *
+ * stale is whether the piece's region is being worked out again during
+ * update_regions (at the root, whether the region it had before is)
+ */
+struct region_piece_t
+{
+    uint32_t size;
+    uint64_t parent;
+    size_t volume;
+    int high;
+    bool sourced;
+    bool grounded;
+    bool powered;
+    bool stale;
+};
+
+/**
+ * Two pieces that touch across the edge between a chunk and the one below it,
+ * by their indexes in each chunk
+ */
+struct region_link_t
+{
+    uint32_t piece;
+    uint32_t below;
+};
+
+/**
+ * One chunk's part of a grid's regions. labels is one more than the index of
+ * the piece each cell is in, or 0 for cells that aren't the element, in row
+ * order like the chunk's planes. It's NULL for chunks without any of the
+ * element, so only the chunks that have some take up any room. pieces is
+ * count pieces with room for capacity
+ *
+ * links is the pieces that touch the chunk below, link_count of them with
+ * room for link_capacity. They're only looked for again when either chunk is
+ * labelled again, so the regions can be joined up without going over every
+ * chunk edge
+ */
+struct region_chunk_t
+{
+    uint32_t *labels;
+    region_piece_t *pieces;
+    uint32_t count;
+    uint32_t capacity;
+    region_link_t *links;
+    uint32_t link_count;
+    uint32_t link_capacity;
+};
+
+/**
+ * The connected regions of one element in a grid, where cells of that element
+ * that share an edge are in the same region (see update_regions). plane is
+ * the element, or any other plane (eg, PLANE_CONDUCTOR). chunks is NULL until
+ * they're first asked for, since most grids never need them
+ *
+ * Every chunk is labelled on its own into pieces (look at the region_chunk_t
+ * definition), which are then joined up across the chunk edges. The labels
+ * only go as far as their own chunk, so they stay small however big the grid
+ * gets. A chunk is only labelled again once it's dirty, which is when any of
+ * its cells starts or stops being the element. Only the regions that reached
+ * a dirty chunk or touch one now are joined up again, in the chunks marked
+ * touched, and the rest keep their roots
+ *
+ * source is the plane whose cells power the region they're in, or -1 if
+ * nothing does, so whether a cell is powered is just a look at its region
+ *
+ * chunk_count is how many chunks the grid has, and pending is the dirty ones
+ * while they're being labelled
+ *
+ * count is the number of regions and largest is the volume of the biggest
+ * one. rescan is whether the biggest one is being worked out again, so the
+ * others have to be looked at to find the biggest
+ */
+struct regions_t
+{
+    int plane;
+    int source;
+    region_chunk_t *chunks;
+    int chunk_count;
+    int *pending;
+    bool *dirty;
+    bool *touched;
+    size_t count;
+    size_t largest;
+    bool rescan;
+};
+
+/**
+ * What a coarse field's arrays point into. cells holds its cells and next,
+ * each width * height floats, and rows holds its rows and next_rows. Forks
+ * share a block until one of them changes the field (see unshare_field), the
+ * same way they share the wind, and refs is how many fields are using it
+ */
+struct field_block_t
+{
+    int refs;
+    float *cells;
+    bool *rows;
+};
+
+/**
+ * Something spread over a grid at a lower resolution than the particles, one
+ * field cell for every 1 << FIELD_SHIFT by 1 << FIELD_SHIFT particles, so
+ * moving it around costs far less than a tick. It's used for the heat (see
+ * update_heat) and for thick smoke (see update_smoke_field)
+ *
+ * cells is width by height field cells in rows, and next is where the next
+ * tick's cells are worked out before the two are swapped. rows says which
+ * rows of cells have anything in them and next_rows is the same for next, so
+ * only the rows with something in or next to them are touched at all. live is
+ * whether any row has anything in it
+ *
+ * block is what cells, next, rows and next_rows point into (look at the
+ * field_block_t definition)
+ */
+struct coarse_field_t
+{
+    field_block_t *block;
+    float *cells;
+    float *next;
+    bool *rows;
+    bool *next_rows;
+    int width;
+    int height;
+    bool live;
+};
+
+/**
+ * The wind a wind field keeps from one tick to the next. v holds its vx, vy,
+ * solver_vx and solver_vy, along with the scratch_vx and scratch_vy the
+ * solver swaps them with, each width * height floats. Forks share a block
+ * until one of them changes its wind (see unshare_wind), the same way they
+ * share chunks, and refs is how many wind fields are using it
+ */
+struct wind_block_t
+{
+    int refs;
+    float *v;
+};
+
+/**
+ * The wind blowing around a grid, which carries smoke and flames along (see
+ * blow_gas). It's coarser still than the heat, one wind cell for every
+ * 1 << WIND_SHIFT by 1 << WIND_SHIFT particles, and is worked out from the
+ * heat by a small stable fluids solver (see solve_wind), so what it costs
+ * doesn't depend on how much gas there is
+ *
+ * vx and vy are the wind gas reads, in cells per tick. The solver works on
+ * its own copy, solver_vx and solver_vy, from the heat it was handed in heat,
+ * with scratch_vx, scratch_vy, pressure and divergence to work in. That lets
+ * it run on its own thread while the grid is updated (see step_wind). The
+ * wind gas reads is always a tick behind the solver, with a thread or without
+ * one, so a grid plays out the same way either way
+ *
+ * calm is whether the solver's wind has died down to nothing, and still is
+ * whether vx and vy are all 0. While it's calm and cold, the solver isn't run
+ *
+ * block is what vx, vy, solver_vx, solver_vy, scratch_vx and scratch_vy point
+ * into (look at the wind_block_t definition). heat, pressure and divergence
+ * are only needed to work the wind out, so a fork doesn't get them until it
+ * steps (see alloc_wind_scratch)
+ *
+ * thread is the solver's thread when threaded is true. lock guards busy
+ * (the solver has a tick to work out) and quitting. work_ready wakes the
+ * solver up and work_done wakes up anything waiting for it to finish
+ */
+struct wind_field_t
+{
+    wind_block_t *block;
+    float *vx;
+    float *vy;
+    float *solver_vx;
+    float *solver_vy;
+    float *heat;
+    float *scratch_vx;
+    float *scratch_vy;
+    float *pressure;
+    float *divergence;
+    int width;
+    int height;
+    bool calm;
+    bool still;
+    bool threaded;
+    bool busy;
+    bool quitting;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t work_ready;
+    pthread_cond_t work_done;
+};
+
+/**
+ * What a light map's arrays point into, each width * height long. levels
+ * holds its levels, shown, emit and next_emit, flags holds its opaque and
+ * queued, and queues holds its remove_queue, add_queue, changes and
+ * change_levels. Forks share a block until one of them is stepped (see
+ * unshare_light), the same way they share the wind, and refs is how many
+ * light maps are using it
+ */
+struct light_block_t
+{
+    int refs;
+    unsigned char *levels;
+    bool *flags;
+    int *queues;
+};
+
+/**
+ * The light given off by everything that's burning, one light map cell for
+ * every 1 << FIELD_SHIFT by 1 << FIELD_SHIFT particles. A cell with something
+ * burning in it is a light (emit), and light spreads out from it one cell at
+ * a time, one dimmer each time, until it runs out. Cells that are mostly
+ * static or solid (opaque) are lit up but don't let light past, except for
+ * their own
+ *
+ * levels is how bright each cell is. It's only worked out again around the
+ * cells whose emit or opaque changed since the last time, the way a BFS light
+ * engine does it: everything that could have been lit through a changed cell
+ * is put out with remove_queue, then everything is spread back in from the
+ * edges of that with add_queue (see relight). add_head and add_tail are where
+ * add_queue is read from and added to, and queued is whether a cell is in it
+ * already. changes is which cells changed and change_levels is how
+ * much light each one let out before it did, or -1 if it didn't get darker
+ *
+ * That runs on its own thread while the grid is updated, the same way the
+ * wind does (see step_light). next_emit is how many particles were burning
+ * in each cell this tick, which the grid builds up while the thread works.
+ * shown is what's drawn, which is the levels from the tick before
+ *
+ * block is what all of the arrays point into (look at the light_block_t
+ * definition)
+ *
+ * thread is the light's thread when threaded is true. lock guards busy and
+ * quitting, work_ready wakes the thread up and work_done wakes up anything
+ * waiting for it to finish
+ */
+struct light_map_t
+{
+    light_block_t *block;
+    unsigned char *levels;
+    unsigned char *shown;
+    unsigned char *emit;
+    unsigned char *next_emit;
+    bool *opaque;
+    bool *queued;
+    int *remove_queue;
+    int *add_queue;
+    size_t add_head;
+    size_t add_tail;
+    int *changes;
+    int *change_levels;
+    size_t change_count;
+    int width;
+    int height;
+    bool dark;
+    bool threaded;
+    bool busy;
+    bool quitting;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t work_ready;
+    pthread_cond_t work_done;
+};
 
 /**
  * The particle grid. The array is a one-dimensional array of particles.
@@ -24,17 +720,107 @@ typedef void (*update_funcptr)(grid_t *, int, int);
  * The reason for doing this is because grid updates are done from the bottom
  * up, so it made sense for the bottom left to be (0, 0)
  *
- * Indexing into the array is done with the formula index = y * width + x
+ * Rows are stored with a stride (the distance from one row to the next) that
+ * is a power of two and at least as big as the width, so indexing into the
+ * array is done with the formula index = (y << stride_shift) | x (see
+ * get_index). The stride is also picked so every row starts on a cache line.
+ * The cells past the width in each row are just padding and never used.
+ * Indices are size_t since they can be bigger than an int on large grids
+ *
+ * With the tiled layout (GRID_TILED), each band of tile-height rows is still
+ * stored in the same stride-sized block of indices, but it's cut up into tiles
+ * that are each stored contiguously, left to right. The rest of the grid code
+ * doesn't care which layout is used as long as it goes through get_index
+ *
+ * The array is split into chunks of CHUNK_ROWS rows each, so the chunk holding
+ * an index is index >> chunk_shift and the spot in the chunk is the rest of
+ * the bits. Chunks are reference counted so that forked grids can share them
+ * (see fork_grid). Because of this, particles must only be changed through
+ * get_particle_mut, which makes a private copy of a shared chunk first
+ *
+ * updated is a bitset with one bit per particle for checking if that particle
+ * has already been updated this tick. It's kept out of the particles so that
+ * running a tick doesn't write to every chunk. It's indexed in row order
+ * ((y << stride_shift) | x) whatever the layout, so it lines up with the bit
+ * planes (look at the chunk_t definition)
+ *
+ * settled is a bitset laid out the same way for water that's settled. Water
+ * only looks at the cells below and beside it, so if it didn't move last time
+ * it won't move again until one of them changes. Settled water is skipped by
+ * update_grid, and any change to a cell wakes everything around it (see
+ * wake_neighbors), so a still lake only costs the cells that are moving. It
+ * can always be cleared, since that just means the water checks again
+ *
+ * timers schedules when particles expire (look at the timer_wheel_t
+ * definition). Its now is how many times the grid has been updated
+ *
+ * velocities is a sparse table of the velocities of the few particles that
+ * have one (look at the velocity_table_t definition)
+ *
+ * ejecta are the particles that are flying outside of the array (look at the
+ * ejecta_t definition)
+ *
+ * blasts are the explosions waiting to go off (look at the blasts_t
+ * definition)
+ *
+ * bodies are the connected bodies of liquid and structures are the connected
+ * pieces of static material (look at the regions_t definition). structures
+ * are only tracked while structural integrity is on (see
+ * set_structural_integrity). circuits are the connected pieces of wire, which
+ * are powered if there's a battery in them. They're only tracked once there's
+ * been a battery (see update_wire)
+ *
+ * pressure is whether water is in pressure mode (see update_pressure), where
+ * how much water is in each cell is kept in the chunks (look at the chunk_t
+ * definition)
+ *
+ * heat is the temperature of the grid and smoke is the thick smoke that's
+ * been turned into a field (look at the coarse_field_t definition). wind is
+ * the air moving around the grid (look at the wind_field_t definition)
+ *
+ * light is the light from everything that's burning (look at the light_map_t
+ * definition), or NULL if lighting is off
+ *
+ * pool is the worker pool that work within a tick can be split up on (eg,
+ * update_heat), or NULL to do it all on the thread running the grid
+ *
+ * rng is the grid's own random number state (see grid_rand). Every grid having
+ * its own means grids can be run on different threads at the same time and
+ * that a seed always plays out the same way
  *
  * @note Raylib does screen coordinates with (0, 0) as the top left and
  * (width, height) as the bottom right. The x-coordinates are the same, but the
  * y-coordinates from raylib to grid array are found with height - y
+ *
+ * history is the rewind recorder. When it isn't NULL, every change made to the
+ * array through set_particle, swap_particles or record_particle is logged so
+ * it can be undone later
  */
 struct grid_t
 {
     int width;
     int height;
-    particle_t *arr;
+    int stride_shift;
+    int chunk_shift;
+    int chunk_count;
+    chunk_t **chunks;
+    uint64_t *updated;
+    uint64_t *settled;
+    bool pressure;
+    regions_t bodies;
+    regions_t structures;
+    regions_t circuits;
+    coarse_field_t heat;
+    coarse_field_t smoke;
+    wind_field_t *wind;
+    light_map_t *light;
+    velocity_table_t velocities;
+    ejecta_t ejecta;
+    blasts_t blasts;
+    timer_wheel_t timers;
+    struct worker_pool_t *pool;
+    uint32_t rng;
+    history_t *history;
 };
 
 /**
@@ -46,10 +832,11 @@ struct grid_t
  *
  * Whenever you add a new particle, do the following:
  * 1. Create a new material type
- * 2. Create a new update function
+ * 2. Create a new update function and add it to update_funcs
  * 3. Create a new entry within add_particle
  * 4. Update particle interactions
- * 5. Add particle color to get_color_from_mat
+ * 5. Add particle color to get_color_from_mat and its name to
+ *    get_name_from_mat
  */
 typedef enum material_type
 {
@@ -62,6 +849,9 @@ typedef enum material_type
     MAT_WOOD,
     MAT_FIRE,
     MAT_FLAME,
+    MAT_POWDER,
+    MAT_WIRE,
+    MAT_BATTERY,
     MAT_COUNT
 } material_type;
 
@@ -85,1358 +875,9871 @@ typedef enum element_type
 } element_type;
 
 /**
- * Most of these properties are pretty self explanatory. has_been_updated is for
- * checking if the current particle has been swapped with another particle in
- * the current frame (eg, if a water particle moves right, it'll swap with the
- * empty space. Since it's now next to be checked (again), we avoid re-updating
- * it by checking if it's been updated)
+ * A particle only holds what the update functions need to decide how things
+ * move, so that the grid stays small and moving a particle is cheap. It's the
+ * material and a state byte. The low bits of the state (STATE_ELEM_MASK) are
+ * the element type, which is usually the material's but not always (eg, fire
+ * from burning oil is a liquid). STATE_HAS_VELOCITY is set if the particle has
+ * an entry in the grid's velocity table.
  *
- * The update function pointer allows us to have any number of particle types
- * without having to create new cases in a switch statement whenever we want to
- * add something. We simply have to call the current particle's function 
- * whenever we update it.
+ * Everything else lives somewhere else:
+ * - A particle that expires has a timer in the grid's timer wheel. The
+ *   handle of the timer is in a separate array in each chunk (see get_timer)
+ * - Velocities are in the grid's sparse velocity table (see get_velocity)
+ * - The color is worked out from the material when drawing
+ *   (see get_particle_color)
+ * - The update function is looked up by material in update_funcs
+ * - Whether the particle has been updated this frame is in the grid's updated
+ *   bitset (look at the grid_t definition)
  */
 struct particle_t
 {
-    material_type mat_type;
-    element_type elem_type;
-    float life_time;
-    Vector2 velocity;
-    Color color;
-    bool has_been_updated;
-    update_funcptr update_func;
+    uint8_t mat_type;
+    uint8_t state;
 };
 
 /**
- * Creates a new grid with no particle array (init_grid must be used to create
- * the array)
- * @note I don't use this anywhere in the code just yet, but the idea behind it
- * is creating a new, uninitialized grid for later use within code
+ * A block of CHUNK_ROWS rows of particles (the last chunk of a grid might have
+ * fewer), including the padding at the end of each row. cells holds the
+ * particles and timers holds the handles of their timers, both indexed the
+ * same way and aligned to a cache line. Both start out zeroed, so the padding
+ * is always empty with no timer.
  *
- * @return The new grid
+ * planes holds PLANE_COUNT bit planes of plane_words words each, one after the
+ * other. Plane e has a bit set for every particle whose element is e, except
+ * plane PLANE_OCCUPIED (the empty element's), which has a bit set for every
+ * particle that isn't empty. Plane PLANE_SAND has a bit set for every sand
+ * particle without a velocity. Plane PLANE_CONDUCTOR has a bit set for every
+ * wire and battery and plane PLANE_SOURCE for every battery. The bits are in
+ * row order whatever the layout (see get_plane_bit), so a row's cells can be
+ * checked 64 at a time. They're kept up to date by update_planes whenever a
+ * cell's particle changes.
+ *
+ * mass is how much water each cell holds when water is in pressure mode (see
+ * update_pressure), or NULL if the chunk has never been in pressure mode.
+ * It's in row order like the planes, so each row is a plain run of floats.
+ * Blocked cells are -1, which only has to be right during update_pressure.
+ * Keeping it in the chunk means forked grids share it like the particles
+ *
+ * refs is how many grids are using the chunk.
+ * A chunk with more than one reference is shared and has to be copied before
+ * it can be changed
+ *
+ * @note Reference counts aren't atomic, so grids sharing chunks have to stay
+ * on the same thread
  */
-grid_t *new_empty_grid(void);
+struct chunk_t
+{
+    int refs;
+    size_t count;
+    particle_t *cells;
+    uint32_t *timers;
+    uint64_t *planes;
+    size_t plane_words;
+    float *mass;
+};
 
 /**
- * Creates a new grid with a particle array full of empty particles (init_grid
- * does not need to be used)
- *
- * @param width The width of the grid
- * @param height The height of the grid
- * @return The new grid
+ * A pool of worker threads. A batch of tasks is started with start_tasks,
+ * then each worker grabs the next task number until they've all been taken.
+ * Tasks are handed out one at a time so slow tasks don't hold up the rest
  */
-grid_t *new_grid(int width, int height);
+typedef struct worker_pool_t
+{
+    int thread_count;
+    pthread_t *threads;
+    pthread_mutex_t lock;
+    pthread_cond_t work_ready;
+    pthread_cond_t work_done;
+    task_funcptr task_func;
+    void *task_ctx;
+    int task_count;
+    int next_task;
+    int tasks_left;
+    bool quitting;
+} worker_pool_t;
 
 /**
- * Initializes a grid that has no particle array (used after new_empty_grid)
- *
- * @param grid The grid to initialize
- * @param width The width of the grid
- * @param height The height of the grid
+ * The starting scenes that batch worlds can be built with
  */
-void init_grid(grid_t *grid, int width, int height);
+typedef enum scenario_type
+{
+    SCENARIO_FIRE = 0,
+    SCENARIO_FLOOD,
+    SCENARIO_AVALANCHE,
+    SCENARIO_COUNT
+} scenario_type;
 
 /**
- * Destroys a grid, freeing the allocated particle array
- *
- * @param grid The grid to destroy
+ * The summary of one batch world after its run
  */
-void destroy_grid(grid_t *grid);
+typedef struct world_stats_t
+{
+    uint32_t seed;
+    int ticks;
+    size_t counts[MAT_COUNT];
+    size_t liquid_bodies;
+    size_t largest_body;
+    bool replay_differed;
+} world_stats_t;
 
 /**
- * Clears a grid, setting all the particles to empty
- * @note I haven't used this anywhere yet
+ * A batch of independent worlds. World i is built from seed + i and gets its
+ * own grid while it runs, so the only thing the workers write to is their own
+ * slot in stats
+ *
+ * If replay_tick isn't -1, each world is forked on that tick, restored to
+ * the fork once it's done and run to the end again, and replay_differed in
+ * its stats says if it didn't end up the same the second time
+ */
+typedef struct batch_t
+{
+    int world_count;
+    int width;
+    int height;
+    int ticks;
+    int replay_tick;
+    scenario_type scenario;
+    bool pressure;
+    bool integrity;
+    uint32_t seed;
+    world_stats_t *stats;
+} batch_t;
+
+/**
+ * What label_region_chunk needs to label the pending chunks of a grid's
+ * regions on the workers
+ */
+typedef struct region_task_t
+{
+    grid_t *grid;
+    regions_t *regions;
+} region_task_t;
+
+/**
+ * A single logged cell: the index into the particle array and everything that
+ * was stored there before a delta changed it. expires is the tick the
+ * particle's timer was due on, or 0 if it didn't have one. velocity is only
+ * meaningful if the particle has STATE_HAS_VELOCITY set, and mass is how much
+ * water was in the cell if water was in pressure mode
+ */
+typedef struct cell_record_t
+{
+    size_t index;
+    particle_t particle;
+    uint32_t expires;
+    Vector2 velocity;
+    float mass;
+} cell_record_t;
+
+/**
+ * The pieces of a grid that extras_t can hold, each of which starts with its
+ * type
+ */
+typedef enum extra_type
+{
+    EXTRA_EJECTA = 0,
+    EXTRA_HEAT,
+    EXTRA_HEAT_CHANGES,
+    EXTRA_SMOKE,
+    EXTRA_SMOKE_CHANGES,
+    EXTRA_WIND,
+    EXTRA_WIND_SOLVER,
+    EXTRA_RNG,
+    EXTRA_COUNT
+} extra_type;
+
+/**
+ * The parts of a grid that aren't in its cells (eg, the ejecta) as they were
+ * at the start of a tick, packed one piece after another into data. size is
+ * how many bytes are used and capacity is how many there's room for
+ */
+typedef struct extras_t
+{
+    unsigned char *data;
+    size_t size;
+    size_t capacity;
+} extras_t;
+
+/**
+ * A keyframe is a snapshot of the grid taken at the start of a tick. It holds
+ * a reference to each of the grid's chunks, chunk_count of them, the same way
+ * fork_grid does, so taking one doesn't copy any cells. A chunk is only
+ * copied when the grid changes it, and the keyframe keeps the old one (see
+ * get_chunk_mut). chunk_count is 0 when the keyframe isn't holding any.
+ * The velocities and timers aren't in the chunks, so they're copied, and
+ * extras is everything else that isn't in the cells
+ */
+typedef struct keyframe_t
+{
+    unsigned long tick;
+    int chunk_count;
+    chunk_t **chunks;
+    bool pressure;
+    velocity_table_t velocities;
+    timer_wheel_t timers;
+    extras_t extras;
+} keyframe_t;
+
+/**
+ * The rewind history. Every tick gets a delta, which is the list of cells that
+ * were changed during that tick along with what they held before. Stepping
+ * back a tick is just writing those cells back in reverse order.
+ *
+ * The deltas live in one big ring buffer of records, and tick_starts is a
+ * second ring that remembers where each tick's delta starts. record_head is a
+ * running count of records ever written, so a record's slot in the ring is
+ * record_head % record_cap. When either ring fills up, the oldest tick is
+ * thrown away. This keeps the memory fixed no matter how big the grid is, and
+ * how far back you can go depends on how busy the world is.
+ *
+ * What isn't in the cells (eg, the ejecta) is saved as it was at the start of
+ * each tick in extras, which is a third ring alongside tick_starts.
+ * extra_bytes is how much they take up between them, and the oldest ticks
+ * are thrown away when it goes over extra_cap.
+ *
+ * Keyframes are taken every keyframe_interval ticks so you can jump straight
+ * back to one instead of stepping through every delta.
+ *
+ * masses is where update_pressure keeps the masses from before the water
+ * flows, mass_capacity of them, so the cells whose mass changed can be logged
+ *
+ * The wind is too big to save every tick, so it's only saved the first time
+ * a tick changes it (see record_wind). wind_saved is whether the current tick
+ * has saved it, and solver_saved is whether that included the solver's wind
+ *
+ * Most of the heat and smoke stays the same from one tick to the next, so
+ * each tick only saves the part that changed (see save_field_changes). heat
+ * and smoke are the fields as they were at the start of the newest tick,
+ * which is what stepping back puts back, and each tick's changes take them
+ * back one more tick after that
+ *
+ * @note If a single tick changes more cells than the ring can hold (eg,
+ * clearing a huge grid), the whole history is dropped because that tick can't
+ * be undone anyway
+ */
+struct history_t
+{
+    cell_record_t *records;
+    size_t record_cap;
+    size_t record_head;
+    size_t *tick_starts;
+    extras_t *extras;
+    size_t extra_bytes;
+    size_t extra_cap;
+    int tick_cap;
+    int tick_first;
+    int tick_count;
+    unsigned long tick;
+    bool overflowed;
+    int keyframe_interval;
+    int keyframe_count;
+    keyframe_t keyframes[HISTORY_KEYFRAMES];
+    float *masses;
+    size_t mass_capacity;
+    bool wind_saved;
+    bool solver_saved;
+    coarse_field_t heat;
+    coarse_field_t smoke;
+};
+
+/**
+ * Creates a new grid with no particle array (init_grid must be used to create
+ * the array)
+ * @note I don't use this anywhere in the code just yet, but the idea behind it
+ * is creating a new, uninitialized grid for later use within code
+ *
+ * @return The new grid
+ */
+grid_t *new_empty_grid(void);
+
+/**
+ * Creates a new grid with a particle array full of empty particles (init_grid
+ * does not need to be used)
+ *
+ * @param width The width of the grid
+ * @param height The height of the grid
+ * @return The new grid
+ */
+grid_t *new_grid(int width, int height);
+
+/**
+ * Initializes a grid that has no particle array (used after new_empty_grid)
+ *
+ * @param grid The grid to initialize
+ * @param width The width of the grid
+ * @param height The height of the grid
+ */
+void init_grid(grid_t *grid, int width, int height);
+
+/**
+ * Destroys a grid, freeing the allocated particle array and its history
+ *
+ * @param grid The grid to destroy
+ */
+void destroy_grid(grid_t *grid);
+
+/**
+ * Clears a grid, setting all the particles to empty
+ * @note I haven't used this anywhere yet
  *
  * @param grid The grid to clear
  */
 void clear_grid(grid_t *grid);
 
 /**
- * Gets the particle at the input coordinates
+ * Creates a new chunk of particles with one reference
  *
- * @param grid The grid into which to index
- * @param x The x-coordinate in the particle array
- * @param y The y-coordinate in the particle array
- * @return A pointer to the particle at the input coordinates
+ * @param count The number of particles in the chunk
+ * @return The new chunk
  */
-particle_t *get_particle(const grid_t *grid, int x, int y);
+chunk_t *new_chunk(size_t count);
 
 /**
- * Copies the information about an input particle to the particle at the input
- * coordinates
+ * Gives a chunk room for the masses of pressure mode. They aren't set to
+ * anything
  *
- * @param grid The grid of particles
- * @param x The x-coordinate in the particle array
- * @param y The y-coordinate in the particle array
- * @param p The particle whose data is set into the array
+ * @param chunk The chunk
  */
-void set_particle(grid_t *grid, int x, int y, particle_t *p);
+void alloc_chunk_mass(chunk_t *chunk);
 
 /**
- * Gets the material type of a particle
+ * Drops a reference to a chunk, freeing it if nothing else is using it
  *
- * @param p The particle
- * @return The material type of the particle
+ * @param chunk The chunk to release
  */
-material_type get_particle_type(const particle_t *p);
+void release_chunk(chunk_t *chunk);
 
 /**
- * Gets the material type of a particle at the input coordinates
+ * Creates a new grid that shares all of its chunks with the input grid. This
+ * only copies the list of chunks, so it's cheap no matter how big the grid is.
+ * A chunk is only really copied once either grid changes something in it.
+ * The heat, smoke, wind and light are shared too, and copied once either grid
+ * is updated. The fork tracks the same regions with the same labels and has
+ * lighting if the input grid does, with the same light
+ * @note The fork doesn't get the input grid's history, pool or threads
  *
- * @param grid The grid of particles
- * @param x The x-coordinate in the particle array
- * @param y The y-coordinate in the particle array
- * @return The material type of the particle
+ * @param grid The grid to fork
+ * @return The new grid
  */
-material_type get_particle_type_pos(const grid_t *grid, int x, int y);
+grid_t *fork_grid(const grid_t *grid);
 
 /**
- * Adds a new particle of type m into the array at the input coordinates
+ * Sets a grid back to the state of a snapshot (usually made with fork_grid).
+ * Like forking, this only swaps chunk references. The snapshot can be restored
+ * again later since it isn't changed. The grid tracks the regions the
+ * snapshot did and takes its light if they both have lighting (otherwise the
+ * grid's lighting stays as it was and catches up over the next tick). The
+ * grid's history is reset, since none of it leads to the snapshot
+ *
+ * @param grid The grid to restore
+ * @param snapshot The grid to restore from
+ * @return A boolean indicating if the grids were the same size
+ */
+bool restore_grid(grid_t *grid, const grid_t *snapshot);
+
+/**
+ * Gets the index into the particle array of the input coordinates
+ * @note This doesn't do bounds checking
  *
  * @param grid The grid of particles
  * @param x The x-coordinate in the particle array
  * @param y The y-coordinate in the particle array
- * @param m The particle type
+ * @return The index
  */
-void add_particle(grid_t *grid, int x, int y, material_type m);
+size_t get_index(const grid_t *grid, int x, int y);
 
 /**
- * Removes a particle in the array at the input coordinates. Used when erasing
- * particles with right-click
- * @note This really just sets the particle type to "Empty"
+ * Gets the coordinates of an index into the particle array. This is the
+ * opposite of get_index
  *
  * @param grid The grid of particles
- * @param x The x-coordinate in the particle array
- * @param y The y-coordinate in the particle array
+ * @param index The index into the particle array
+ * @param x Where to put the x-coordinate
+ * @param y Where to put the y-coordinate
  */
-void remove_particle(grid_t *grid, int x, int y);
+void get_position(const grid_t *grid, size_t index, int *x, int *y);
 
 /**
- * Swaps two particles in the particle array
- * @note Use this whenever you want a particle to move. Non-empty particles
- * "swap" places with empty ones to give them the appearance of moving
+ * Gets the number of particles in the grid
  *
  * @param grid The grid of particles
- * @param x1 The x-coordinate of the first particle
- * @param y1 The y-coordinate of the first particle
- * @param x2 The x-coordinate of the second particle
- * @param y2 The y-coordinate of the second particle
+ * @return width * height
  */
-void swap_particles(grid_t *grid, int x1, int y1, int x2, int y2);
+size_t get_cell_count(const grid_t *grid);
 
 /**
- * Adds or removes a line of particles of type m from (x1, y1) to (x2, y2)
- * @note Removal is only done if the particle type is "Empty"
- * @note A line of particles is drawn to enable continuous particle drawing.
- * Otherwise, only one particle is drawn per frame and they are widely spread
- * out if the mouse is moved around rapidly.
+ * Gets the number of particles the grid has room for, padding included. Every
+ * index from get_index is less than this. With the tiled layout, the height
+ * is rounded up to whole tiles since the last band of tiles is always stored
+ * in full
  *
  * @param grid The grid of particles
- * @param x1 The starting x-coordinate
- * @param y1 The starting y-coordinate
- * @param x2 The ending x-coordinate
- * @param y2 The ending y-coordinate
- * @param m The type of the particle to add/remove
+ * @return height * stride
  */
-void particle_line(grid_t *grid, int x1, int y1, int x2, int y2,
-                   material_type m);
+size_t get_storage_count(const grid_t *grid);
 
 /**
- * Checks if the particle type is "EMPTY"
+ * Gets the particle at an index into the particle array (see get_index)
  *
- * @param particle The particle to check
- * @return A boolean indicating if the particle is empty
+ * @param grid The grid into which to index
+ * @param index The index into the particle array
+ * @return A read-only pointer to the particle at the index
  */
-bool is_particle_empty(const particle_t *particle);
+const particle_t *get_particle_at(const grid_t *grid, size_t index);
 
 /**
- * Checks if the particle's element type is "STATIC"
+ * Gets the particle at an index into the particle array so it can be changed.
+ * If the particle's chunk is shared, it's copied first
  *
- * @param particle The particle to check
- * @return A boolean indicating if the particle is static
+ * @param grid The grid into which to index
+ * @param index The index into the particle array
+ * @return A pointer to the particle at the index
  */
-bool is_particle_static(const particle_t *particle);
+particle_t *get_particle_at_mut(grid_t *grid, size_t index);
 
 /**
- * Checks if the particle's element type is "SOLID"
+ * Gets the particle at the input coordinates
  *
- * @param particle The particle to check
- * @return A boolean indicating if the particle is solid
+ * @param grid The grid into which to index
+ * @param x The x-coordinate in the particle array
+ * @param y The y-coordinate in the particle array
+ * @return A read-only pointer to the particle at the input coordinates
  */
-bool is_particle_solid(const particle_t *particle);
+const particle_t *get_particle(const grid_t *grid, int x, int y);
 
 /**
- * Checks if the particle's element type is "LIQUID"
+ * Gets the chunk holding an index so it can be changed. If the chunk is
+ * shared, it's copied first
  *
- * @param particle The particle to check
- * @return A boolean indicating if the particle is liquid
+ * @param grid The grid of particles
+ * @param index The index into the particle array
+ * @return The chunk
  */
-bool is_particle_liquid(const particle_t *particle);
+chunk_t *get_chunk_mut(grid_t *grid, size_t index);
 
 /**
- * Checks if the particle's element type is "GAS"
+ * Gets the particle at the input coordinates so it can be changed. If the
+ * particle's chunk is shared, it's copied first
  *
- * @param particle The particle to check
- * @return A boolean indicating if the particle is gas
+ * @param grid The grid into which to index
+ * @param x The x-coordinate in the particle array
+ * @param y The y-coordinate in the particle array
+ * @return A pointer to the particle at the input coordinates
  */
-bool is_particle_gas(const particle_t *particle);
+particle_t *get_particle_mut(grid_t *grid, int x, int y);
 
 /**
- * Checks if the particle type in the array at the input coordinates is "EMPTY"
- * @note This function does bounds checking. Coordinates outside of the grid
- * (ie, less than 0 or greater than width/height) are considered "occupied".
- * This is so the particles don't flow outside the bounds of the game window
+ * Checks if the particle at the input coordinates has already been updated
+ * this tick
  *
  * @param grid The grid of particles
  * @param x The x-coordinate in the particle array
  * @param y The y-coordinate in the particle array
- * @return A boolean indicating if the particle is empty
+ * @return A boolean indicating if the particle has been updated
  */
-bool is_pos_empty(const grid_t *grid, int x, int y);
+bool is_updated(const grid_t *grid, int x, int y);
 
 /**
- * Checks if the particle type in the array at the input coordinates is "STATIC"
+ * Marks the particle at the input coordinates as updated (or not) this tick
  *
  * @param grid The grid of particles
  * @param x The x-coordinate in the particle array
  * @param y The y-coordinate in the particle array
- * @return A boolean indicating if the particle is static
+ * @param updated Whether the particle has been updated
  */
-bool is_pos_static(const grid_t *grid, int x, int y);
+void set_updated(grid_t *grid, int x, int y, bool updated);
 
 /**
- * Checks if the particle type in the array at the input coordinates is "SOLID"
+ * Marks the water at the input coordinates as settled (or not), so update_grid
+ * skips it until something near it changes
  *
  * @param grid The grid of particles
  * @param x The x-coordinate in the particle array
  * @param y The y-coordinate in the particle array
- * @return A boolean indicating if the particle is solid
+ * @param settled Whether the particle is settled
  */
-bool is_pos_solid(const grid_t *grid, int x, int y);
+void set_settled(grid_t *grid, int x, int y, bool settled);
 
 /**
- * Checks if the particle type in the array at the input coordinates is "LIQUID"
+ * Wakes the settled particles at and around the input coordinates after that
+ * cell changed
  *
  * @param grid The grid of particles
  * @param x The x-coordinate in the particle array
  * @param y The y-coordinate in the particle array
- * @return A boolean indicating if the particle is liquid
  */
-bool is_pos_liquid(const grid_t *grid, int x, int y);
+void wake_neighbors(grid_t *grid, int x, int y);
 
 /**
- * Checks if the particle type in the array at the input coordinates is "GAS"
+ * Gets where the bit for the input coordinates is in its chunk's planes
  *
  * @param grid The grid of particles
  * @param x The x-coordinate in the particle array
  * @param y The y-coordinate in the particle array
- * @return A boolean indicating if the particle is gas
+ * @return The bit's position in a plane
  */
-bool is_pos_gas(const grid_t *grid, int x, int y);
+size_t get_plane_bit(const grid_t *grid, int x, int y);
 
 /**
- * The update function for empty particles
+ * Checks the bit for the input coordinates in one of its chunk's planes
+ * @note This doesn't do bounds checking
  *
  * @param grid The grid of particles
+ * @param plane Which plane (PLANE_OCCUPIED or an element type)
  * @param x The x-coordinate in the particle array
  * @param y The y-coordinate in the particle array
+ * @return A boolean indicating if the bit is set
  */
-void update_empty(grid_t *grid, int x, int y);
+bool test_plane(const grid_t *grid, int plane, int x, int y);
 
 /**
- * The update function for sand particles
+ * Sets the bits for the input coordinates in its chunk's planes to match the
+ * particle that's there, and wakes the particles around it since it changed
  *
  * @param grid The grid of particles
- * @param x The x-coordinate in the particle array of the sand
- * @param y The y-coordinate in the particle array of the sand
+ * @param x The x-coordinate in the particle array
+ * @param y The y-coordinate in the particle array
  */
-void update_sand(grid_t *grid, int x, int y);
+void update_planes(grid_t *grid, int x, int y);
 
 /**
- * The update function for water particles
+ * Finds the first particle in a row at or after the input x-coordinate that
+ * needs updating using the occupancy plane and the settled bitset, skipping
+ * empty and settled cells 64 at a time
  *
  * @param grid The grid of particles
- * @param x The x-coordinate in the particle array of the water
- * @param y The y-coordinate in the particle array of the water
+ * @param x The x-coordinate to start looking from
+ * @param y The y-coordinate of the row
+ * @return The x-coordinate of the particle, or the grid's width if there isn't
+ * one
  */
-void update_water(grid_t *grid, int x, int y);
+int next_active(const grid_t *grid, int x, int y);
 
 /**
- * The update function for smoke particles
+ * Updates all of the sand in one 64-column word of a row at once with bit
+ * operations instead of one particle at a time. It only does it if the word
+ * has nothing in it but sand, and the cells below it have nothing that sand
+ * sinks into (liquid or gas) or that stops it sliding (static). The result is
+ * exactly what running update_sand on each sand particle from left to right
+ * would do
  *
  * @param grid The grid of particles
- * @param x The x-coordinate in the particle array of the smoke
- * @param y The y-coordinate in the particle array of the smoke
+ * @param x The x-coordinate of the start of the word (a multiple of 64)
+ * @param y The y-coordinate of the row
+ * @return A boolean indicating if the word was updated. If it wasn't, its
+ * particles still need updating the normal way
  */
-void update_smoke(grid_t *grid, int x, int y);
+bool update_sand_word(grid_t *grid, int x, int y);
 
 /**
- * The update function for oil particles
+ * Wakes the settled particles in the word of a row and the row below it that
+ * update_sand_word moved grains around in, along with the words either side of
+ * those and above and below them
+ * @note The stride has to be at least 64 (a word a row)
  *
  * @param grid The grid of particles
- * @param x The x-coordinate in the particle array of the oil
- * @param y The y-coordinate in the particle array of the oil
+ * @param x The x-coordinate of the start of the word (a multiple of 64)
+ * @param y The y-coordinate of the upper row
  */
-void update_oil(grid_t *grid, int x, int y);
+void wake_word(grid_t *grid, int x, int y);
 
 /**
- * The update function for wall particles
+ * Drops a falling column of sand or water down a cell in one go. The column is
+ * the run of identical particles going up from (x, y) with nothing but empty
+ * cells or static particles beside them, and the cell under (x, y) has to be
+ * empty. Each of those particles would fall straight into the cell the one
+ * under it just left, so moving the top one to the bottom ends up the same as
+ * updating them one by one, however tall the column is
  *
  * @param grid The grid of particles
- * @param x The x-coordinate in the particle array of the wall
- * @param y The y-coordinate in the particle array of the wall
+ * @param x The x-coordinate in the particle array of the bottom of the column
+ * @param y The y-coordinate in the particle array of the bottom of the column
+ * @return A boolean indicating if the column was dropped. Runs of only one
+ * particle aren't, since the normal update does the same thing
  */
-void update_wall(grid_t *grid, int x, int y);
+bool drop_column(grid_t *grid, int x, int y);
 
 /**
- * The update function for wood particles
+ * Gets the position of the lowest set bit
+ *
+ * @param bits The bits, which can't be 0
+ * @return The position of the lowest set bit (0 to 63)
+ */
+int lowest_bit(uint64_t bits);
+
+/**
+ * Gives a grid its own heat, smoke and light if it still shares them with a
+ * fork, and its updated and settled bits if it doesn't have them yet (see
+ * fork_grid). The chunks and wind are copied as they're changed instead
  *
  * @param grid The grid of particles
- * @param x The x-coordinate in the particle array of the wood
- * @param y The y-coordinate in the particle array of the wood
  */
-void update_wood(grid_t *grid, int x, int y);
+void unshare_grid(grid_t *grid);
 
 /**
- * The update function for burning particles
+ * Runs one tick of the simulation, updating every particle from the bottom up
  *
  * @param grid The grid of particles
- * @param x The x-coordinate in the particle array of the fire
- * @param y The y-coordinate in the particle array of the fire
  */
-void update_fire(grid_t *grid, int x, int y);
+void update_grid(grid_t *grid);
 
 /**
- * The update function for flame particles
+ * Moves the grid's timer wheel on a tick and expires the particles whose
+ * timers are due (see expire_particle)
  *
  * @param grid The grid of particles
- * @param x The x-coordinate in the particle array of the flame
- * @param y The y-coordinate in the particle array of the flame
  */
-void update_flame(grid_t *grid, int x, int y);
+void advance_timers(grid_t *grid);
 
 /**
- * Sets the current drawing material to the next type
+ * Does whatever a particle does when its life runs out
  *
- * @param m The current material
- * @return The new material type
+ * @param grid The grid of particles
+ * @param x The x-coordinate in the particle array
+ * @param y The y-coordinate in the particle array
  */
-material_type next_material(material_type m);
+void expire_particle(grid_t *grid, int x, int y);
 
 /**
- * Sets the current drawing material to the previous type
+ * Sets up an empty timer wheel
  *
- * @param m The current material
- * @return The new material type
+ * @param wheel The timer wheel
  */
-material_type prev_material(material_type m);
+void init_timer_wheel(timer_wheel_t *wheel);
 
 /**
- * Gets the color of a material
+ * Makes one timer wheel a copy of another, keeping the same handles
  *
- * @param m The material
- * @return The color of the material
+ * @param dest The timer wheel to copy into
+ * @param src The timer wheel to copy
+ * @return A boolean indicating if there was enough memory
  */
-Color get_color_from_mat(material_type m);
+bool copy_timer_wheel(timer_wheel_t *dest, const timer_wheel_t *src);
 
-int 
-main(void)
-{
-    const int grid_w = 512, grid_h = 512;
-    const int scr_w = 512, scr_h = 578;
-    int x = 0, y = 0, i = 0;
-    int prev_pos[2] = {0, 0};
-    int curr_pos[2] = {0, 0};
-    material_type curr_mat = MAT_SAND;
-    grid_t *grid = new_grid(grid_w, grid_h);
-    particle_t *curr_particle = NULL;
+/**
+ * Starts a timer for a particle
+ *
+ * @param wheel The timer wheel
+ * @param index The index of the particle in the particle array
+ * @param due The tick the timer goes off on. If it's already passed, the
+ * timer goes off on the next tick
+ * @return The handle of the timer
+ */
+uint32_t add_timer(timer_wheel_t *wheel, size_t index, uint32_t due);
 
-    srand(time(NULL));
+/**
+ * Stops a timer and frees its handle
+ *
+ * @param wheel The timer wheel
+ * @param handle The handle of the timer
+ */
+void remove_timer(timer_wheel_t *wheel, uint32_t handle);
 
-    InitWindow(scr_w, scr_h, "Falling Sand");
-    SetTargetFPS(60);
+/**
+ * Puts a timer in the slot it belongs in for how far away its due tick is
+ *
+ * @param wheel The timer wheel
+ * @param handle The handle of the timer
+ */
+void link_timer(timer_wheel_t *wheel, uint32_t handle);
 
-    while (!WindowShouldClose()) {
-        curr_pos[0] = GetMouseX();
-        curr_pos[1] = grid_h - 1 - GetMouseY();
+/**
+ * Takes a timer out of its slot
+ *
+ * @param wheel The timer wheel
+ * @param handle The handle of the timer
+ */
+void unlink_timer(timer_wheel_t *wheel, uint32_t handle);
 
-        /*if (GetMouseWheelMoveV().y > 0) {*/
-            /* Increase the drawing size */
+/**
+ * Seeds the grid's random number generator
+ *
+ * @param grid The grid of particles
+ * @param seed The seed
+ */
+void seed_grid(grid_t *grid, uint32_t seed);
+
+/**
+ * Gets the next random number from the grid's generator. Use this instead of
+ * rand() in update functions so that grids don't share any state
+ *
+ * @param grid The grid of particles
+ * @return A random number from 0 to GRID_RAND_MAX
+ */
+int grid_rand(grid_t *grid);
+
+/**
+ * Replaces the particle at the input coordinates. Any velocity or timer the old
+ * particle had is dropped
+ *
+ * @param grid The grid of particles
+ * @param x The x-coordinate in the particle array
+ * @param y The y-coordinate in the particle array
+ * @param p The particle whose data is set into the array
+ * @param life_time How many ticks until the new particle expires, or 0 if it
+ * doesn't
+ */
+void set_particle(grid_t *grid, int x, int y, const particle_t *p,
+                  uint32_t life_time);
+
+/**
+ * Gets the element type of a particle from its state
+ *
+ * @param p The particle
+ * @return The element type of the particle
+ */
+element_type get_particle_elem(const particle_t *p);
+
+/**
+ * Sets the element type in a particle's state
+ *
+ * @param p The particle
+ * @param e The element type
+ */
+void set_particle_elem(particle_t *p, element_type e);
+
+/**
+ * Gets how many ticks the particle at the input coordinates has left
+ *
+ * @param grid The grid of particles
+ * @param x The x-coordinate in the particle array
+ * @param y The y-coordinate in the particle array
+ * @return The life time, or 0 if the particle doesn't expire
+ */
+uint32_t get_life_time(const grid_t *grid, int x, int y);
+
+/**
+ * Gets the handle of the timer of the particle at an index
+ *
+ * @param grid The grid of particles
+ * @param index The index into the particle array
+ * @return The handle, or TIMER_NONE if the particle doesn't have a timer
+ */
+uint32_t get_timer(const grid_t *grid, size_t index);
+
+/**
+ * Sets the handle of the timer of the particle at an index. This doesn't log
+ * anything or touch the timer wheel
+ *
+ * @param grid The grid of particles
+ * @param index The index into the particle array
+ * @param handle The handle, or TIMER_NONE
+ */
+void set_timer(grid_t *grid, size_t index, uint32_t handle);
+
+/**
+ * Looks up an index in a velocity table
+ *
+ * @param table The velocity table
+ * @param index The index into the particle array
+ * @return A pointer to the velocity, or NULL if the index has none
+ */
+Vector2 *find_velocity(const velocity_table_t *table, size_t index);
+
+/**
+ * Adds or replaces the velocity of an index in a velocity table, growing the
+ * table if it's getting full
+ *
+ * @param table The velocity table
+ * @param index The index into the particle array
+ * @param velocity The velocity
+ */
+void put_velocity(velocity_table_t *table, size_t index, Vector2 velocity);
+
+/**
+ * Removes an index from a velocity table if it's there
+ *
+ * @param table The velocity table
+ * @param index The index into the particle array
+ */
+void erase_velocity(velocity_table_t *table, size_t index);
+
+/**
+ * Makes one velocity table a copy of another
+ *
+ * @param dest The velocity table to copy into
+ * @param src The velocity table to copy
+ * @return A boolean indicating if there was enough memory
+ */
+bool copy_velocity_table(velocity_table_t *dest,
+                         const velocity_table_t *src);
+
+/**
+ * Gets the velocity of the particle at the input coordinates
+ *
+ * @param grid The grid of particles
+ * @param x The x-coordinate in the particle array
+ * @param y The y-coordinate in the particle array
+ * @param velocity Where to put the velocity (set to 0 if there isn't one)
+ * @return A boolean indicating if the particle has a velocity
+ */
+bool get_velocity(const grid_t *grid, int x, int y, Vector2 *velocity);
+
+/**
+ * Gives the particle at the input coordinates a velocity
+ *
+ * @param grid The grid of particles
+ * @param x The x-coordinate in the particle array
+ * @param y The y-coordinate in the particle array
+ * @param velocity The velocity
+ */
+void set_velocity(grid_t *grid, int x, int y, Vector2 velocity);
+
+/**
+ * Removes the velocity of the particle at the input coordinates
+ *
+ * @param grid The grid of particles
+ * @param x The x-coordinate in the particle array
+ * @param y The y-coordinate in the particle array
+ */
+void clear_velocity(grid_t *grid, int x, int y);
+
+/**
+ * Reads everything stored in a cell into a record
+ *
+ * @param grid The grid of particles
+ * @param index The index into the particle array
+ * @param record Where to put the cell
+ */
+void read_cell(const grid_t *grid, size_t index, cell_record_t *record);
+
+/**
+ * Writes a record back into a cell without logging it. Used for rewinding
+ *
+ * @param grid The grid of particles
+ * @param record The cell to write (its index says where)
+ */
+void write_cell(grid_t *grid, const cell_record_t *record);
+
+/**
+ * Gets the material type of a particle
+ *
+ * @param p The particle
+ * @return The material type of the particle
+ */
+material_type get_particle_type(const particle_t *p);
+
+/**
+ * Gets the material type of a particle at the input coordinates
+ *
+ * @param grid The grid of particles
+ * @param x The x-coordinate in the particle array
+ * @param y The y-coordinate in the particle array
+ * @return The material type of the particle
+ */
+material_type get_particle_type_pos(const grid_t *grid, int x, int y);
+
+/**
+ * Adds a new particle of type m into the array at the input coordinates
+ *
+ * @param grid The grid of particles
+ * @param x The x-coordinate in the particle array
+ * @param y The y-coordinate in the particle array
+ * @param m The particle type
+ */
+void add_particle(grid_t *grid, int x, int y, material_type m);
+
+/**
+ * Removes a particle in the array at the input coordinates. Used when erasing
+ * particles with right-click
+ * @note This really just sets the particle type to "Empty"
+ *
+ * @param grid The grid of particles
+ * @param x The x-coordinate in the particle array
+ * @param y The y-coordinate in the particle array
+ */
+void remove_particle(grid_t *grid, int x, int y);
+
+/**
+ * Swaps two particles in the particle array
+ * @note Use this whenever you want a particle to move. Non-empty particles
+ * "swap" places with empty ones to give them the appearance of moving
+ *
+ * @param grid The grid of particles
+ * @param x1 The x-coordinate of the first particle
+ * @param y1 The y-coordinate of the first particle
+ * @param x2 The x-coordinate of the second particle
+ * @param y2 The y-coordinate of the second particle
+ */
+void swap_particles(grid_t *grid, int x1, int y1, int x2, int y2);
+
+/**
+ * Adds or removes a line of particles of type m from (x1, y1) to (x2, y2)
+ * @note Removal is only done if the particle type is "Empty"
+ * @note A line of particles is drawn to enable continuous particle drawing.
+ * Otherwise, only one particle is drawn per frame and they are widely spread
+ * out if the mouse is moved around rapidly.
+ *
+ * @param grid The grid of particles
+ * @param x1 The starting x-coordinate
+ * @param y1 The starting y-coordinate
+ * @param x2 The ending x-coordinate
+ * @param y2 The ending y-coordinate
+ * @param m The type of the particle to add/remove
+ */
+void particle_line(grid_t *grid, int x1, int y1, int x2, int y2,
+                   material_type m);
+
+/**
+ * Creates a new rewind history
+ *
+ * @param max_ticks The most ticks that can be rewound
+ * @param max_records The most changed cells that can be stored across all ticks
+ * @param keyframe_interval How many ticks between keyframes
+ * @return The new history
+ */
+history_t *new_history(int max_ticks, size_t max_records,
+                       int keyframe_interval);
+
+/**
+ * Destroys a history, freeing the deltas and keyframes
+ *
+ * @param history The history to destroy
+ */
+void destroy_history(history_t *history);
+
+/**
+ * Starts a new tick in the grid's history. Call this once per tick before
+ * anything is changed. Takes a keyframe if one is due
+ * @note Does nothing if the grid has no history
+ *
+ * @param grid The grid of particles
+ */
+void begin_history_tick(grid_t *grid);
+
+/**
+ * Takes a keyframe of the grid, recycling the oldest keyframe slot if they're
+ * all in use
+ *
+ * @param grid The grid of particles
+ */
+void take_keyframe(grid_t *grid);
+
+/**
+ * Lets go of the chunks a keyframe is holding
+ *
+ * @param keyframe The keyframe
+ */
+void release_keyframe(keyframe_t *keyframe);
+
+/**
+ * Drops any keyframes newer than the history's current tick. Used after going
+ * back in time since those keyframes are now in the future
+ *
+ * @param history The history
+ */
+void drop_future_keyframes(history_t *history);
+
+/**
+ * Forgets every tick and keyframe in a history, so it starts over from the
+ * grid as it is now. Used when the grid has jumped somewhere its deltas can't
+ * undo (eg, restore_grid)
+ *
+ * @param history The history
+ */
+void reset_history(history_t *history);
+
+/**
+ * Throws away the oldest tick in a history
+ *
+ * @param history The history
+ */
+void drop_oldest_tick(history_t *history);
+
+/**
+ * Frees the extras of one of a history's ticks
+ *
+ * @param history The history
+ * @param slot Where the tick is in the history's rings
+ */
+void free_tick_extras(history_t *history, int slot);
+
+/**
+ * Counts bytes just added to the newest tick's extras, throwing away the
+ * oldest ticks until the extras fit again. If the newest tick's don't fit by
+ * themselves, it's thrown away too and nothing more is logged until the next
+ * tick
+ *
+ * @param history The history
+ * @param added How many bytes were added
+ */
+void fit_extras(history_t *history, size_t added);
+
+/**
+ * Adds bytes to the end of some extras
+ *
+ * @param extras The extras
+ * @param data The bytes to add
+ * @param size How many bytes to add
+ */
+void put_extra(extras_t *extras, const void *data, size_t size);
+
+/**
+ * Reads bytes from some extras
+ *
+ * @param extras The extras
+ * @param offset Where to read from, which is moved past what's read
+ * @param data Where to put the bytes
+ * @param size How many bytes to read
+ */
+void get_extra(const extras_t *extras, size_t *offset, void *data,
+               size_t size);
+
+/**
+ * Saves a grid's ejecta into some extras
+ *
+ * @param ejecta The ejecta
+ * @param extras The extras to add them to
+ */
+void save_ejecta(const ejecta_t *ejecta, extras_t *extras);
+
+/**
+ * Puts back ejecta saved with save_ejecta, replacing the ones there are now
+ *
+ * @param ejecta The ejecta
+ * @param extras The extras they were saved in
+ * @param offset Where they start (after their type), which is moved past them
+ */
+void load_ejecta(ejecta_t *ejecta, const extras_t *extras, size_t *offset);
+
+/**
+ * Saves the rows of a coarse field that have anything in them into some
+ * extras
+ *
+ * @param field The field
+ * @param type Which of the grid's fields it is (eg, EXTRA_HEAT)
+ * @param extras The extras to add it to
+ */
+void save_field(const coarse_field_t *field, extra_type type,
+                extras_t *extras);
+
+/**
+ * Puts back a coarse field saved with save_field. The rows that weren't saved
+ * are emptied
+ *
+ * @param field The field
+ * @param extras The extras it was saved in
+ * @param offset Where it starts (after its type), which is moved past it
+ */
+void load_field(coarse_field_t *field, const extras_t *extras,
+                size_t *offset);
+
+/**
+ * Saves the cells of a coarse field that are different from a copy of it
+ * taken earlier into some extras, as they are in the copy, then brings the
+ * copy up to date
+ *
+ * @param field The field
+ * @param saved The earlier copy of the field
+ * @param type Which of the grid's fields it is (eg, EXTRA_HEAT_CHANGES)
+ * @param extras The extras to add it to
+ */
+void save_field_changes(const coarse_field_t *field, coarse_field_t *saved,
+                        extra_type type, extras_t *extras);
+
+/**
+ * Takes a copy of a coarse field back to how it was before the changes saved
+ * with save_field_changes
+ *
+ * @param saved The copy of the field
+ * @param extras The extras they were saved in
+ * @param offset Where they start (after their type), which is moved past them
+ */
+void load_field_changes(coarse_field_t *saved, const extras_t *extras,
+                        size_t *offset);
+
+/**
+ * Saves the wind gas reads into some extras, along with whether it and the
+ * solver's wind are still
+ *
+ * @param wind The wind field
+ * @param extras The extras to add it to
+ */
+void save_wind(wind_field_t *wind, extras_t *extras);
+
+/**
+ * Saves the solver's wind into some extras
+ *
+ * @param wind The wind field
+ * @param handed Whether the solver's wind was handed to the gas, so it's
+ * saved from vx and vy instead of solver_vx and solver_vy
+ * @param extras The extras to add it to
+ */
+void save_wind_solver(wind_field_t *wind, bool handed, extras_t *extras);
+
+/**
+ * Puts back the wind saved with save_wind. The solver's wind is taken back
+ * from the wind gas reads, which is what step_wind handed it, and a piece
+ * saved with save_wind_solver after this one replaces it
+ *
+ * @param wind The wind field
+ * @param extras The extras it was saved in
+ * @param offset Where it starts (after its type), which is moved past it
+ */
+void load_wind(wind_field_t *wind, const extras_t *extras, size_t *offset);
+
+/**
+ * Puts back the solver's wind saved with save_wind_solver
+ *
+ * @param wind The wind field
+ * @param extras The extras it was saved in
+ * @param offset Where it starts (after its type), which is moved past it
+ */
+void load_wind_solver(wind_field_t *wind, const extras_t *extras,
+                      size_t *offset);
+
+/**
+ * Saves everything about a grid that isn't in its cells and is saved whole at
+ * the start of every tick (eg, the ejecta) into some extras
+ *
+ * @param grid The grid of particles
+ * @param extras The extras to add it to
+ */
+void save_extras(const grid_t *grid, extras_t *extras);
+
+/**
+ * Puts back every piece saved in some extras. Whatever isn't in them is left
+ * as it is
+ *
+ * @param grid The grid of particles
+ * @param extras The extras
+ */
+void load_extras(grid_t *grid, const extras_t *extras);
+
+/**
+ * Logs the particle at the input coordinates into the current tick's delta.
+ * set_particle and swap_particles already do this, so this only needs to be
+ * called before changing a particle directly through its pointer (eg,
+ * setting its element type)
+ *
+ * @param grid The grid of particles
+ * @param x The x-coordinate in the particle array
+ * @param y The y-coordinate in the particle array
+ */
+void record_particle(grid_t *grid, int x, int y);
+
+/**
+ * Logs a cell into the current tick's delta as it was before its mass was
+ * changed in pressure mode, which update_pressure does without going through
+ * set_particle
+ *
+ * @param grid The grid of particles
+ * @param x The x-coordinate in the particle array
+ * @param y The y-coordinate in the particle array
+ * @param mass The mass the cell had before
+ */
+void record_mass(grid_t *grid, int x, int y, float mass);
+
+/**
+ * Saves the wind into the current tick's extras before it's changed for the
+ * first time that tick. The solver's wind is left out when stepping, since
+ * step_wind hands it over to the gas where it's still there to put back
+ * unless something else changes the wind later in the tick
+ *
+ * @param grid The grid of particles
+ * @param stepping Whether it's step_wind that's about to change it
+ */
+void record_wind(grid_t *grid, bool stepping);
+
+/**
+ * Undoes the most recent tick in the grid's history
+ *
+ * @param grid The grid of particles
+ * @return A boolean indicating if there was a tick to undo
+ */
+bool step_back_history(grid_t *grid);
+
+/**
+ * Jumps back to the newest keyframe at or before the current tick, dropping
+ * every tick after it
+ *
+ * @param grid The grid of particles
+ * @return A boolean indicating if there was a keyframe to restore
+ */
+bool restore_keyframe(grid_t *grid);
+
+/**
+ * Checks if the particle type is "EMPTY"
+ *
+ * @param particle The particle to check
+ * @return A boolean indicating if the particle is empty
+ */
+bool is_particle_empty(const particle_t *particle);
+
+/**
+ * Checks if the particle's element type is "STATIC"
+ *
+ * @param particle The particle to check
+ * @return A boolean indicating if the particle is static
+ */
+bool is_particle_static(const particle_t *particle);
+
+/**
+ * Checks if the particle's element type is "SOLID"
+ *
+ * @param particle The particle to check
+ * @return A boolean indicating if the particle is solid
+ */
+bool is_particle_solid(const particle_t *particle);
+
+/**
+ * Checks if the particle's element type is "LIQUID"
+ *
+ * @param particle The particle to check
+ * @return A boolean indicating if the particle is liquid
+ */
+bool is_particle_liquid(const particle_t *particle);
+
+/**
+ * Checks if the particle's element type is "GAS"
+ *
+ * @param particle The particle to check
+ * @return A boolean indicating if the particle is gas
+ */
+bool is_particle_gas(const particle_t *particle);
+
+/**
+ * Checks if the particle type in the array at the input coordinates is "EMPTY"
+ * @note This function does bounds checking. Coordinates outside of the grid
+ * (ie, less than 0 or greater than width/height) are considered "occupied".
+ * This is so the particles don't flow outside the bounds of the game window
+ *
+ * @param grid The grid of particles
+ * @param x The x-coordinate in the particle array
+ * @param y The y-coordinate in the particle array
+ * @return A boolean indicating if the particle is empty
+ */
+bool is_pos_empty(const grid_t *grid, int x, int y);
+
+/**
+ * Checks if the particle type in the array at the input coordinates is "STATIC"
+ *
+ * @param grid The grid of particles
+ * @param x The x-coordinate in the particle array
+ * @param y The y-coordinate in the particle array
+ * @return A boolean indicating if the particle is static
+ */
+bool is_pos_static(const grid_t *grid, int x, int y);
+
+/**
+ * Checks if the particle type in the array at the input coordinates is "SOLID"
+ *
+ * @param grid The grid of particles
+ * @param x The x-coordinate in the particle array
+ * @param y The y-coordinate in the particle array
+ * @return A boolean indicating if the particle is solid
+ */
+bool is_pos_solid(const grid_t *grid, int x, int y);
+
+/**
+ * Checks if the particle type in the array at the input coordinates is "LIQUID"
+ *
+ * @param grid The grid of particles
+ * @param x The x-coordinate in the particle array
+ * @param y The y-coordinate in the particle array
+ * @return A boolean indicating if the particle is liquid
+ */
+bool is_pos_liquid(const grid_t *grid, int x, int y);
+
+/**
+ * Checks if the particle type in the array at the input coordinates is "GAS"
+ *
+ * @param grid The grid of particles
+ * @param x The x-coordinate in the particle array
+ * @param y The y-coordinate in the particle array
+ * @return A boolean indicating if the particle is gas
+ */
+bool is_pos_gas(const grid_t *grid, int x, int y);
+
+/**
+ * The update function for empty particles
+ *
+ * @param grid The grid of particles
+ * @param x The x-coordinate in the particle array
+ * @param y The y-coordinate in the particle array
+ */
+void update_empty(grid_t *grid, int x, int y);
+
+/**
+ * The update function for sand particles
+ *
+ * @param grid The grid of particles
+ * @param x The x-coordinate in the particle array of the sand
+ * @param y The y-coordinate in the particle array of the sand
+ */
+void update_sand(grid_t *grid, int x, int y);
+
+/**
+ * The update function for water particles
+ *
+ * @param grid The grid of particles
+ * @param x The x-coordinate in the particle array of the water
+ * @param y The y-coordinate in the particle array of the water
+ */
+void update_water(grid_t *grid, int x, int y);
+
+/**
+ * The update function for smoke particles
+ *
+ * @param grid The grid of particles
+ * @param x The x-coordinate in the particle array of the smoke
+ * @param y The y-coordinate in the particle array of the smoke
+ */
+void update_smoke(grid_t *grid, int x, int y);
+
+/**
+ * The update function for oil particles
+ *
+ * @param grid The grid of particles
+ * @param x The x-coordinate in the particle array of the oil
+ * @param y The y-coordinate in the particle array of the oil
+ */
+void update_oil(grid_t *grid, int x, int y);
+
+/**
+ * The update function for wall particles
+ *
+ * @param grid The grid of particles
+ * @param x The x-coordinate in the particle array of the wall
+ * @param y The y-coordinate in the particle array of the wall
+ */
+void update_wall(grid_t *grid, int x, int y);
+
+/**
+ * The update function for wood particles
+ *
+ * @param grid The grid of particles
+ * @param x The x-coordinate in the particle array of the wood
+ * @param y The y-coordinate in the particle array of the wood
+ */
+void update_wood(grid_t *grid, int x, int y);
+
+/**
+ * The update function for burning particles
+ *
+ * @param grid The grid of particles
+ * @param x The x-coordinate in the particle array of the fire
+ * @param y The y-coordinate in the particle array of the fire
+ */
+void update_fire(grid_t *grid, int x, int y);
+
+/**
+ * The update function for flame particles
+ *
+ * @param grid The grid of particles
+ * @param x The x-coordinate in the particle array of the flame
+ * @param y The y-coordinate in the particle array of the flame
+ */
+void update_flame(grid_t *grid, int x, int y);
+
+/**
+ * The update function for gunpowder particles. It falls like sand and goes
+ * off if it touches fire or flame or gets hot enough
+ *
+ * @param grid The grid of particles
+ * @param x The x-coordinate in the particle array of the gunpowder
+ * @param y The y-coordinate in the particle array of the gunpowder
+ */
+void update_powder(grid_t *grid, int x, int y);
+
+/**
+ * The update function for wire and battery particles. Batteries are wire
+ * that's always powered. While it's powered, it sets off gunpowder next to it
+ * and sets wood and oil next to it alight
+ *
+ * @param grid The grid of particles
+ * @param x The x-coordinate in the particle array of the wire
+ * @param y The y-coordinate in the particle array of the wire
+ */
+void update_wire(grid_t *grid, int x, int y);
+
+/**
+ * Checks if the particle at the input coordinates is in a powered circuit
+ *
+ * @param grid The grid of particles
+ * @param x The x-coordinate in the particle array
+ * @param y The y-coordinate in the particle array
+ * @return Whether it is, which is never if circuits aren't being tracked
+ */
+bool is_powered(const grid_t *grid, int x, int y);
+
+/**
+ * Turns a burning material's particle into fire, keeping its velocity
+ *
+ * @param grid The grid of particles
+ * @param x The x-coordinate in the particle array
+ * @param y The y-coordinate in the particle array
+ * @param e The element type the fire keeps from what was burning
+ */
+void ignite_particle(grid_t *grid, int x, int y, element_type e);
+
+/**
+ * Starts a particle that just fell straight down into (x, y) flying if there's
+ * nothing under it, so it speeds up from the next tick on (see fly_particle)
+ *
+ * @param grid The grid of particles
+ * @param x The x-coordinate in the particle array of the particle
+ * @param y The y-coordinate in the particle array of the particle
+ */
+void start_falling(grid_t *grid, int x, int y);
+
+/**
+ * Moves a flying particle (one with a velocity) for a tick. Gravity is added
+ * to its velocity, then it goes along the line to where the velocity takes it
+ * until it gets there or the next cell on the line is full. If it's stopped
+ * it has landed and its velocity is dropped, so it goes back to the normal
+ * rules
+ *
+ * @param grid The grid of particles
+ * @param x The x-coordinate in the particle array of the particle
+ * @param y The y-coordinate in the particle array of the particle
+ * @return A boolean indicating if the particle was moved. If it wasn't (it
+ * doesn't have a velocity or it landed without moving), it still has to be
+ * updated the normal way
+ */
+bool fly_particle(grid_t *grid, int x, int y);
+
+/**
+ * Sets up an empty list of ejecta
+ *
+ * @param ejecta The ejecta
+ */
+void init_ejecta(ejecta_t *ejecta);
+
+/**
+ * Makes room for more ejecta, keeping the ones that are already there
+ *
+ * @param ejecta The ejecta
+ * @param capacity How many particles there has to be room for
+ * @return A boolean indicating if the room could be allocated
+ */
+bool reserve_ejecta(ejecta_t *ejecta, size_t capacity);
+
+/**
+ * Copies a list of ejecta into another one, reusing its memory if it's big
+ * enough
+ *
+ * @param dest The ejecta to copy into
+ * @param src The ejecta to copy
+ * @return A boolean indicating if the copy worked (it only fails if memory
+ * couldn't be allocated)
+ */
+bool copy_ejecta(ejecta_t *dest, const ejecta_t *src);
+
+/**
+ * Throws the particle at the input coordinates out of the grid and into the
+ * ejecta. It keeps its timer but not its velocity, which is replaced by the
+ * one it's thrown with
+ *
+ * @param grid The grid of particles
+ * @param x The x-coordinate in the particle array
+ * @param y The y-coordinate in the particle array
+ * @param velocity The velocity it's thrown with in cells per tick
+ */
+void launch_particle(grid_t *grid, int x, int y, Vector2 velocity);
+
+/**
+ * Moves the ejecta on a tick. All of them get gravity and move first, then
+ * each one's path is walked over the occupancy plane to check if it hit
+ * something. The ones that did are put back into the grid in the last empty
+ * cell before what they hit (see land_ejecta). Ejecta can fly above the top of
+ * the grid, but the sides and bottom stop them
+ *
+ * @param grid The grid of particles
+ */
+void update_ejecta(grid_t *grid);
+
+/**
+ * Puts one of the ejecta back into the grid and takes it off the list. If the
+ * cell has been filled since it got there, it goes in the first empty cell
+ * above it instead, or stays flying just above the grid if the column's full
+ *
+ * @param grid The grid of particles
+ * @param i Which of the ejecta it is
+ * @param x The x-coordinate in the particle array of where it lands
+ * @param y The y-coordinate in the particle array of where it lands
+ * @return A boolean indicating if it landed. If it did, the last of the
+ * ejecta has been moved into spot i
+ */
+bool land_ejecta(grid_t *grid, size_t i, int x, int y);
+
+/**
+ * Finds how far a liquid at the input coordinates can flow sideways in one
+ * go. It goes along the empty cells in the row, up to rate of them. If that
+ * takes it past an edge, it falls from there on the next tick
+ *
+ * @param grid The grid of particles
+ * @param x The x-coordinate in the particle array of the liquid
+ * @param y The y-coordinate in the particle array of the liquid
+ * @param direction -1 to look left or 1 to look right
+ * @param rate The most cells it can flow (see dispersion_rates)
+ * @return The x-coordinate it can flow to, which is x if it can't flow
+ */
+int find_dispersal(const grid_t *grid, int x, int y, int direction, int rate);
+
+/**
+ * Turns pressure mode for water on or off (see update_pressure). Turning it
+ * on fills every water cell to 1
+ *
+ * @param grid The grid of particles
+ * @param enabled Whether water should be in pressure mode
+ */
+void set_pressure_water(grid_t *grid, bool enabled);
+
+/**
+ * Gets how much water is in a cell in pressure mode
+ * @note This doesn't do bounds checking
+ *
+ * @param grid The grid of particles
+ * @param x The x-coordinate in the particle array
+ * @param y The y-coordinate in the particle array
+ * @return The cell's mass
+ */
+float get_mass(const grid_t *grid, int x, int y);
+
+/**
+ * Sets how much water is in a cell in pressure mode
+ * @note This doesn't do bounds checking
+ *
+ * @param grid The grid of particles
+ * @param x The x-coordinate in the particle array
+ * @param y The y-coordinate in the particle array
+ * @param mass The cell's new mass
+ */
+void set_mass(grid_t *grid, int x, int y, float mass);
+
+/**
+ * Gets a row of masses in pressure mode so they can be changed. If the row's
+ * chunk is shared, it's copied first
+ *
+ * @param grid The grid of particles
+ * @param y The y-coordinate of the row
+ * @return The row's masses, width of them in a plain run
+ */
+float *get_mass_row(grid_t *grid, int y);
+
+/**
+ * Moves the water in pressure mode. Instead of being moved one particle at a
+ * time, each cell holds some amount of water (mass) and water flows between
+ * neighboring cells. Cells lower down can hold a little more than the ones
+ * above them (PRESSURE_COMPRESSION), so the water at the bottom of a column is
+ * under pressure and pushes water up the other side of a U-tube until both
+ * sides are level. Afterwards, cells with at least PRESSURE_MIN_MASS in them
+ * are water particles and the rest are empty
+ *
+ * Each round of flow evens out pairs of cells: the rows paired up from an
+ * even row, then from an odd row, then the same with columns. Every cell is
+ * only in one pair at a time, so no cell can give away more water than it
+ * has and no water is lost, and the pairs are independent of each other, so
+ * each pass is a straight loop over a row that the compiler can vectorize.
+ * Then the runs of full cells in each row are evened out in one go (see
+ * level_pressure_row)
+ *
+ * Anything that isn't water or empty blocks the water, and only the rows near
+ * a chunk with liquid in it are done
+ *
+ * @param grid The grid of particles
+ */
+void update_pressure(grid_t *grid);
+
+/**
+ * Evens out the water between the cells of two rows, column by column, in
+ * pressure mode. The bottom cell gets all of it up to 1, and past that it
+ * gets PRESSURE_COMPRESSION more than the top one
+ *
+ * @param lower The masses of the lower row
+ * @param upper The masses of the row above it
+ * @param width The number of cells in each row
+ */
+void flow_pressure_rows(float *restrict lower, float *restrict upper,
+                        int width);
+
+/**
+ * Evens out the water between pairs of cells next to each other in a row in
+ * pressure mode
+ *
+ * @param row The masses of the row
+ * @param first Where the first pair starts (0 or 1)
+ * @param width The number of cells in the row
+ */
+void flow_pressure_row(float *row, int first, int width);
+
+/**
+ * Evens out the water in each run of full cells (at least 1) in a row in
+ * pressure mode. The water in a run is all connected at the same depth, so
+ * it ends up at the same pressure anyway, and doing it in one go means the
+ * pressure gets from one side of a big body to the other in a single round
+ * instead of creeping across it a cell at a time
+ *
+ * @param row The masses of the row
+ * @param width The number of cells in the row
+ */
+void level_pressure_row(float *row, int width);
+
+/**
+ * Sets up regions that aren't being tracked yet
+ *
+ * @param regions The regions
+ * @param plane The element (or plane) whose regions they are
+ * @param source The plane whose cells power a region, or -1
+ */
+void init_regions(regions_t *regions, int plane, int source);
+
+/**
+ * Frees regions, which stops them being tracked
+ *
+ * @param regions The regions
+ */
+void free_regions(regions_t *regions);
+
+/**
+ * Makes a grid track one of its sets of regions if another grid tracks the
+ * same set, and stop if it doesn't. The other grid's labels are copied, so
+ * the grid must have the other grid's chunks. Used when a grid's chunks are
+ * swapped out (see fork_grid)
+ *
+ * @param grid The grid of particles
+ * @param regions The grid's regions
+ * @param other The other grid's regions of the same element
+ */
+void match_regions(grid_t *grid, regions_t *regions, const regions_t *other);
+
+/**
+ * Copies the labels and pieces of one chunk's regions over another's
+ *
+ * @param dest The chunk's regions to copy over
+ * @param src The chunk's regions to copy
+ * @param count The number of cells in the chunk
+ */
+void copy_region_chunk(region_chunk_t *dest, const region_chunk_t *src,
+                       size_t count);
+
+/**
+ * Starts tracking a grid's regions, with every chunk to be labelled at the
+ * next update
+ *
+ * @param grid The grid of particles
+ * @param regions The grid's regions of one element
+ */
+void alloc_regions(grid_t *grid, regions_t *regions);
+
+/**
+ * Brings a grid's regions up to date, starting to track them if they aren't
+ * yet. The dirty chunks are labelled on their own, at the same time if
+ * there's a pool to do it on, then the pieces are joined up across the chunk
+ * edges. Nothing is done at all if no chunk is dirty, and otherwise only the
+ * dirty chunks cost more than a look at the pieces of the regions they're in
+ *
+ * @param grid The grid of particles
+ * @param regions The grid's regions of one element
+ * @param pool The worker pool to label the chunks on, or NULL to do it on
+ * this thread (eg, when the grid is already being run on a worker)
+ * @return Whether any chunk had to be labelled again
+ */
+bool update_regions(grid_t *grid, regions_t *regions, worker_pool_t *pool);
+
+/**
+ * Labels the pieces of the regions in one dirty chunk (see update_regions).
+ * It only writes to the chunk's own region_chunk_t, so chunks can be done on
+ * different threads at once
+ *
+ * @param ctx The region_task_t
+ * @param task Which of the pending chunks to label
+ */
+void label_region_chunk(void *ctx, int task);
+
+/**
+ * Makes room for more pieces in one chunk's part of some regions
+ *
+ * @param part The chunk's part
+ */
+void grow_region_chunk(region_chunk_t *part);
+
+/**
+ * Finds the pieces touching across the edge between a chunk and the one
+ * below it again (see the region_chunk_t definition)
+ *
+ * @param grid The grid of particles
+ * @param regions The grid's regions of one element
+ * @param chunk The chunk, which can't be the first
+ */
+void link_region_chunk(grid_t *grid, regions_t *regions, int chunk);
+
+/**
+ * Marks a region to be worked out again in update_regions, along with every
+ * chunk it reaches, unless it already is. It's no longer counted
+ *
+ * @param regions The regions
+ * @param root The id of the region's root
+ */
+void touch_region(regions_t *regions, uint64_t root);
+
+/**
+ * Brings the grid's liquid bodies up to date (see update_regions)
+ *
+ * @param grid The grid of particles
+ * @param pool The worker pool to label the chunks on, or NULL
+ */
+void update_liquid_bodies(grid_t *grid, worker_pool_t *pool);
+
+/**
+ * Finds the root of the set an element is in, halving the path as it goes
+ *
+ * @param parents The parent of each element
+ * @param i The element
+ * @return The root of its set
+ */
+uint32_t find_root(uint32_t *parents, uint32_t i);
+
+/**
+ * Joins the sets two elements are in. The smaller root becomes the root of
+ * both, so a set's root is always its first element
+ *
+ * @param parents The parent of each element
+ * @param a One element
+ * @param b The other element
+ */
+void join_sets(uint32_t *parents, uint32_t a, uint32_t b);
+
+/**
+ * Gets a piece of some regions
+ *
+ * @param regions The regions
+ * @param id The piece's id (look at the region_piece_t definition)
+ * @return The piece
+ */
+region_piece_t *get_piece(const regions_t *regions, uint64_t id);
+
+/**
+ * Finds the root of the region a piece is in, halving the path as it goes
+ *
+ * @param regions The regions
+ * @param id The piece's id
+ * @return The id of the region's root
+ */
+uint64_t find_piece(regions_t *regions, uint64_t id);
+
+/**
+ * Joins the regions two pieces are in. The smaller id becomes the root of
+ * both, so a region's root is always its first piece
+ *
+ * @param regions The regions
+ * @param a One piece's id
+ * @param b The other piece's id
+ */
+void join_pieces(regions_t *regions, uint64_t a, uint64_t b);
+
+/**
+ * Gets the id of the piece of some regions a cell is in as of the last
+ * update_regions
+ *
+ * @param grid The grid of particles
+ * @param regions The regions, which have to be tracked
+ * @param x The x-coordinate in the particle array
+ * @param y The y-coordinate in the particle array
+ * @param id Where to put the piece's id
+ * @return Whether the cell is in one
+ */
+bool get_piece_at(const grid_t *grid, const regions_t *regions, int x, int y,
+                  uint64_t *id);
+
+/**
+ * Gets the liquid body the input coordinates are in as of the last
+ * update_liquid_bodies
+ *
+ * @param grid The grid of particles
+ * @param x The x-coordinate in the particle array
+ * @param y The y-coordinate in the particle array
+ * @return The body, which is one more than the id of its first piece (look at
+ * the region_piece_t definition), or 0 if the cell isn't liquid (or bodies
+ * aren't being tracked)
+ */
+uint64_t get_liquid_body(const grid_t *grid, int x, int y);
+
+/**
+ * Gets how many cells a liquid body has
+ *
+ * @param grid The grid of particles
+ * @param body The body (see get_liquid_body), which can't be 0
+ * @return The number of cells in the body
+ */
+size_t get_liquid_body_volume(const grid_t *grid, uint64_t body);
+
+/**
+ * Turns structural integrity on or off. While it's on, the connected pieces
+ * of static material are tracked and any that aren't anchored to the bottom
+ * of the grid come loose and fall (see collapse_structures)
+ *
+ * @param grid The grid of particles
+ * @param enabled Whether structural integrity should be on
+ */
+void set_structural_integrity(grid_t *grid, bool enabled);
+
+/**
+ * Loosens every piece of static material that isn't connected to the bottom
+ * row any more, so a wall that's been burned or dug out from under falls down.
+ * Only the chunks with a loose piece in them are looked through, and only
+ * after some static material changed
+ *
+ * @param grid The grid of particles
+ */
+void collapse_structures(grid_t *grid);
+
+/**
+ * Turns a static particle into a loose solid one that falls like sand but is
+ * still the same material
+ *
+ * @param grid The grid of particles
+ * @param x The x-coordinate in the particle array
+ * @param y The y-coordinate in the particle array
+ */
+void loosen_particle(grid_t *grid, int x, int y);
+
+/**
+ * Sets up a coarse field with nothing allocated
+ *
+ * @param field The field
+ */
+void init_field(coarse_field_t *field);
+
+/**
+ * Allocates an empty coarse field for a grid
+ *
+ * @param field The field
+ * @param width The width of the grid in particles
+ * @param height The height of the grid in particles
+ */
+void alloc_field(coarse_field_t *field, int width, int height);
+
+/**
+ * Frees a coarse field
+ *
+ * @param field The field
+ */
+void free_field(coarse_field_t *field);
+
+/**
+ * Copies one coarse field's cells into another for the same size grid
+ *
+ * @param dest The field to copy into
+ * @param src The field to copy from
+ */
+void copy_field(coarse_field_t *dest, const coarse_field_t *src);
+
+/**
+ * Creates an empty block for a coarse field
+ *
+ * @param width The width of the field, in field cells
+ * @param height The height of the field, in field cells
+ * @return The block, which the caller holds the only reference to
+ */
+field_block_t *new_field_block(int width, int height);
+
+/**
+ * Lets go of a field block, freeing it once nothing's using it
+ *
+ * @param block The block
+ */
+void release_field_block(field_block_t *block);
+
+/**
+ * Points a coarse field's arrays into a block it holds the only reference to,
+ * in order, and lets go of the block it had
+ *
+ * @param field The field
+ * @param block The block
+ */
+void set_field_block(coarse_field_t *field, field_block_t *block);
+
+/**
+ * Makes one coarse field the same as another's for the same size grid,
+ * sharing its block until either of them changes it
+ *
+ * @param dest The field to point
+ * @param src The field to share the block of
+ */
+void share_field(coarse_field_t *dest, const coarse_field_t *src);
+
+/**
+ * Gives a coarse field its own copy of its cells if it's sharing them, so they
+ * can be changed
+ *
+ * @param field The field
+ */
+void unshare_field(coarse_field_t *field);
+
+/**
+ * Empties a coarse field completely
+ *
+ * @param field The field
+ */
+void clear_field(coarse_field_t *field);
+
+/**
+ * Adds to the field cell a particle is in
+ *
+ * @param field The field
+ * @param x The x-coordinate in the particle array
+ * @param y The y-coordinate in the particle array
+ * @param amount How much to add
+ */
+void add_to_field(coarse_field_t *field, int x, int y, float amount);
+
+/**
+ * Gets the field cell a particle is in
+ *
+ * @param field The field
+ * @param x The x-coordinate in the particle array
+ * @param y The y-coordinate in the particle array
+ * @return How much is in the field cell
+ */
+float get_field(const coarse_field_t *field, int x, int y);
+
+/**
+ * Spreads the heat out and cools it off a little. The rows are split into
+ * bands of HEAT_BAND_ROWS that are diffused at the same time if the grid has
+ * a pool. Nothing is done at all while the grid is cold
+ *
+ * @param grid The grid of particles
+ */
+void update_heat(grid_t *grid);
+
+/**
+ * Diffuses one band of heat rows into the next heat (see update_heat). Bands
+ * only write to their own rows, so they can be done on different threads
+ *
+ * @param ctx The grid
+ * @param task Which band to diffuse
+ */
+void diffuse_heat_band(void *ctx, int task);
+
+/**
+ * Works out the next heat of one row of heat cells from it and the rows above
+ * and below it. The edges of the field don't let any heat out. It's a plain
+ * loop over floats with no branches so that it vectorizes
+ *
+ * @param out Where the row's next heat goes
+ * @param row The heat of the row
+ * @param below The heat of the row below, or row itself at the bottom
+ * @param above The heat of the row above, or row itself at the top
+ * @param width The number of cells in the row
+ * @return Whether any heat is left in the row
+ */
+bool diffuse_heat_row(float *restrict out, const float *restrict row,
+                      const float *restrict below, const float *restrict above,
+                      int width);
+
+/**
+ * Creates a still wind field for a grid, without a thread
+ *
+ * @param width The width of the grid in particles
+ * @param height The height of the grid in particles
+ * @return The wind field
+ */
+wind_field_t *new_wind_field(int width, int height);
+
+/**
+ * Sets up a wind field with no wind in it yet, without a thread
+ *
+ * @param wind The wind field
+ * @param width The width of the wind field, in wind cells
+ * @param height The height of the wind field, in wind cells
+ */
+void init_wind_field(wind_field_t *wind, int width, int height);
+
+/**
+ * Creates a wind field that shares another's wind until either of them
+ * changes it, without a thread. Used by fork_grid, so it's cheap however big
+ * the grid is
+ *
+ * @param wind The wind field to share
+ * @return The new wind field
+ */
+wind_field_t *fork_wind_field(wind_field_t *wind);
+
+/**
+ * Creates a block for the wind of a wind field with count wind cells, with
+ * the wind still
+ *
+ * @param count How many wind cells the wind field has
+ * @return The block, which the caller holds the only reference to
+ */
+wind_block_t *new_wind_block(size_t count);
+
+/**
+ * Lets go of a wind block, freeing it once nothing's using it
+ *
+ * @param block The block
+ */
+void release_wind_block(wind_block_t *block);
+
+/**
+ * Points a wind field's wind into a block it holds the only reference to, in
+ * order, and lets go of the block it had
+ *
+ * @param wind The wind field
+ * @param block The block
+ */
+void set_wind_block(wind_field_t *wind, wind_block_t *block);
+
+/**
+ * Points a wind field's wind at the same block as another's
+ *
+ * @param dest The wind field to point
+ * @param src The wind field to share the block of
+ */
+void share_wind_block(wind_field_t *dest, const wind_field_t *src);
+
+/**
+ * Gives a wind field its own copy of its wind if it's sharing it, so it can
+ * be changed. The solver mustn't be working on it
+ *
+ * @param wind The wind field
+ */
+void unshare_wind(wind_field_t *wind);
+
+/**
+ * Allocates what the solver works in, if the wind field doesn't have it yet
+ *
+ * @param wind The wind field
+ */
+void alloc_wind_scratch(wind_field_t *wind);
+
+/**
+ * Stops a wind field's thread if it has one and frees it
+ *
+ * @param wind The wind field
+ */
+void destroy_wind_field(wind_field_t *wind);
+
+/**
+ * Gives a wind field its own thread to run the solver on
+ *
+ * @param wind The wind field
+ */
+void start_wind_thread(wind_field_t *wind);
+
+/**
+ * The wind thread. It waits for step_wind to hand it a tick, works it out and
+ * waits again until the wind field is destroyed
+ *
+ * @param arg The wind field
+ * @return NULL
+ */
+void *wind_main(void *arg);
+
+/**
+ * Waits for the wind solver to finish the tick it's on, if it's on one
+ *
+ * @param wind The wind field
+ */
+void wait_wind(wind_field_t *wind);
+
+/**
+ * Makes one wind field's wind the same as another's for the same size grid,
+ * sharing it until either of them changes it
+ *
+ * @param dest The wind field to copy into
+ * @param src The wind field to copy from
+ */
+void copy_wind_field(wind_field_t *dest, wind_field_t *src);
+
+/**
+ * Stops the wind completely
+ *
+ * @param wind The wind field
+ */
+void clear_wind(wind_field_t *wind);
+
+/**
+ * Moves the wind on a tick at the end of update_grid. It waits for the solver
+ * to finish the last tick, hands that wind over to the gas, then starts the
+ * solver on the next one from the heat. The solver is run straight away if
+ * the wind field doesn't have a thread, and not at all while it's calm and
+ * the grid is cold
+ *
+ * @param grid The grid of particles
+ */
+void step_wind(grid_t *grid);
+
+/**
+ * Works out the wind a tick on: hot air rises, the wind carries itself along
+ * and the pressure pushes it around instead of letting it pile up, then it
+ * slows down a little
+ *
+ * @param wind The wind field
+ */
+void solve_wind(wind_field_t *wind);
+
+/**
+ * Samples part of the wind between wind cells, blending the four around it
+ *
+ * @param v One part of the wind
+ * @param width The width of the wind field
+ * @param height The height of the wind field
+ * @param x The x-coordinate in wind cells, which is kept inside the field
+ * @param y The y-coordinate in wind cells, which is kept inside the field
+ * @return The blended wind
+ */
+float sample_wind(const float *v, int width, int height, float x, float y);
+
+/**
+ * Keeps part of the wind under WIND_MAX_SPEED either way
+ *
+ * @param v The part of the wind
+ * @return The wind limited to WIND_MAX_SPEED
+ */
+float clamp_wind(float v);
+
+/**
+ * Gets the wind blowing on a particle
+ *
+ * @param grid The grid of particles
+ * @param x The x-coordinate in the particle array
+ * @param y The y-coordinate in the particle array
+ * @return The wind, in cells per tick
+ */
+Vector2 get_wind(const grid_t *grid, int x, int y);
+
+/**
+ * Rounds a number of cells to a whole number at random, so that the fraction
+ * is how likely it is to go a cell further
+ *
+ * @param grid The grid of particles
+ * @param v The number of cells
+ * @return The whole number of cells
+ */
+int round_randomly(grid_t *grid, float v);
+
+/**
+ * Moves a gas particle with the wind, as far along the way as it can go
+ *
+ * @param grid The grid of particles
+ * @param x The x-coordinate in the particle array
+ * @param y The y-coordinate in the particle array
+ * @return Whether the wind moved it, which it doesn't if it's calm or the
+ * way is blocked
+ */
+bool blow_gas(grid_t *grid, int x, int y);
+
+/**
+ * Turns a smoke particle into smoke in the smoke field
+ *
+ * @param grid The grid of particles
+ * @param x The x-coordinate in the particle array
+ * @param y The y-coordinate in the particle array
+ */
+void absorb_smoke(grid_t *grid, int x, int y);
+
+/**
+ * Checks if a smoke field cell is at the edge of the thick smoke, where it
+ * lets particles back out
+ *
+ * @param smoke The smoke field
+ * @param x The x-coordinate in field cells
+ * @param y The y-coordinate in field cells
+ * @return Whether any cell next to it isn't thick
+ */
+bool is_smoke_edge(const coarse_field_t *smoke, int x, int y);
+
+/**
+ * Counts how many of a field cell's particles have an element
+ *
+ * @param grid The grid of particles
+ * @param plane The element
+ * @param x The x-coordinate in field cells
+ * @param y The y-coordinate in field cells
+ * @return How many of the cell's particles are that element
+ */
+int count_field_cell(const grid_t *grid, int plane, int x, int y);
+
+/**
+ * Moves the smoke field a tick on. Thick smoke is kept as a field instead of
+ * particles, so a big plume costs a fixed amount per field cell instead of a
+ * full update per particle. The field rises and drifts with the wind,
+ * thinning out as it goes, and lets particles back out at its edges and
+ * wherever it's thin
+ *
+ * @param grid The grid of particles
+ */
+void update_smoke_field(grid_t *grid);
+
+/**
+ * Moves some smoke into the next smoke field, split between the four cells
+ * around where it ends up. Any part that would end up in a cell with static
+ * particles stays where it was instead
+ *
+ * @param grid The grid of particles
+ * @param x The x-coordinate of the cell it's from in field cells
+ * @param y The y-coordinate of the cell it's from in field cells
+ * @param to_x The x-coordinate it ends up at in field cells
+ * @param to_y The y-coordinate it ends up at in field cells
+ * @param amount How much smoke
+ */
+void spread_smoke(grid_t *grid, int x, int y, float to_x, float to_y,
+                  float amount);
+
+/**
+ * Lets smoke particles out of a smoke field cell into empty spots in it
+ *
+ * @param grid The grid of particles
+ * @param x The x-coordinate in field cells
+ * @param y The y-coordinate in field cells
+ * @param count How many particles to let out
+ * @return How many were let out, which is fewer if it's crowded
+ */
+int release_smoke(grid_t *grid, int x, int y, int count);
+
+/**
+ * Adds up everything in a coarse field
+ *
+ * @param field The field
+ * @return The total
+ */
+double get_field_total(const coarse_field_t *field);
+
+/**
+ * Sets up an empty queue of blasts and works out the rays they cast
+ *
+ * @param blasts The blasts
+ */
+void init_blasts(blasts_t *blasts);
+
+/**
+ * Frees a queue of blasts, leaving it empty
+ *
+ * @param blasts The blasts
+ */
+void free_blasts(blasts_t *blasts);
+
+/**
+ * Copies the blasts waiting to go off into another queue
+ *
+ * @param dest The blasts to copy into
+ * @param src The blasts to copy
+ * @return A boolean indicating if the copy worked (it only fails if memory
+ * couldn't be allocated)
+ */
+bool copy_blasts(blasts_t *dest, const blasts_t *src);
+
+/**
+ * Sets off an explosive particle. It's removed right away and its blast goes
+ * off at the end of the tick (see update_blasts)
+ *
+ * @param grid The grid of particles
+ * @param x The x-coordinate in the particle array
+ * @param y The y-coordinate in the particle array
+ */
+void detonate_particle(grid_t *grid, int x, int y);
+
+/**
+ * Sets off every blast that's queued. Each one casts rays out from where it
+ * is over the occupancy plane, which get weaker with distance and with
+ * everything they go through. Walls only weaken them, gas is blown away,
+ * explosives are set off to go off next tick and everything else is thrown
+ * outwards as ejecta, faster the stronger the ray still is. The blast leaves
+ * a flame and a lot of heat where it was
+ *
+ * @param grid The grid of particles
+ */
+void update_blasts(grid_t *grid);
+
+/**
+ * Casts one queued blast's rays and stores what they hit (look at the
+ * blasts_t definition). It only reads the grid, so any number of them can run
+ * at once
+ *
+ * @param ctx The grid
+ * @param task Which of the queued blasts to cast
+ */
+void cast_blast(void *ctx, int task);
+
+/**
+ * Turns lighting on or off. Lighting starts dark and lights up from the next
+ * tick on
+ *
+ * @param grid The grid of particles
+ * @param enabled Whether it should be on
+ */
+void set_lighting(grid_t *grid, bool enabled);
+
+/**
+ * Creates a dark light map for a grid
+ *
+ * @param width The width of the grid in particles
+ * @param height The height of the grid in particles
+ * @return The new light map
+ */
+light_map_t *new_light_map(int width, int height);
+
+/**
+ * Sets up a light map with no light in it yet, without a thread
+ *
+ * @param light The light map
+ * @param width The width of the light map, in light map cells
+ * @param height The height of the light map, in light map cells
+ */
+void init_light_map(light_map_t *light, int width, int height);
+
+/**
+ * Creates a light map that shares another's light until either of them is
+ * stepped, without a thread. Used by fork_grid, so it's cheap however big the
+ * grid is
+ *
+ * @param light The light map to share
+ * @return The new light map
+ */
+light_map_t *fork_light_map(light_map_t *light);
+
+/**
+ * Creates a dark block for a light map with count light map cells
+ *
+ * @param count How many cells the light map has
+ * @return The block, which the caller holds the only reference to
+ */
+light_block_t *new_light_block(size_t count);
+
+/**
+ * Lets go of a light block, freeing it once nothing's using it
+ *
+ * @param block The block
+ */
+void release_light_block(light_block_t *block);
+
+/**
+ * Points a light map's arrays into a block, in order, and lets go of the
+ * block it had
+ *
+ * @param light The light map
+ * @param block The block
+ */
+void set_light_block(light_map_t *light, light_block_t *block);
+
+/**
+ * Gives a light map its own copy of its light if it's sharing it, so it can
+ * be changed
+ *
+ * @param light The light map
+ */
+void unshare_light(light_map_t *light);
+
+/**
+ * Destroys a light map, stopping its thread if it has one
+ *
+ * @param light The light map
+ */
+void destroy_light_map(light_map_t *light);
+
+/**
+ * Starts a thread for a light map so it's worked out while the grid is
+ * updated. Without one, it's worked out at the end of each tick instead
+ *
+ * @param light The light map
+ */
+void start_light_thread(light_map_t *light);
+
+/**
+ * The function the light thread runs
+ *
+ * @param arg The light map
+ * @return Nothing
+ */
+void *light_main(void *arg);
+
+/**
+ * Waits for the light thread to finish the tick it's working on, if it is
+ *
+ * @param light The light map
+ */
+void wait_light(light_map_t *light);
+
+/**
+ * Makes one light map's light the same as another's for the same size grid,
+ * sharing it until either of them is stepped
+ *
+ * @param dest The light map to copy into
+ * @param src The light map to copy from
+ */
+void copy_light_map(light_map_t *dest, light_map_t *src);
+
+/**
+ * Counts a burning particle towards the light in its light map cell
+ *
+ * @param grid The grid of particles
+ * @param x The x-coordinate in the particle array
+ * @param y The y-coordinate in the particle array
+ */
+void add_light(grid_t *grid, int x, int y);
+
+/**
+ * Moves the light map a tick on. The last tick's light is shown, then what
+ * lights up each cell and what blocks light are worked out again from the
+ * grid, and the cells where either changed are handed to relight
+ *
+ * @param grid The grid of particles
+ */
+void step_light(grid_t *grid);
+
+/**
+ * Works out the light levels again around the cells that changed (look at
+ * the light_map_t definition)
+ *
+ * @param light The light map
+ */
+void relight(light_map_t *light);
+
+/**
+ * Puts a light map cell in the queue of cells to spread light out from, if
+ * it isn't already
+ *
+ * @param light The light map
+ * @param cell The index of the cell
+ */
+void queue_light(light_map_t *light, int cell);
+
+/**
+ * Gets the four cells next to a light map cell
+ *
+ * @param light The light map
+ * @param cell The index of the cell
+ * @param near Where the indices are put, left, right, below and above, with
+ * -1 for the ones off the edge of the map
+ */
+void get_light_neighbors(const light_map_t *light, int cell, int near[4]);
+
+/**
+ * Gets how bright the light is at a particle
+ *
+ * @param light The light map
+ * @param x The x-coordinate in the particle array
+ * @param y The y-coordinate in the particle array
+ * @return The light level from 0 to LIGHT_MAX
+ */
+int get_light(const light_map_t *light, int x, int y);
+
+/**
+ * The update function for each material. The update function lookup allows
+ * us to have any number of particle types without having to create new cases
+ * in a switch statement whenever we want to add something. We simply have to
+ * call the current particle's function whenever we update it.
+ */
+const update_funcptr update_funcs[MAT_COUNT] = {
+    update_empty,
+    update_sand,
+    update_water,
+    update_smoke,
+    update_oil,
+    update_wall,
+    update_wood,
+    update_fire,
+    update_flame,
+    update_powder,
+    update_wire,
+    update_wire
+};
+
+/**
+ * How many cells each liquid can flow sideways in one tick when it can't fall
+ * (see find_dispersal). The higher it is, the quicker a body of it levels out.
+ * None of them can be more than MAX_DISPERSION
+ */
+const int dispersion_rates[MAT_COUNT] = {
+    [MAT_WATER] = 6,
+    [MAT_OIL] = 3
+};
+
+/**
+ * Sets the current drawing material to the next type
+ *
+ * @param m The current material
+ * @return The new material type
+ */
+material_type next_material(material_type m);
+
+/**
+ * Sets the current drawing material to the previous type
+ *
+ * @param m The current material
+ * @return The new material type
+ */
+material_type prev_material(material_type m);
+
+/**
+ * Gets the color of a material
+ *
+ * @param m The material
+ * @return The color of the material
+ */
+Color get_color_from_mat(material_type m);
+
+/**
+ * Reads a size written like 512x512
+ *
+ * @param str The string to read
+ * @param w Where to put the width
+ * @param h Where to put the height
+ * @return A boolean indicating if the size was valid (both sides from 1 to
+ *         MAX_SIZE)
+ */
+bool parse_size(const char *str, int *w, int *h);
+
+/**
+ * Reads a whole number, which has to be all of the string
+ *
+ * @param str The string to read
+ * @param value Where to put the number
+ * @return A boolean indicating if the number was valid and fits in an int
+ */
+bool parse_int(const char *str, int *value);
+
+/**
+ * Reads a seed, which has to be a whole number from 0 to UINT32_MAX and all of
+ * the string
+ *
+ * @param str The string to read
+ * @param seed Where to put the seed
+ * @return A boolean indicating if the seed was valid
+ */
+bool parse_seed(const char *str, uint32_t *seed);
+
+/**
+ * Fills a framebuffer with the colors of the particles in a view of the grid.
+ * The framebuffer's top row is the view's top row (like raylib) so it can be
+ * uploaded straight into a texture
+ *
+ * @param grid The grid of particles
+ * @param frame The framebuffer, view_w * view_h colors
+ * @param view_x The x-coordinate of the bottom left of the view
+ * @param view_y The y-coordinate of the bottom left of the view
+ * @param view_w The width of the view
+ * @param view_h The height of the view
+ */
+void fill_frame(const grid_t *grid, Color *frame, int view_x, int view_y,
+                int view_w, int view_h);
+
+/**
+ * Gets the color a particle is drawn with. Fire flickers between a few shades
+ * of red
+ *
+ * @param p The particle
+ * @return The color of the particle
+ */
+Color get_particle_color(const particle_t *p);
+
+/**
+ * Gets the name of a material
+ *
+ * @param m The material
+ * @return The name of the material in lowercase
+ */
+const char *get_name_from_mat(material_type m);
+
+/**
+ * Creates a new pool of worker threads
+ *
+ * @param thread_count The number of threads
+ * @return The new pool
+ */
+worker_pool_t *new_worker_pool(int thread_count);
+
+/**
+ * Destroys a pool, waiting for any running tasks and joining the threads
+ *
+ * @param pool The pool to destroy
+ */
+void destroy_worker_pool(worker_pool_t *pool);
+
+/**
+ * Starts running func(ctx, task) for each task from 0 to task_count - 1 on the
+ * pool's threads. This doesn't wait for them to finish (see wait_tasks)
+ *
+ * @param pool The worker pool
+ * @param task_count The number of tasks
+ * @param func The function to run for each task
+ * @param ctx The first argument passed to func
+ */
+void start_tasks(worker_pool_t *pool, int task_count, task_funcptr func,
+                 void *ctx);
+
+/**
+ * Waits for every task started with start_tasks to finish
+ *
+ * @param pool The worker pool
+ */
+void wait_tasks(worker_pool_t *pool);
+
+/**
+ * Starts tasks and waits for them to finish
+ *
+ * @param pool The worker pool
+ * @param task_count The number of tasks
+ * @param func The function to run for each task
+ * @param ctx The first argument passed to func
+ */
+void run_tasks(worker_pool_t *pool, int task_count, task_funcptr func,
+               void *ctx);
+
+/**
+ * The function each worker thread runs
+ *
+ * @param arg The worker pool
+ * @return Nothing
+ */
+void *worker_main(void *arg);
+
+/* The name of each scenario, as given to --scenario */
+const char *scenario_names[SCENARIO_COUNT] = {"fire", "flood", "avalanche"};
+
+/**
+ * Builds the starting scene of a scenario into an empty grid. Everything
+ * random comes from the grid's generator, so seed it first
+ *
+ * @param grid The grid of particles
+ * @param scenario The scenario to build
+ */
+void build_scenario(grid_t *grid, scenario_type scenario);
+
+/**
+ * Runs one world of a batch from start to finish. Used as a pool task
+ *
+ * @param ctx The batch
+ * @param task The world number
+ */
+void run_world_task(void *ctx, int task);
+
+/**
+ * Counts what's in a world for its stats
+ *
+ * @param grid The world's grid
+ * @param stats The stats to fill in
+ */
+void count_world(grid_t *grid, world_stats_t *stats);
+
+/**
+ * Writes the stats of every world in a batch as CSV
+ *
+ * @param file The file to write to
+ * @param batch The batch
+ */
+void write_batch_stats(FILE *file, const batch_t *batch);
+
+/**
+ * Runs the game without a window, simulating a batch of worlds across all the
+ * cores and writing their stats. This is what the --batch option does
+ *
+ * @param argc The argument count from main
+ * @param argv The arguments from main
+ * @return The exit code
+ */
+int batch_main(int argc, char **argv);
+
+int 
+main(int argc, char **argv)
+{
+    int grid_w = 512, grid_h = 512;
+    int scr_w = 0, scr_h = 0, scale = 1;
+    int view_x = 0, view_y = 0, view_w = 0, view_h = 0, field_h = 0;
+    int i = 0;
+    int prev_pos[2] = {0, 0};
+    int curr_pos[2] = {0, 0};
+    material_type curr_mat = MAT_SAND;
+    grid_t *grid = NULL;
+    worker_pool_t *pool = NULL;
+    Color *frame = NULL;
+    Image frame_image;
+    Texture2D frame_texture;
+
+    if (argc > 1 && strcmp(argv[1], "--batch") == 0)
+        return batch_main(argc, argv);
+
+    for (i = 1; i < argc; i++) {
+        if (i + 1 >= argc) {
+            fprintf(stderr, "Error: %s needs a value\n", argv[i]);
+            return EXIT_FAILURE;
+        }
+
+        if (strcmp(argv[i], "--grid") == 0) {
+            if (!parse_size(argv[++i], &grid_w, &grid_h)) {
+                fprintf(stderr, "Error: --grid needs a size like 512x512, up "
+                        "to %dx%d\n", MAX_SIZE, MAX_SIZE);
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp(argv[i], "--window") == 0) {
+            if (!parse_size(argv[++i], &scr_w, &scr_h)
+                || scr_h <= UI_HEIGHT) {
+                fprintf(stderr, "Error: --window needs a size like 512x578, "
+                        "up to %dx%d\n", MAX_SIZE, MAX_SIZE);
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp(argv[i], "--scale") == 0) {
+            if (!parse_int(argv[++i], &scale) || scale < 1
+                || scale > MAX_SCALE) {
+                fprintf(stderr, "Error: --scale must be from 1 to %d\n",
+                        MAX_SCALE);
+                return EXIT_FAILURE;
+            }
+        }
+        else {
+            fprintf(stderr, "Error: Unknown option %s\n", argv[i]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    /* By default the window fits the whole grid (up to a point) */
+    if (scr_w == 0) {
+        scr_w = grid_w * scale;
+        if (scr_w > MAX_DEFAULT_WINDOW)
+            scr_w = MAX_DEFAULT_WINDOW;
+
+        scr_h = grid_h * scale;
+        if (scr_h > MAX_DEFAULT_WINDOW)
+            scr_h = MAX_DEFAULT_WINDOW;
+        scr_h += UI_HEIGHT;
+    }
+
+    /* The view is the part of the grid that fits in the window */
+    view_w = scr_w / scale < grid_w ? scr_w / scale : grid_w;
+    view_h = (scr_h - UI_HEIGHT) / scale < grid_h
+             ? (scr_h - UI_HEIGHT) / scale : grid_h;
+    field_h = view_h * scale;
+
+    grid = new_grid(grid_w, grid_h);
+    grid->history = new_history(HISTORY_SECONDS * 60, HISTORY_RECORDS,
+                                HISTORY_KEYFRAME_TICKS);
+
+    seed_grid(grid, (uint32_t)time(NULL));
+
+    /* Cores for the work that can be split up (eg, update_liquid_bodies) */
+    pool = new_worker_pool((int)sysconf(_SC_NPROCESSORS_ONLN));
+    grid->pool = pool;
+
+    /* The wind is worked out on its own thread while the grid is updated */
+    start_wind_thread(grid->wind);
+
+    /* And so is the light */
+    set_lighting(grid, true);
+    start_light_thread(grid->light);
+
+    frame = malloc((size_t)view_w * (size_t)view_h * sizeof(*frame));
+    if (frame == NULL) {
+        fprintf(stderr, "Error: Could not allocate enough memory at %d in %s\n",
+                __LINE__, __FILE__);
+        exit(EXIT_FAILURE);
+    }
+
+    InitWindow(scr_w, scr_h, "Falling Sand");
+    SetTargetFPS(60);
+
+    frame_image = GenImageColor(view_w, view_h, BLANK);
+    frame_texture = LoadTextureFromImage(frame_image);
+    UnloadImage(frame_image);
+
+    while (!WindowShouldClose()) {
+        /* WASD pans the view around grids too big for the window */
+        if (IsKeyDown(KEY_A))
+            view_x -= PAN_SPEED;
+        if (IsKeyDown(KEY_D))
+            view_x += PAN_SPEED;
+        if (IsKeyDown(KEY_S))
+            view_y -= PAN_SPEED;
+        if (IsKeyDown(KEY_W))
+            view_y += PAN_SPEED;
+
+        if (view_x > grid_w - view_w)
+            view_x = grid_w - view_w;
+        if (view_x < 0)
+            view_x = 0;
+        if (view_y > grid_h - view_h)
+            view_y = grid_h - view_h;
+        if (view_y < 0)
+            view_y = 0;
+
+        curr_pos[0] = view_x + GetMouseX() / scale;
+        curr_pos[1] = view_y + (field_h - 1 - GetMouseY()) / scale;
+
+        /*if (GetMouseWheelMoveV().y > 0) {*/
+            /* Increase the drawing size */
         /*}*/
         /*else if (GetMouseWheelMoveV().y < 0) {*/
             /* Decrease the drawing size */
         /*}*/
 
-        if (IsKeyPressed(KEY_RIGHT))
-            curr_mat = next_material(curr_mat);
-        else if (IsKeyPressed(KEY_LEFT))
-            curr_mat = prev_material(curr_mat);
+        if (IsKeyPressed(KEY_RIGHT))
+            curr_mat = next_material(curr_mat);
+        else if (IsKeyPressed(KEY_LEFT))
+            curr_mat = prev_material(curr_mat);
+
+        /**
+         * Holding R rewinds one tick per frame instead of simulating.
+         * Shift+R jumps back to the last keyframe instead
+         */
+        if (IsKeyDown(KEY_R)) {
+            if (IsKeyDown(KEY_LEFT_SHIFT) || IsKeyDown(KEY_RIGHT_SHIFT)) {
+                if (IsKeyPressed(KEY_R))
+                    restore_keyframe(grid);
+            }
+            else {
+                step_back_history(grid);
+            }
+        }
+        else {
+            begin_history_tick(grid);
+
+            if (IsMouseButtonDown(MOUSE_BUTTON_LEFT)) {
+                particle_line(grid, prev_pos[0], prev_pos[1],
+                                    curr_pos[0], curr_pos[1], curr_mat);
+            }
+            else if (IsMouseButtonDown(MOUSE_BUTTON_RIGHT)) {
+                particle_line(grid, prev_pos[0], prev_pos[1],
+                                    curr_pos[0], curr_pos[1], MAT_EMPTY);
+            }
+
+            if (IsKeyPressed(KEY_C))
+                clear_grid(grid);
+
+            if (IsKeyPressed(KEY_P))
+                set_pressure_water(grid, !grid->pressure);
+
+            if (IsKeyPressed(KEY_I)) {
+                set_structural_integrity(grid,
+                                         grid->structures.chunks == NULL);
+            }
+
+            /* Liquid bodies are only worked out while they're shown */
+            if (IsKeyPressed(KEY_B)) {
+                if (grid->bodies.chunks != NULL)
+                    free_regions(&grid->bodies);
+                else
+                    update_liquid_bodies(grid, pool);
+            }
+
+            if (IsKeyPressed(KEY_L)) {
+                set_lighting(grid, grid->light == NULL);
+
+                if (grid->light != NULL)
+                    start_light_thread(grid->light);
+            }
+
+            /**
+             * @note Two separate loops are used for grid updates. One for the
+             * actual particle interactions and a second for drawing particles.
+             * This is for simplicity because moving particles then drawing
+             * them was hard logic that I'm too dumb to figure out.
+             * Until I figure out how to update AND draw within the same loop
+             * again, this will have to be two loops
+             */
+            update_grid(grid);
+        }
+
+        if (grid->bodies.chunks != NULL)
+            update_liquid_bodies(grid, pool);
+
+        BeginDrawing();
+            ClearBackground((Color){64, 64, 64, 255});
+
+            fill_frame(grid, frame, view_x, view_y, view_w, view_h);
+            UpdateTexture(frame_texture, frame);
+            DrawTexturePro(frame_texture,
+                           (Rectangle){0.0f, 0.0f, view_w, view_h},
+                           (Rectangle){0.0f, 0.0f, view_w * scale, field_h},
+                           (Vector2){0.0f, 0.0f}, 0.0f, WHITE);
+
+            /* UI drawing code */
+            DrawRectangle(0, field_h, scr_w, scr_h - field_h, DARKBLUE);
+            DrawFPS(4, field_h);
+            DrawRectangle(4, field_h + 20, 40, 40,
+                          get_color_from_mat(curr_mat));
+
+            for (i = 1; i < MAT_COUNT; i++) {
+                DrawRectangle(30 + 20 * i, field_h + 20, 15, 15,
+                              get_color_from_mat(i));
+            }
+
+            if (grid->pressure)
+                DrawText("Pressure water", 50, field_h + 42, 20, RAYWHITE);
+
+            if (grid->bodies.chunks != NULL) {
+                DrawText(TextFormat("%zu liquid bodies, largest %zu",
+                                    grid->bodies.count, grid->bodies.largest),
+                         220, field_h + 20, 10, RAYWHITE);
+            }
+
+            if (grid->structures.chunks != NULL) {
+                DrawText("Structural integrity", 220, field_h + 34, 10,
+                         RAYWHITE);
+            }
+        EndDrawing();
+
+        prev_pos[0] = curr_pos[0];
+        prev_pos[1] = curr_pos[1];
+    }
+
+    UnloadTexture(frame_texture);
+    free(frame);
+    destroy_worker_pool(pool);
+    destroy_grid(grid);
+    CloseWindow();
+    return 0;
+}
+
+grid_t *
+new_empty_grid(void)
+{
+    grid_t *grid = malloc(sizeof(*grid));
+
+    if (grid == NULL) {
+        fprintf(stderr, "Error: Could not allocate enough memory at %d in %s\n",
+                __LINE__, __FILE__);
+        exit(EXIT_FAILURE);
+    }
+
+    grid->width = 0;
+    grid->height = 0;
+    grid->stride_shift = 0;
+    grid->chunk_shift = 0;
+    grid->chunk_count = 0;
+    grid->chunks = NULL;
+    grid->updated = NULL;
+    grid->settled = NULL;
+    grid->pressure = false;
+    init_regions(&grid->bodies, ELEM_LIQUID, -1);
+    init_regions(&grid->structures, ELEM_STATIC, -1);
+    init_regions(&grid->circuits, PLANE_CONDUCTOR, PLANE_SOURCE);
+    init_field(&grid->heat);
+    init_field(&grid->smoke);
+    grid->wind = NULL;
+    grid->light = NULL;
+    init_timer_wheel(&grid->timers);
+    grid->velocities.entries = NULL;
+    grid->velocities.capacity = 0;
+    grid->velocities.count = 0;
+    init_ejecta(&grid->ejecta);
+    init_blasts(&grid->blasts);
+    grid->pool = NULL;
+    grid->rng = 1;
+    grid->history = NULL;
+
+    return grid;
+}
+
+grid_t *
+new_grid(int width, int height)
+{
+    grid_t *grid = malloc(sizeof(*grid));
+
+    if (grid == NULL) {
+        fprintf(stderr, "Error: Could not allocate enough memory at %d in %s\n",
+                __LINE__, __FILE__);
+        exit(EXIT_FAILURE);
+    }
+
+    init_grid(grid, width, height);
+
+    return grid;
+}
+
+void
+init_grid(grid_t *grid, int width, int height)
+{
+    int i, rows;
+
+    grid->width = width;
+    grid->height = height;
+
+    /**
+     * Smallest power of two that fits a row and keeps rows on cache lines
+     * (and is at least a tile wide)
+     */
+    grid->stride_shift = TILE_SHIFT;
+    while (((size_t)1 << grid->stride_shift) < (size_t)width
+           || (((size_t)1 << grid->stride_shift) * sizeof(particle_t))
+              % CACHE_LINE != 0) {
+        grid->stride_shift++;
+    }
+
+    grid->chunk_shift = grid->stride_shift + CHUNK_SHIFT;
+    grid->chunk_count = (height + CHUNK_ROWS - 1) / CHUNK_ROWS;
+    grid->chunks = malloc(grid->chunk_count * sizeof(*grid->chunks));
+    grid->updated = calloc((get_storage_count(grid) + 63) / 64,
+                           sizeof(*grid->updated));
+    grid->settled = calloc((get_storage_count(grid) + 63) / 64,
+                           sizeof(*grid->settled));
+    grid->pressure = false;
+    init_regions(&grid->bodies, ELEM_LIQUID, -1);
+    init_regions(&grid->structures, ELEM_STATIC, -1);
+    init_regions(&grid->circuits, PLANE_CONDUCTOR, PLANE_SOURCE);
+    init_field(&grid->heat);
+    init_field(&grid->smoke);
+    grid->wind = NULL;
+    grid->light = NULL;
+    init_timer_wheel(&grid->timers);
+    grid->velocities.entries = NULL;
+    grid->velocities.capacity = 0;
+    grid->velocities.count = 0;
+    init_ejecta(&grid->ejecta);
+    init_blasts(&grid->blasts);
+    grid->pool = NULL;
+    grid->rng = 1;
+    grid->history = NULL;
+
+    if (grid->chunks == NULL || grid->updated == NULL
+        || grid->settled == NULL) {
+        fprintf(stderr, "Error: Could not allocate enough memory at %d in %s\n",
+                __LINE__, __FILE__);
+        exit(EXIT_FAILURE);
+    }
+
+    alloc_field(&grid->heat, width, height);
+    alloc_field(&grid->smoke, width, height);
+    grid->wind = new_wind_field(width, height);
+
+    for (i = 0; i < grid->chunk_count; i++) {
+        /* The last chunk still has to hold its last band of tiles in full */
+        rows = height - i * CHUNK_ROWS;
+        rows = (rows + (1 << TILE_SHIFT) - 1) & ~((1 << TILE_SHIFT) - 1);
+        if (rows > CHUNK_ROWS)
+            rows = CHUNK_ROWS;
+
+        grid->chunks[i] = new_chunk((size_t)rows << grid->stride_shift);
+    }
+
+    clear_grid(grid);
+}
+
+void
+destroy_grid(grid_t *grid)
+{
+    int i;
+
+    for (i = 0; i < grid->chunk_count; i++)
+        release_chunk(grid->chunks[i]);
+
+    free(grid->chunks);
+    grid->chunks = NULL;
+
+    free(grid->updated);
+    grid->updated = NULL;
+
+    free(grid->settled);
+    grid->settled = NULL;
+
+    free_regions(&grid->bodies);
+    free_regions(&grid->structures);
+    free_regions(&grid->circuits);
+
+    free_field(&grid->heat);
+    free_field(&grid->smoke);
+
+    if (grid->wind != NULL)
+        destroy_wind_field(grid->wind);
+    grid->wind = NULL;
+
+    if (grid->light != NULL)
+        destroy_light_map(grid->light);
+    grid->light = NULL;
+
+    free(grid->timers.events);
+    init_timer_wheel(&grid->timers);
+
+    free(grid->velocities.entries);
+    grid->velocities.entries = NULL;
+
+    free(grid->ejecta.block);
+    init_ejecta(&grid->ejecta);
+
+    free_blasts(&grid->blasts);
+
+    if (grid->history != NULL)
+        destroy_history(grid->history);
+    grid->history = NULL;
+
+    free(grid);
+    grid = NULL;
+}
+
+void
+clear_grid(grid_t *grid)
+{
+    int x, y;
+    particle_t empty_particle = {MAT_EMPTY, ELEM_EMPTY};
+
+    for (y = 0; y < grid->height; y++) {
+        for (x = 0; x < grid->width; x++) {
+            set_particle(grid, x, y, &empty_particle, 0);
+        }
+    }
+
+    grid->ejecta.count = 0;
+    grid->blasts.count = 0;
+    clear_field(&grid->heat);
+    clear_field(&grid->smoke);
+    record_wind(grid, false);
+    clear_wind(grid->wind);
+}
+
+chunk_t *
+new_chunk(size_t count)
+{
+    void *cells = NULL, *timers = NULL, *planes = NULL;
+    size_t plane_words = (count + 63) / 64;
+    chunk_t *chunk = malloc(sizeof(*chunk));
+
+    if (chunk == NULL
+        || posix_memalign(&cells, CACHE_LINE,
+                          count * sizeof(*chunk->cells)) != 0
+        || posix_memalign(&timers, CACHE_LINE,
+                          count * sizeof(*chunk->timers)) != 0
+        || posix_memalign(&planes, CACHE_LINE,
+                          PLANE_COUNT * plane_words
+                          * sizeof(*chunk->planes)) != 0) {
+        fprintf(stderr, "Error: Could not allocate enough memory at %d in %s\n",
+                __LINE__, __FILE__);
+        exit(EXIT_FAILURE);
+    }
+
+    chunk->cells = cells;
+    chunk->timers = timers;
+    memset(chunk->cells, 0, count * sizeof(*chunk->cells));
+    memset(chunk->timers, 0, count * sizeof(*chunk->timers));
+    chunk->planes = planes;
+    chunk->plane_words = plane_words;
+    memset(chunk->planes, 0,
+           PLANE_COUNT * plane_words * sizeof(*chunk->planes));
+    chunk->mass = NULL;
+    chunk->refs = 1;
+    chunk->count = count;
+
+    return chunk;
+}
+
+void
+alloc_chunk_mass(chunk_t *chunk)
+{
+    void *mass = NULL;
+
+    if (posix_memalign(&mass, CACHE_LINE,
+                       chunk->count * sizeof(*chunk->mass)) != 0) {
+        fprintf(stderr, "Error: Could not allocate enough memory at %d in %s\n",
+                __LINE__, __FILE__);
+        exit(EXIT_FAILURE);
+    }
+
+    chunk->mass = mass;
+}
+
+void
+release_chunk(chunk_t *chunk)
+{
+    chunk->refs--;
+
+    if (chunk->refs == 0) {
+        free(chunk->mass);
+        free(chunk->planes);
+        free(chunk->timers);
+        free(chunk->cells);
+        free(chunk);
+    }
+}
+
+grid_t *
+fork_grid(const grid_t *grid)
+{
+    int i;
+    grid_t *fork = new_empty_grid();
+
+    fork->width = grid->width;
+    fork->height = grid->height;
+    fork->stride_shift = grid->stride_shift;
+    fork->chunk_shift = grid->chunk_shift;
+    fork->chunk_count = grid->chunk_count;
+    fork->rng = grid->rng;
+    fork->chunks = malloc(fork->chunk_count * sizeof(*fork->chunks));
+
+    /* The masses are in the chunks, so they're shared along with them */
+    fork->pressure = grid->pressure;
+
+    if (fork->chunks == NULL
+        || !copy_velocity_table(&fork->velocities, &grid->velocities)
+        || !copy_timer_wheel(&fork->timers, &grid->timers)
+        || !copy_ejecta(&fork->ejecta, &grid->ejecta)
+        || !copy_blasts(&fork->blasts, &grid->blasts)) {
+        fprintf(stderr, "Error: Could not allocate enough memory at %d in %s\n",
+                __LINE__, __FILE__);
+        exit(EXIT_FAILURE);
+    }
+
+    /**
+     * The fields are shared like the chunks until either grid is updated (see
+     * unshare_grid). The fork's updated and settled bits aren't made until
+     * then either, and nothing starts settled, which only costs the fork a
+     * tick to find out
+     */
+    share_field(&fork->heat, &grid->heat);
+    share_field(&fork->smoke, &grid->smoke);
+
+    /* The fork's wind never gets a thread since it's never run as it is */
+    fork->wind = fork_wind_field(grid->wind);
+
+    for (i = 0; i < fork->chunk_count; i++) {
+        fork->chunks[i] = grid->chunks[i];
+        fork->chunks[i]->refs++;
+    }
+
+    /* The fork tracks the same regions without labelling them again */
+    match_regions(fork, &fork->bodies, &grid->bodies);
+    match_regions(fork, &fork->structures, &grid->structures);
+    match_regions(fork, &fork->circuits, &grid->circuits);
+
+    if (grid->light != NULL)
+        fork->light = fork_light_map(grid->light);
+
+    return fork;
+}
+
+bool
+restore_grid(grid_t *grid, const grid_t *snapshot)
+{
+    int i;
+
+    if (grid->width != snapshot->width || grid->height != snapshot->height)
+        return false;
+
+    if (!copy_timer_wheel(&grid->timers, &snapshot->timers)
+        || !copy_velocity_table(&grid->velocities, &snapshot->velocities)
+        || !copy_ejecta(&grid->ejecta, &snapshot->ejecta)
+        || !copy_blasts(&grid->blasts, &snapshot->blasts))
+        return false;
+
+    share_field(&grid->heat, &snapshot->heat);
+    share_field(&grid->smoke, &snapshot->smoke);
+    copy_wind_field(grid->wind, snapshot->wind);
+
+    /* The snapshot's chunks bring their masses if it was in pressure mode */
+    grid->pressure = snapshot->pressure;
+
+    /* Grab the snapshot's chunk before releasing ours in case they're shared */
+    for (i = 0; i < grid->chunk_count; i++) {
+        snapshot->chunks[i]->refs++;
+        release_chunk(grid->chunks[i]);
+        grid->chunks[i] = snapshot->chunks[i];
+    }
+
+    /* The particles changed wholesale, so they all have to check again */
+    if (grid->settled != NULL) {
+        memset(grid->settled, 0,
+               (get_storage_count(grid) + 63) / 64 * sizeof(*grid->settled));
+    }
+
+    grid->rng = snapshot->rng;
+
+    /**
+     * Structural integrity goes back to how the snapshot had it too. Nothing
+     * comes loose until the next tick, same as it would have in the snapshot
+     */
+    match_regions(grid, &grid->bodies, &snapshot->bodies);
+    match_regions(grid, &grid->structures, &snapshot->structures);
+    match_regions(grid, &grid->circuits, &snapshot->circuits);
+
+    if (grid->light != NULL && snapshot->light != NULL)
+        copy_light_map(grid->light, snapshot->light);
+
+    if (grid->history != NULL)
+        reset_history(grid->history);
+
+    return true;
+}
+
+size_t
+get_index(const grid_t *grid, int x, int y)
+{
+#ifdef GRID_TILED
+    const size_t mask = ((size_t)1 << TILE_SHIFT) - 1;
+
+    /* Band of tile rows, then tile within the band, then spot in the tile */
+    return (((size_t)y >> TILE_SHIFT) << (grid->stride_shift + TILE_SHIFT))
+           | (((size_t)x >> TILE_SHIFT) << (2 * TILE_SHIFT))
+           | (((size_t)y & mask) << TILE_SHIFT)
+           | ((size_t)x & mask);
+#else
+    return ((size_t)y << grid->stride_shift) | (size_t)x;
+#endif
+}
+
+void
+get_position(const grid_t *grid, size_t index, int *x, int *y)
+{
+#ifdef GRID_TILED
+    const size_t mask = ((size_t)1 << TILE_SHIFT) - 1;
+    const size_t band = index & (((size_t)1 << (grid->stride_shift
+                                                + TILE_SHIFT)) - 1);
+
+    *x = (int)(((band >> (2 * TILE_SHIFT)) << TILE_SHIFT) | (band & mask));
+    *y = (int)(((index >> (grid->stride_shift + TILE_SHIFT)) << TILE_SHIFT)
+               | ((band >> TILE_SHIFT) & mask));
+#else
+    *x = (int)(index & (((size_t)1 << grid->stride_shift) - 1));
+    *y = (int)(index >> grid->stride_shift);
+#endif
+}
+
+size_t
+get_cell_count(const grid_t *grid)
+{
+    return (size_t)grid->width * (size_t)grid->height;
+}
+
+size_t
+get_storage_count(const grid_t *grid)
+{
+    const size_t tile = (size_t)1 << TILE_SHIFT;
+
+    return (((size_t)grid->height + tile - 1) & ~(tile - 1))
+           << grid->stride_shift;
+}
+
+const particle_t *
+get_particle_at(const grid_t *grid, size_t index)
+{
+    return &grid->chunks[index >> grid->chunk_shift]
+                ->cells[index & (((size_t)1 << grid->chunk_shift) - 1)];
+}
+
+chunk_t *
+get_chunk_mut(grid_t *grid, size_t index)
+{
+    size_t c = index >> grid->chunk_shift;
+    chunk_t *chunk = grid->chunks[c];
+    chunk_t *copy = NULL;
+
+    if (chunk->refs > 1) {
+        copy = new_chunk(chunk->count);
+        memcpy(copy->cells, chunk->cells, chunk->count * sizeof(*chunk->cells));
+        memcpy(copy->timers, chunk->timers,
+               chunk->count * sizeof(*chunk->timers));
+        memcpy(copy->planes, chunk->planes,
+               PLANE_COUNT * chunk->plane_words * sizeof(*chunk->planes));
+
+        if (chunk->mass != NULL) {
+            alloc_chunk_mass(copy);
+            memcpy(copy->mass, chunk->mass, chunk->count * sizeof(*copy->mass));
+        }
+        release_chunk(chunk);
+        grid->chunks[c] = copy;
+        chunk = copy;
+    }
+
+    return chunk;
+}
+
+particle_t *
+get_particle_at_mut(grid_t *grid, size_t index)
+{
+    return &get_chunk_mut(grid, index)
+                ->cells[index & (((size_t)1 << grid->chunk_shift) - 1)];
+}
+
+const particle_t *
+get_particle(const grid_t *grid, int x, int y)
+{
+    if (x < 0 || x >= grid->width || y < 0 || y >= grid->height)
+        return NULL;
+
+    return get_particle_at(grid, get_index(grid, x, y));
+}
+
+particle_t *
+get_particle_mut(grid_t *grid, int x, int y)
+{
+    if (x < 0 || x >= grid->width || y < 0 || y >= grid->height)
+        return NULL;
+
+    return get_particle_at_mut(grid, get_index(grid, x, y));
+}
+
+bool
+is_updated(const grid_t *grid, int x, int y)
+{
+    size_t index = ((size_t)y << grid->stride_shift) | (size_t)x;
+
+    return (grid->updated[index / 64] >> (index % 64)) & 1;
+}
+
+void
+set_updated(grid_t *grid, int x, int y, bool updated)
+{
+    size_t index = ((size_t)y << grid->stride_shift) | (size_t)x;
+
+    /* A fork has no bits until it's first updated (see unshare_grid) */
+    if (grid->updated == NULL)
+        return;
+
+    if (updated)
+        grid->updated[index / 64] |= (uint64_t)1 << (index % 64);
+    else
+        grid->updated[index / 64] &= ~((uint64_t)1 << (index % 64));
+}
+
+void
+set_settled(grid_t *grid, int x, int y, bool settled)
+{
+    size_t index = ((size_t)y << grid->stride_shift) | (size_t)x;
+
+    if (settled)
+        grid->settled[index / 64] |= (uint64_t)1 << (index % 64);
+    else
+        grid->settled[index / 64] &= ~((uint64_t)1 << (index % 64));
+}
+
+void
+wake_neighbors(grid_t *grid, int x, int y)
+{
+    int i, j;
+
+    if (grid->settled == NULL)
+        return;
+
+    for (j = y - 1; j <= y + 1; j++) {
+        if (j < 0 || j >= grid->height)
+            continue;
+
+        for (i = x - 1; i <= x + 1; i++) {
+            if (i >= 0 && i < grid->width)
+                set_settled(grid, i, j, false);
+        }
+    }
+}
+
+void
+unshare_grid(grid_t *grid)
+{
+    size_t words = (get_storage_count(grid) + 63) / 64;
+
+    if (grid->updated == NULL) {
+        grid->updated = calloc(words, sizeof(*grid->updated));
+        grid->settled = calloc(words, sizeof(*grid->settled));
+
+        if (grid->updated == NULL || grid->settled == NULL) {
+            fprintf(stderr, "Error: Could not allocate enough memory at %d "
+                    "in %s\n", __LINE__, __FILE__);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    unshare_field(&grid->heat);
+    unshare_field(&grid->smoke);
+
+    if (grid->light != NULL)
+        unshare_light(grid->light);
+}
+
+void
+update_grid(grid_t *grid)
+{
+    int x, y, word;
+
+    unshare_grid(grid);
+    memset(grid->updated, 0,
+           (get_storage_count(grid) + 63) / 64 * sizeof(*grid->updated));
+
+    advance_timers(grid);
+
+    /* Wire drawn since the last tick is powered from this one on */
+    if (grid->circuits.chunks != NULL)
+        update_regions(grid, &grid->circuits, grid->pool);
+
+    /**
+     * Empty cells and settled water don't do anything, so only the rest of
+     * the particles are visited. The planes are checked again after every
+     * update since updates can add or wake particles further along the row
+     */
+    for (y = 0; y < grid->height; y++) {
+        word = -1;
+
+        for (x = next_active(grid, 0, y); x < grid->width;
+             x = next_active(grid, x + 1, y)) {
+            /* The first particle in a word gets the chance to do it all */
+            if (x / 64 != word) {
+                word = x / 64;
+
+                /* A falling column goes first so the word only has the rest */
+                drop_column(grid, x, y);
+
+                if (update_sand_word(grid, word * 64, y)) {
+                    x = word * 64 + 63;
+                    continue;
+                }
+            }
+
+            if (is_updated(grid, x, y))
+                continue;
+
+            update_funcs[get_particle(grid, x, y)->mat_type](grid, x, y);
+        }
+    }
+
+    update_blasts(grid);
+    update_ejecta(grid);
+
+    if (grid->pressure)
+        update_pressure(grid);
+
+    update_heat(grid);
+    step_wind(grid);
+    update_smoke_field(grid);
+
+    if (grid->structures.chunks != NULL)
+        collapse_structures(grid);
+
+    if (grid->light != NULL)
+        step_light(grid);
+}
+
+size_t
+get_plane_bit(const grid_t *grid, int x, int y)
+{
+    return ((size_t)(y & (CHUNK_ROWS - 1)) << grid->stride_shift) | (size_t)x;
+}
+
+bool
+test_plane(const grid_t *grid, int plane, int x, int y)
+{
+    const chunk_t *chunk = grid->chunks[y >> CHUNK_SHIFT];
+    size_t bit = get_plane_bit(grid, x, y);
+
+    return (chunk->planes[plane * chunk->plane_words + bit / 64]
+            >> (bit % 64)) & 1;
+}
+
+void
+update_planes(grid_t *grid, int x, int y)
+{
+    const particle_t *p = get_particle(grid, x, y);
+    chunk_t *chunk = get_chunk_mut(grid, get_index(grid, x, y));
+    size_t bit = get_plane_bit(grid, x, y);
+    size_t word = bit / 64;
+    uint64_t mask = (uint64_t)1 << (bit % 64);
+    int plane;
+
+    /* The chunk's regions only have to be redone if it was in one */
+    if (grid->bodies.chunks != NULL
+        && (chunk->planes[ELEM_LIQUID * chunk->plane_words + word] & mask))
+        grid->bodies.dirty[y >> CHUNK_SHIFT] = true;
+    if (grid->structures.chunks != NULL
+        && (chunk->planes[ELEM_STATIC * chunk->plane_words + word] & mask))
+        grid->structures.dirty[y >> CHUNK_SHIFT] = true;
+    if (grid->circuits.chunks != NULL
+        && (chunk->planes[PLANE_CONDUCTOR * chunk->plane_words + word] & mask))
+        grid->circuits.dirty[y >> CHUNK_SHIFT] = true;
+
+    for (plane = 0; plane < PLANE_COUNT; plane++)
+        chunk->planes[plane * chunk->plane_words + word] &= ~mask;
+
+    wake_neighbors(grid, x, y);
+
+    if (p->mat_type == MAT_EMPTY)
+        return;
+
+    chunk->planes[PLANE_OCCUPIED * chunk->plane_words + word] |= mask;
+    chunk->planes[get_particle_elem(p) * chunk->plane_words + word] |= mask;
+
+    /* Or if it is now */
+    if (grid->bodies.chunks != NULL && get_particle_elem(p) == ELEM_LIQUID)
+        grid->bodies.dirty[y >> CHUNK_SHIFT] = true;
+    if (grid->structures.chunks != NULL && get_particle_elem(p) == ELEM_STATIC)
+        grid->structures.dirty[y >> CHUNK_SHIFT] = true;
+
+    if (p->mat_type == MAT_SAND && !(p->state & STATE_HAS_VELOCITY))
+        chunk->planes[PLANE_SAND * chunk->plane_words + word] |= mask;
+
+    if (p->mat_type == MAT_WIRE || p->mat_type == MAT_BATTERY) {
+        chunk->planes[PLANE_CONDUCTOR * chunk->plane_words + word] |= mask;
+
+        if (grid->circuits.chunks != NULL)
+            grid->circuits.dirty[y >> CHUNK_SHIFT] = true;
+    }
+
+    if (p->mat_type == MAT_BATTERY)
+        chunk->planes[PLANE_SOURCE * chunk->plane_words + word] |= mask;
+}
+
+int
+next_active(const grid_t *grid, int x, int y)
+{
+    const chunk_t *chunk = grid->chunks[y >> CHUNK_SHIFT];
+    const uint64_t *plane = &chunk->planes[PLANE_OCCUPIED
+                                           * chunk->plane_words];
+    size_t start = get_plane_bit(grid, 0, y);
+    size_t end = start + (size_t)grid->width;
+    size_t bit = start + (size_t)x;
+    uint64_t bits;
+
+    /**
+     * The settled bitset is in row order over the whole grid instead of the
+     * chunk, and a chunk is always a whole number of words, so it's the same
+     * bits just further along
+     */
+    const uint64_t *settled = &grid->settled[(((size_t)y << grid->stride_shift)
+                                              - start) / 64];
+
+    /* With a narrow stride the rest of the word can be the next row's */
+    while (bit < end) {
+        bits = (plane[bit / 64] & ~settled[bit / 64]) >> (bit % 64);
+
+        if (bits != 0) {
+            bit += lowest_bit(bits);
+            return bit < end ? (int)(bit - start) : grid->width;
+        }
+
+        bit = (bit | 63) + 1;
+    }
+
+    return grid->width;
+}
+
+bool
+update_sand_word(grid_t *grid, int x, int y)
+{
+    chunk_t *chunk = grid->chunks[y >> CHUNK_SHIFT];
+    chunk_t *below = NULL;
+    particle_t grain;
+    size_t word, below_word;
+    uint64_t valid, sand, empty, left_empty, right_empty;
+    uint64_t down, down_left, down_right, next, moved, landed;
+    const int grain_planes[3] = {PLANE_OCCUPIED, ELEM_SOLID, PLANE_SAND};
+    int i, to;
+
+    /* Narrow rows share words, so the kernel can't have a word to itself */
+    if (y == 0 || grid->stride_shift < 6)
+        return false;
+
+    below = grid->chunks[(y - 1) >> CHUNK_SHIFT];
+    word = get_plane_bit(grid, x, y) / 64;
+    below_word = get_plane_bit(grid, x, y - 1) / 64;
+
+    if ((chunk->planes[PLANE_OCCUPIED * chunk->plane_words + word]
+         & ~chunk->planes[PLANE_SAND * chunk->plane_words + word]) != 0)
+        return false;
+
+    if ((below->planes[ELEM_STATIC * below->plane_words + below_word]
+         | below->planes[ELEM_LIQUID * below->plane_words + below_word]
+         | below->planes[ELEM_GAS * below->plane_words + below_word]) != 0
+        || is_pos_liquid(grid, x - 1, y - 1) || is_pos_gas(grid, x - 1, y - 1)
+        || is_pos_liquid(grid, x + 64, y - 1)
+        || is_pos_gas(grid, x + 64, y - 1))
+        return false;
+
+    valid = grid->width - x >= 64 ? ~(uint64_t)0
+                                  : ((uint64_t)1 << (grid->width - x)) - 1;
+    sand = chunk->planes[PLANE_SAND * chunk->plane_words + word]
+           & ~grid->updated[(((size_t)y << grid->stride_shift) | (size_t)x)
+                            / 64];
+    empty = ~below->planes[PLANE_OCCUPIED * below->plane_words + below_word]
+            & valid;
+
+    /* Bit i of these is whether the cell below and left/right of i is empty */
+    left_empty = (empty << 1) | (uint64_t)is_pos_empty(grid, x - 1, y - 1);
+    right_empty = (empty >> 1)
+                  | ((uint64_t)is_pos_empty(grid, x + 64, y - 1) << 63);
+
+    /**
+     * Going left to right, a grain falls straight down if it can, then down
+     * left, then down right. Anything to the left of the word is already done
+     * and is part of empty. Within the word, a grain only loses a spot to an
+     * earlier grain by that grain sliding down right into it, so the grains
+     * that slide down right are worked out first. A grain slides down right if
+     * the cell below right is empty and it couldn't go down (that cell is full
+     * or the grain to its left slid into it) or down left (that cell is full,
+     * the grain above it fell into it, or the grain two to its left slid into
+     * it). Sliding grains can set off more sliding grains further right, so
+     * this goes until nothing changes, which is one pass per grain in the
+     * longest chain
+     */
+    down_right = 0;
+    do {
+        next = sand & right_empty & (~empty | (down_right << 1))
+               & (~left_empty | (sand << 1) | (down_right << 2));
+        if (next == down_right)
+            break;
+        down_right = next;
+    } while (1);
+
+    down = sand & empty & ~(down_right << 1);
+    down_left = sand & ~down & left_empty & ~(sand << 1)
+                & ~(down_right << 2);
+
+    /**
+     * None of the moves share a cell, so the order they're done in is fine.
+     * Sand and empty cells have no timers or velocities, so moving a grain is
+     * just swapping the two cells, and the planes are done a word at a time
+     */
+    moved = down | down_left | down_right;
+
+    while (moved != 0) {
+        i = lowest_bit(moved);
+        to = x + i;
+        if ((down_left >> i) & 1)
+            to--;
+        else if ((down_right >> i) & 1)
+            to++;
+
+        record_particle(grid, x + i, y);
+        record_particle(grid, to, y - 1);
+
+        grain = *get_particle(grid, x + i, y);
+        *get_particle_mut(grid, x + i, y) = *get_particle(grid, to, y - 1);
+        *get_particle_mut(grid, to, y - 1) = grain;
+
+        moved &= moved - 1;
+    }
+
+    moved = down | down_left | down_right;
+    landed = down | (down_left >> 1) | (down_right << 1);
+    chunk = get_chunk_mut(grid, get_index(grid, x, y));
+    below = get_chunk_mut(grid, get_index(grid, x, y - 1));
+
+    for (i = 0; i < 3; i++) {
+        chunk->planes[grain_planes[i] * chunk->plane_words + word] &= ~moved;
+        below->planes[grain_planes[i] * below->plane_words + below_word]
+            |= landed;
+    }
+
+    /* The grains that slid out of the word */
+    if (down_left & 1)
+        update_planes(grid, x - 1, y - 1);
+    if (down_right >> 63)
+        update_planes(grid, x + 64, y - 1);
+
+    /**
+     * The planes were done without update_planes, so the particles around the
+     * word have to be woken here. It's done a word at a time, so it wakes a
+     * few more than it has to, which is fine
+     */
+    if ((down | down_left | down_right) != 0)
+        wake_word(grid, x, y);
+
+    /* Grains that didn't move are done for this tick too */
+    grid->updated[(((size_t)y << grid->stride_shift) | (size_t)x) / 64] |= sand;
+    grid->updated[(((size_t)(y - 1) << grid->stride_shift) | (size_t)x) / 64]
+        |= landed;
+
+    if (down_left & 1)
+        set_updated(grid, x - 1, y - 1, true);
+    if (down_right >> 63)
+        set_updated(grid, x + 64, y - 1, true);
+
+    /* Grains that fell straight into open air start flying */
+    while (down != 0) {
+        start_falling(grid, x + lowest_bit(down), y - 1);
+        down &= down - 1;
+    }
+
+    return true;
+}
+
+void
+wake_word(grid_t *grid, int x, int y)
+{
+    size_t word;
+    int row;
+
+    if (grid->settled == NULL)
+        return;
+
+    for (row = y - 2; row <= y + 1; row++) {
+        if (row < 0 || row >= grid->height)
+            continue;
+
+        word = (((size_t)row << grid->stride_shift) | (size_t)x) / 64;
+
+        if (x > 0)
+            grid->settled[word - 1] = 0;
+        grid->settled[word] = 0;
+        if (x + 64 < grid->width)
+            grid->settled[word + 1] = 0;
+    }
+}
+
+bool
+drop_column(grid_t *grid, int x, int y)
+{
+    const particle_t *grain = get_particle(grid, x, y);
+    const particle_t *p = NULL;
+    int top, i;
+
+    if (is_updated(grid, x, y)
+        || (grain->mat_type != MAT_SAND && grain->mat_type != MAT_WATER)
+        || (grain->state & STATE_HAS_VELOCITY)
+        || !is_pos_empty(grid, x, y - 1))
+        return false;
+
+    /**
+     * Anything beside the column that can move might get in the way of a
+     * particle part way down, so the run stops there. Static particles never
+     * move and only care about their neighbors burning, so they're fine.
+     * Liquids can flow in from further away (see find_dispersal), so there
+     * can't be any of those for MAX_DISPERSION cells either side
+     */
+    for (top = y; top < grid->height; top++) {
+        p = get_particle(grid, x, top);
+
+        if (p->mat_type != grain->mat_type || p->state != grain->state
+            || is_updated(grid, x, top)
+            || (x > 0 && test_plane(grid, PLANE_OCCUPIED, x - 1, top)
+                && !test_plane(grid, ELEM_STATIC, x - 1, top))
+            || (x + 1 < grid->width
+                && test_plane(grid, PLANE_OCCUPIED, x + 1, top)
+                && !test_plane(grid, ELEM_STATIC, x + 1, top)))
+            break;
+
+        for (i = 2; i <= MAX_DISPERSION; i++) {
+            if (is_pos_liquid(grid, x - i, top)
+                || is_pos_liquid(grid, x + i, top))
+                break;
+        }
+
+        if (i <= MAX_DISPERSION)
+            break;
+    }
+
+    if (top - y < 2)
+        return false;
+
+    /* The particles are all the same, so only the ends of the run change */
+    swap_particles(grid, x, top - 1, x, y - 1);
+    start_falling(grid, x, y - 1);
+
+    for (top -= 2; top >= y; top--)
+        set_updated(grid, x, top, true);
+
+    return true;
+}
+
+int
+lowest_bit(uint64_t bits)
+{
+#ifdef __GNUC__
+    return __builtin_ctzll(bits);
+#else
+    int n = 0;
+
+    while ((bits & 1) == 0) {
+        bits >>= 1;
+        n++;
+    }
+
+    return n;
+#endif
+}
+
+void
+advance_timers(grid_t *grid)
+{
+    timer_wheel_t *wheel = &grid->timers;
+    uint32_t handle, next;
+    int level, bucket, x, y;
+
+    wheel->now++;
+
+    /**
+     * At the start of a slot on a higher level, put its timers back in. They're
+     * all closer than that level now, so they drop down a level or more
+     */
+    for (level = 1; level < TIMER_LEVELS; level++) {
+        if ((wheel->now & ((1u << (TIMER_SLOT_BITS * level)) - 1)) != 0)
+            break;
+
+        bucket = level * TIMER_SLOTS
+                 + (int)((wheel->now >> (TIMER_SLOT_BITS * level))
+                         & (TIMER_SLOTS - 1));
+        handle = wheel->slots[bucket];
+        wheel->slots[bucket] = TIMER_NONE;
+
+        while (handle != TIMER_NONE) {
+            next = wheel->events[handle].next;
+            wheel->events[handle].bucket = -1;
+            link_timer(wheel, handle);
+            handle = next;
+        }
+    }
+
+    /**
+     * A slot on the bottom level can also hold timers that are due a whole
+     * turn of the wheel later, which are left alone
+     */
+    handle = wheel->slots[wheel->now & (TIMER_SLOTS - 1)];
+
+    while (handle != TIMER_NONE) {
+        next = wheel->events[handle].next;
+
+        if (wheel->events[handle].due == wheel->now) {
+            get_position(grid, wheel->events[handle].index, &x, &y);
+            expire_particle(grid, x, y);
+        }
+
+        handle = next;
+    }
+}
+
+void
+expire_particle(grid_t *grid, int x, int y)
+{
+    material_type m = get_particle(grid, x, y)->mat_type;
+
+    remove_particle(grid, x, y);
+
+    if (m == MAT_FIRE && grid_rand(grid) % 5 == 0)
+        add_particle(grid, x, y, MAT_SMOKE);
+
+    set_updated(grid, x, y, true);
+}
+
+void
+init_timer_wheel(timer_wheel_t *wheel)
+{
+    int i;
+
+    wheel->events = NULL;
+    wheel->capacity = 0;
+    wheel->free_list = TIMER_NONE;
+    wheel->count = 0;
+    wheel->now = 0;
+
+    for (i = 0; i < TIMER_LEVELS * TIMER_SLOTS; i++)
+        wheel->slots[i] = TIMER_NONE;
+}
+
+bool
+copy_timer_wheel(timer_wheel_t *dest, const timer_wheel_t *src)
+{
+    timer_event_t *events = dest->events;
+
+    if (src->capacity > dest->capacity) {
+        events = realloc(dest->events, src->capacity * sizeof(*events));
+
+        if (events == NULL)
+            return false;
+    }
+
+    *dest = *src;
+    dest->events = events;
+
+    if (src->capacity > 0)
+        memcpy(events, src->events, src->capacity * sizeof(*events));
+
+    return true;
+}
+
+uint32_t
+add_timer(timer_wheel_t *wheel, size_t index, uint32_t due)
+{
+    uint32_t handle, i, capacity;
+    timer_event_t *events = NULL;
+
+    if (wheel->free_list == TIMER_NONE) {
+        capacity = wheel->capacity == 0 ? 1024 : wheel->capacity * 2;
+        events = realloc(wheel->events, capacity * sizeof(*events));
+
+        if (events == NULL) {
+            fprintf(stderr, "Error: Could not allocate enough memory at %d in "
+                    "%s\n", __LINE__, __FILE__);
+            exit(EXIT_FAILURE);
+        }
+
+        /* Handle 0 is TIMER_NONE, so it never goes on the free list */
+        for (i = capacity - 1; i >= wheel->capacity && i > 0; i--) {
+            events[i].bucket = -1;
+            events[i].next = wheel->free_list;
+            wheel->free_list = i;
+        }
+
+        wheel->events = events;
+        wheel->capacity = capacity;
+    }
+
+    handle = wheel->free_list;
+    wheel->free_list = wheel->events[handle].next;
+    wheel->count++;
+
+    if ((int32_t)(due - wheel->now) <= 0)
+        due = wheel->now + 1;
+
+    wheel->events[handle].index = index;
+    wheel->events[handle].due = due;
+    wheel->events[handle].bucket = -1;
+    link_timer(wheel, handle);
+
+    return handle;
+}
+
+void
+remove_timer(timer_wheel_t *wheel, uint32_t handle)
+{
+    unlink_timer(wheel, handle);
+
+    wheel->events[handle].next = wheel->free_list;
+    wheel->free_list = handle;
+    wheel->count--;
+}
+
+void
+link_timer(timer_wheel_t *wheel, uint32_t handle)
+{
+    timer_event_t *event = &wheel->events[handle];
+    uint32_t delta = event->due - wheel->now;
+    int level = 0, bucket;
+
+    while (level < TIMER_LEVELS - 1
+           && delta >= (1u << (TIMER_SLOT_BITS * (level + 1)))) {
+        level++;
+    }
+
+    bucket = level * TIMER_SLOTS
+             + (int)((event->due >> (TIMER_SLOT_BITS * level))
+                     & (TIMER_SLOTS - 1));
+
+    event->bucket = bucket;
+    event->prev = TIMER_NONE;
+    event->next = wheel->slots[bucket];
+
+    if (event->next != TIMER_NONE)
+        wheel->events[event->next].prev = handle;
+
+    wheel->slots[bucket] = handle;
+}
+
+void
+unlink_timer(timer_wheel_t *wheel, uint32_t handle)
+{
+    timer_event_t *event = &wheel->events[handle];
+
+    if (event->bucket < 0)
+        return;
+
+    if (event->prev != TIMER_NONE)
+        wheel->events[event->prev].next = event->next;
+    else
+        wheel->slots[event->bucket] = event->next;
+
+    if (event->next != TIMER_NONE)
+        wheel->events[event->next].prev = event->prev;
+
+    event->bucket = -1;
+}
+
+void
+seed_grid(grid_t *grid, uint32_t seed)
+{
+    /* xorshift gets stuck at 0, so mix the seed and make sure it isn't */
+    seed = (seed ^ 61) ^ (seed >> 16);
+    seed *= 9;
+    seed ^= seed >> 4;
+    seed *= 0x27d4eb2d;
+    seed ^= seed >> 15;
+
+    grid->rng = seed != 0 ? seed : 1;
+}
+
+int
+grid_rand(grid_t *grid)
+{
+    uint32_t s = grid->rng;
+
+    s ^= s << 13;
+    s ^= s >> 17;
+    s ^= s << 5;
+    grid->rng = s;
+
+    return (int)(s >> 1);
+}
+
+void
+set_particle(grid_t *grid, int x, int y, const particle_t *p,
+             uint32_t life_time)
+{
+    size_t index;
+    uint32_t handle;
+    particle_t *dest = NULL;
+
+    if (x < 0 || x >= grid->width || y < 0 || y >= grid->height)
+        return;
+
+    /* Emptying an empty cell doesn't change anything worth rewinding */
+    if (grid->history != NULL
+        && !(get_particle(grid, x, y)->mat_type == MAT_EMPTY
+             && p->mat_type == MAT_EMPTY)) {
+        record_particle(grid, x, y);
+    }
+
+    index = get_index(grid, x, y);
+    dest = get_particle_at_mut(grid, index);
+
+    if (dest->state & STATE_HAS_VELOCITY)
+        erase_velocity(&grid->velocities, index);
+
+    dest->mat_type = p->mat_type;
+    dest->state = p->state & ~STATE_HAS_VELOCITY;
+
+    handle = get_timer(grid, index);
+    if (handle != TIMER_NONE)
+        remove_timer(&grid->timers, handle);
+
+    if (life_time > 0) {
+        handle = add_timer(&grid->timers, index,
+                           grid->timers.now + life_time);
+    }
+    else {
+        handle = TIMER_NONE;
+    }
+
+    set_timer(grid, index, handle);
+    update_planes(grid, x, y);
+
+    if (grid->pressure)
+        set_mass(grid, x, y, p->mat_type == MAT_WATER ? 1.0f : 0.0f);
+
+    set_updated(grid, x, y, false);
+}
+
+element_type
+get_particle_elem(const particle_t *p)
+{
+    return p->state & STATE_ELEM_MASK;
+}
+
+void
+set_particle_elem(particle_t *p, element_type e)
+{
+    p->state = (p->state & ~STATE_ELEM_MASK) | e;
+}
+
+uint32_t
+get_life_time(const grid_t *grid, int x, int y)
+{
+    uint32_t handle = get_timer(grid, get_index(grid, x, y));
+
+    if (handle == TIMER_NONE)
+        return 0;
+
+    return grid->timers.events[handle].due - grid->timers.now;
+}
+
+uint32_t
+get_timer(const grid_t *grid, size_t index)
+{
+    return grid->chunks[index >> grid->chunk_shift]
+               ->timers[index & (((size_t)1 << grid->chunk_shift) - 1)];
+}
+
+void
+set_timer(grid_t *grid, size_t index, uint32_t handle)
+{
+    get_chunk_mut(grid, index)
+        ->timers[index & (((size_t)1 << grid->chunk_shift) - 1)] = handle;
+}
+
+Vector2 *
+find_velocity(const velocity_table_t *table, size_t index)
+{
+    size_t slot;
+
+    if (table->count == 0)
+        return NULL;
+
+    slot = (size_t)((uint64_t)index * 0x9e3779b97f4a7c15ull)
+           & (table->capacity - 1);
+
+    while (table->entries[slot].index != SIZE_MAX) {
+        if (table->entries[slot].index == index)
+            return &table->entries[slot].velocity;
+
+        slot = (slot + 1) & (table->capacity - 1);
+    }
+
+    return NULL;
+}
+
+void
+put_velocity(velocity_table_t *table, size_t index, Vector2 velocity)
+{
+    size_t i, slot;
+    Vector2 *existing = find_velocity(table, index);
+    velocity_table_t bigger;
+
+    if (existing != NULL) {
+        *existing = velocity;
+        return;
+    }
+
+    /* Keep the table at most half full so the probes stay short */
+    if ((table->count + 1) * 2 > table->capacity) {
+        bigger.capacity = table->capacity == 0 ? 64 : table->capacity * 2;
+        bigger.count = 0;
+        bigger.entries = malloc(bigger.capacity * sizeof(*bigger.entries));
+
+        if (bigger.entries == NULL) {
+            fprintf(stderr, "Error: Could not allocate enough memory at %d in "
+                    "%s\n", __LINE__, __FILE__);
+            exit(EXIT_FAILURE);
+        }
+
+        for (i = 0; i < bigger.capacity; i++)
+            bigger.entries[i].index = SIZE_MAX;
+
+        for (i = 0; i < table->capacity; i++) {
+            if (table->entries[i].index != SIZE_MAX) {
+                put_velocity(&bigger, table->entries[i].index,
+                             table->entries[i].velocity);
+            }
+        }
+
+        free(table->entries);
+        *table = bigger;
+    }
+
+    slot = (size_t)((uint64_t)index * 0x9e3779b97f4a7c15ull)
+           & (table->capacity - 1);
+
+    while (table->entries[slot].index != SIZE_MAX)
+        slot = (slot + 1) & (table->capacity - 1);
+
+    table->entries[slot].index = index;
+    table->entries[slot].velocity = velocity;
+    table->count++;
+}
+
+void
+erase_velocity(velocity_table_t *table, size_t index)
+{
+    size_t slot, next, home;
+
+    if (find_velocity(table, index) == NULL)
+        return;
+
+    slot = (size_t)((uint64_t)index * 0x9e3779b97f4a7c15ull)
+           & (table->capacity - 1);
+
+    while (table->entries[slot].index != index)
+        slot = (slot + 1) & (table->capacity - 1);
+
+    table->entries[slot].index = SIZE_MAX;
+    table->count--;
+
+    /**
+     * Shift later entries of the same probe run back into the hole so lookups
+     * don't stop early (this is instead of leaving tombstones around)
+     */
+    next = (slot + 1) & (table->capacity - 1);
+
+    while (table->entries[next].index != SIZE_MAX) {
+        home = (size_t)((uint64_t)table->entries[next].index
+                        * 0x9e3779b97f4a7c15ull) & (table->capacity - 1);
+
+        if (((next - home) & (table->capacity - 1))
+            >= ((next - slot) & (table->capacity - 1))) {
+            table->entries[slot] = table->entries[next];
+            table->entries[next].index = SIZE_MAX;
+            slot = next;
+        }
+
+        next = (next + 1) & (table->capacity - 1);
+    }
+}
+
+bool
+copy_velocity_table(velocity_table_t *dest, const velocity_table_t *src)
+{
+    velocity_entry_t *entries = dest->entries;
+
+    if (src->capacity > dest->capacity) {
+        entries = realloc(dest->entries, src->capacity * sizeof(*entries));
+
+        if (entries == NULL)
+            return false;
+    }
+
+    *dest = *src;
+    dest->entries = entries;
+
+    if (src->capacity > 0)
+        memcpy(entries, src->entries, src->capacity * sizeof(*entries));
+
+    return true;
+}
+
+bool
+get_velocity(const grid_t *grid, int x, int y, Vector2 *velocity)
+{
+    const particle_t *p = get_particle(grid, x, y);
+    Vector2 *found = NULL;
+
+    velocity->x = 0.0f;
+    velocity->y = 0.0f;
+
+    if (p == NULL || !(p->state & STATE_HAS_VELOCITY))
+        return false;
+
+    found = find_velocity(&grid->velocities, get_index(grid, x, y));
+    if (found == NULL)
+        return false;
+
+    *velocity = *found;
+
+    return true;
+}
+
+void
+set_velocity(grid_t *grid, int x, int y, Vector2 velocity)
+{
+    particle_t *p = NULL;
+
+    if (x < 0 || x >= grid->width || y < 0 || y >= grid->height)
+        return;
+
+    record_particle(grid, x, y);
+
+    p = get_particle_mut(grid, x, y);
+    p->state |= STATE_HAS_VELOCITY;
+    put_velocity(&grid->velocities, get_index(grid, x, y), velocity);
+    update_planes(grid, x, y);
+}
+
+void
+clear_velocity(grid_t *grid, int x, int y)
+{
+    particle_t *p = NULL;
+    const particle_t *curr = get_particle(grid, x, y);
+
+    if (curr == NULL || !(curr->state & STATE_HAS_VELOCITY))
+        return;
+
+    record_particle(grid, x, y);
+
+    p = get_particle_mut(grid, x, y);
+    p->state &= ~STATE_HAS_VELOCITY;
+    erase_velocity(&grid->velocities, get_index(grid, x, y));
+    update_planes(grid, x, y);
+}
+
+void
+read_cell(const grid_t *grid, size_t index, cell_record_t *record)
+{
+    const particle_t *p = get_particle_at(grid, index);
+    uint32_t handle = get_timer(grid, index);
+    Vector2 *velocity = NULL;
+    int x, y;
+
+    record->index = index;
+    record->particle = *p;
+    record->expires = handle != TIMER_NONE ? grid->timers.events[handle].due
+                                           : 0;
+    record->velocity = (Vector2){0.0f, 0.0f};
+    record->mass = 0.0f;
+
+    if (grid->pressure) {
+        get_position(grid, index, &x, &y);
+        record->mass = get_mass(grid, x, y);
+    }
+
+    if (p->state & STATE_HAS_VELOCITY) {
+        velocity = find_velocity(&grid->velocities, index);
+        if (velocity != NULL)
+            record->velocity = *velocity;
+    }
+}
+
+void
+write_cell(grid_t *grid, const cell_record_t *record)
+{
+    size_t index = record->index;
+    chunk_t *chunk = get_chunk_mut(grid, index);
+    size_t offset = index & (((size_t)1 << grid->chunk_shift) - 1);
+    int x, y;
+
+    if (chunk->cells[offset].state & STATE_HAS_VELOCITY)
+        erase_velocity(&grid->velocities, index);
+
+    if (chunk->timers[offset] != TIMER_NONE)
+        remove_timer(&grid->timers, chunk->timers[offset]);
+
+    chunk->cells[offset] = record->particle;
+    chunk->timers[offset] = record->expires != 0
+                            ? add_timer(&grid->timers, index, record->expires)
+                            : TIMER_NONE;
+
+    if (record->particle.state & STATE_HAS_VELOCITY)
+        put_velocity(&grid->velocities, index, record->velocity);
+
+    get_position(grid, index, &x, &y);
+    update_planes(grid, x, y);
+
+    /**
+     * Cells logged outside of pressure mode have no mass, which
+     * update_pressure fills back up if they're water
+     */
+    if (grid->pressure)
+        set_mass(grid, x, y, record->mass);
+}
+
+material_type
+get_particle_type(const particle_t *p)
+{
+    return p->mat_type;
+}
+
+material_type
+get_particle_type_pos(const grid_t *grid, int x, int y)
+{
+    /* TODO: Fix this */
+    if (x < 0 || x >= grid->width || y < 0 || y >= grid->height)
+        return MAT_EMPTY;
+
+    return get_particle(grid, x, y)->mat_type;
+}
+
+void
+ignite_particle(grid_t *grid, int x, int y, element_type e)
+{
+    Vector2 velocity;
+    bool moving = get_velocity(grid, x, y, &velocity);
+
+    remove_particle(grid, x, y);
+    add_particle(grid, x,  y, MAT_FIRE);
+    set_particle_elem(get_particle_mut(grid, x, y), e);
+    update_planes(grid, x, y);
+
+    if (moving)
+        set_velocity(grid, x, y, velocity);
+}
+
+void
+add_particle(grid_t *grid, int x, int y, material_type m)
+{
+    particle_t part = {MAT_EMPTY, ELEM_EMPTY};
+    uint32_t life_time = 0;
+
+    if (!is_pos_empty(grid, x, y))
+        return;
+
+    part.mat_type = m;
+
+    switch (m) {
+        case MAT_SAND:
+            part.state = ELEM_SOLID;
+            break;
+        case MAT_WATER:
+            part.state = ELEM_LIQUID;
+            break;
+        case MAT_SMOKE:
+            part.state = ELEM_GAS;
+            life_time = 45 + grid_rand(grid) % 31;
+            break;
+        case MAT_OIL:
+            part.state = ELEM_LIQUID;
+            break;
+        case MAT_WALL:
+            part.state = ELEM_STATIC;
+            break;
+        case MAT_WOOD:
+            part.state = ELEM_STATIC;
+            break;
+        case MAT_FIRE:
+            part.state = ELEM_SOLID;
+            life_time = 90 + grid_rand(grid) % 37;
+            break;
+        case MAT_FLAME:
+            part.state = ELEM_GAS;
+            life_time = 8 + grid_rand(grid) % 9;
+            break;
+        case MAT_POWDER:
+            part.state = ELEM_SOLID;
+            break;
+        case MAT_WIRE:
+            part.state = ELEM_STATIC;
+            break;
+        case MAT_BATTERY:
+            part.state = ELEM_STATIC;
+            break;
+        default:
+            break;
+    }
+
+    set_particle(grid, x, y, &part, life_time);
+}
+
+void
+remove_particle(grid_t *grid, int x, int y)
+{
+    particle_t empty_particle = {MAT_EMPTY, ELEM_EMPTY};
+
+    if (is_pos_empty(grid, x,  y))
+        return;
+
+    set_particle(grid, x, y, &empty_particle, 0);
+}
+
+void
+swap_particles(grid_t *grid, int x1, int y1, int x2, int y2)
+{
+    size_t index1 = get_index(grid, x1, y1);
+    size_t index2 = get_index(grid, x2, y2);
+    particle_t *p1 = NULL, *p2 = NULL;
+    particle_t temp;
+    uint32_t timer1, timer2;
+    Vector2 vel1, vel2;
+    bool moving1, moving2;
+    float mass;
+
+    record_particle(grid, x1, y1);
+    record_particle(grid, x2, y2);
+
+    p1 = get_particle_mut(grid, x1, y1);
+    p2 = get_particle_mut(grid, x2, y2);
+
+    /* Velocities are keyed by index, so they only move if there are any */
+    if ((p1->state | p2->state) & STATE_HAS_VELOCITY) {
+        moving1 = get_velocity(grid, x1, y1, &vel1);
+        moving2 = get_velocity(grid, x2, y2, &vel2);
+
+        erase_velocity(&grid->velocities, index1);
+        erase_velocity(&grid->velocities, index2);
+
+        if (moving1)
+            put_velocity(&grid->velocities, index2, vel1);
+        if (moving2)
+            put_velocity(&grid->velocities, index1, vel2);
+    }
+
+    temp = *p1;
+    *p1 = *p2;
+    *p2 = temp;
+
+    /* Timers point back at their particle, so they have to follow it too */
+    timer1 = get_timer(grid, index1);
+    timer2 = get_timer(grid, index2);
+
+    if ((timer1 | timer2) != TIMER_NONE) {
+        set_timer(grid, index1, timer2);
+        set_timer(grid, index2, timer1);
+
+        if (timer1 != TIMER_NONE)
+            grid->timers.events[timer1].index = index2;
+        if (timer2 != TIMER_NONE)
+            grid->timers.events[timer2].index = index1;
+    }
+
+    /* So does however much water it has in pressure mode */
+    if (grid->pressure) {
+        mass = get_mass(grid, x1, y1);
+        set_mass(grid, x1, y1, get_mass(grid, x2, y2));
+        set_mass(grid, x2, y2, mass);
+    }
+
+    update_planes(grid, x1, y1);
+    update_planes(grid, x2, y2);
+
+    set_updated(grid, x1, y1, true);
+    set_updated(grid, x2, y2, true);
+}
+
+void
+particle_line(grid_t *grid, int x1, int y1, int x2, int y2, material_type m)
+{
+    if (x1 > grid->width)
+        x1 = grid->width;
+    if (x2 > grid->width)
+        x2 = grid->width;
+    if (y1 > grid->height)
+        y1 = grid->height;
+    if (y2 > grid->height)
+        y2 = grid->height;
+
+    int dx = abs(x2 - x1);
+    int sx = x1 < x2 ? 1 : -1;
+    int dy = -abs(y2 - y1);
+    int sy = y1 < y2 ? 1 : -1;
+    int error = dx + dy;
+    int e2;
+
+    /** 
+     * The if-else checks containing the while loops used to be within the
+     * loops. They were moved out here as a little bit of optimization because
+     * the check only needs to be done once to decide if a particle is getting
+     * added or removed. Having it within the loop made it check ever iteration,
+     * which was largely unnecessary. This does make the code uglier, but who
+     * cares
+     */
+    if (m == MAT_EMPTY) {
+        while (1) {
+            remove_particle(grid, x1, y1);
+            if (x1 == x2 && y1 == y2)
+                break;
+
+            e2 = 2 * error;
+
+            if (e2 >= dy) {
+                if (x1 == x2)
+                    break;
+
+                error += dy;
+                x1 += sx;
+            }
+
+            if (e2 <= dx) {
+                if (y1 == y2)
+                    break;
+
+                error += dx;
+                y1 += sy;
+            }
+        }
+    }
+    else {
+        while (1) {
+            add_particle(grid, x1, y1, m);
+            if (x1 == x2 && y1 == y2)
+                break;
+
+            e2 = 2 * error;
+
+            if (e2 >= dy) {
+                if (x1 == x2)
+                    break;
+
+                error += dy;
+                x1 += sx;
+            }
+
+            if (e2 <= dx) {
+                if (y1 == y2)
+                    break;
+
+                error += dx;
+                y1 += sy;
+            }
+        }
+    }
+}
+
+history_t *
+new_history(int max_ticks, size_t max_records, int keyframe_interval)
+{
+    int i;
+    history_t *history = malloc(sizeof(*history));
+
+    if (history == NULL) {
+        fprintf(stderr, "Error: Could not allocate enough memory at %d in %s\n",
+                __LINE__, __FILE__);
+        exit(EXIT_FAILURE);
+    }
+
+    history->records = malloc(max_records * sizeof(*history->records));
+    history->record_cap = max_records;
+    history->record_head = 0;
+    history->tick_starts = malloc(max_ticks * sizeof(*history->tick_starts));
+    history->extras = calloc(max_ticks, sizeof(*history->extras));
+    history->extra_bytes = 0;
+    history->extra_cap = HISTORY_EXTRA_BYTES;
+    history->tick_cap = max_ticks;
+    history->tick_first = 0;
+    history->tick_count = 0;
+    history->tick = 0;
+    history->overflowed = false;
+    history->keyframe_interval = keyframe_interval;
+    history->keyframe_count = 0;
+    history->masses = NULL;
+    history->mass_capacity = 0;
+    history->wind_saved = false;
+    history->solver_saved = false;
+    init_field(&history->heat);
+    init_field(&history->smoke);
+
+    for (i = 0; i < HISTORY_KEYFRAMES; i++) {
+        history->keyframes[i].tick = 0;
+        history->keyframes[i].chunk_count = 0;
+        history->keyframes[i].chunks = NULL;
+        history->keyframes[i].pressure = false;
+        history->keyframes[i].velocities.entries = NULL;
+        history->keyframes[i].velocities.capacity = 0;
+        history->keyframes[i].velocities.count = 0;
+        init_timer_wheel(&history->keyframes[i].timers);
+        history->keyframes[i].extras.data = NULL;
+        history->keyframes[i].extras.size = 0;
+        history->keyframes[i].extras.capacity = 0;
+    }
+
+    if (history->records == NULL || history->tick_starts == NULL
+        || history->extras == NULL) {
+        fprintf(stderr, "Error: Could not allocate enough memory at %d in %s\n",
+                __LINE__, __FILE__);
+        exit(EXIT_FAILURE);
+    }
+
+    return history;
+}
+
+void
+destroy_history(history_t *history)
+{
+    int i;
+
+    for (i = 0; i < HISTORY_KEYFRAMES; i++) {
+        release_keyframe(&history->keyframes[i]);
+        free(history->keyframes[i].chunks);
+        free(history->keyframes[i].velocities.entries);
+        free(history->keyframes[i].timers.events);
+        free(history->keyframes[i].extras.data);
+    }
+
+    for (i = 0; i < history->tick_cap; i++)
+        free(history->extras[i].data);
+
+    free_field(&history->heat);
+    free_field(&history->smoke);
+    free(history->masses);
+    free(history->extras);
+    free(history->tick_starts);
+    free(history->records);
+    free(history);
+}
+
+void
+take_keyframe(grid_t *grid)
+{
+    history_t *history = grid->history;
+    keyframe_t *kf = NULL;
+    keyframe_t oldest;
+    int i;
+
+    /* Keyframes are kept sorted oldest to newest, so the oldest is recycled */
+    kf = &history->keyframes[history->keyframe_count == HISTORY_KEYFRAMES
+                             ? 0 : history->keyframe_count];
+    release_keyframe(kf);
+
+    if (kf->chunks == NULL)
+        kf->chunks = malloc(grid->chunk_count * sizeof(*kf->chunks));
+
+    if (kf->chunks == NULL
+        || !copy_velocity_table(&kf->velocities, &grid->velocities)
+        || !copy_timer_wheel(&kf->timers, &grid->timers)) {
+        fprintf(stderr, "Error: Could not allocate enough memory at %d in %s\n",
+                __LINE__, __FILE__);
+        exit(EXIT_FAILURE);
+    }
+
+    kf->tick = history->tick;
+    kf->chunk_count = grid->chunk_count;
+    kf->pressure = grid->pressure;
+
+    for (i = 0; i < grid->chunk_count; i++) {
+        kf->chunks[i] = grid->chunks[i];
+        kf->chunks[i]->refs++;
+    }
+
+    kf->extras.size = 0;
+    save_extras(grid, &kf->extras);
+    save_field(&grid->heat, EXTRA_HEAT, &kf->extras);
+    save_field(&grid->smoke, EXTRA_SMOKE, &kf->extras);
+    save_wind(grid->wind, &kf->extras);
+    save_wind_solver(grid->wind, false, &kf->extras);
+
+    if (history->keyframe_count == HISTORY_KEYFRAMES) {
+        oldest = history->keyframes[0];
+
+        for (i = 1; i < HISTORY_KEYFRAMES; i++)
+            history->keyframes[i - 1] = history->keyframes[i];
+
+        history->keyframes[HISTORY_KEYFRAMES - 1] = oldest;
+        history->keyframe_count--;
+    }
+
+    history->keyframe_count++;
+}
+
+void
+begin_history_tick(grid_t *grid)
+{
+    history_t *history = grid->history;
+    int slot;
+
+    if (history == NULL)
+        return;
+
+    if (history->heat.cells == NULL) {
+        alloc_field(&history->heat, grid->width, grid->height);
+        alloc_field(&history->smoke, grid->width, grid->height);
+    }
+
+    /* With no ticks to go back to, there's nothing to save the changes for */
+    if (history->tick_count == 0) {
+        copy_field(&history->heat, &grid->heat);
+        copy_field(&history->smoke, &grid->smoke);
+    }
+
+    if (history->tick_count == history->tick_cap)
+        drop_oldest_tick(history);
+
+    slot = (history->tick_first + history->tick_count) % history->tick_cap;
+    history->tick_starts[slot] = history->record_head;
+    history->tick_count++;
+    history->tick++;
+    history->overflowed = false;
+    history->wind_saved = false;
+    history->solver_saved = false;
+
+    save_extras(grid, &history->extras[slot]);
+    save_field_changes(&grid->heat, &history->heat, EXTRA_HEAT_CHANGES,
+                       &history->extras[slot]);
+    save_field_changes(&grid->smoke, &history->smoke, EXTRA_SMOKE_CHANGES,
+                       &history->extras[slot]);
+    fit_extras(history, history->extras[slot].size);
+
+    if (history->tick % history->keyframe_interval == 0)
+        take_keyframe(grid);
+}
+
+void
+record_particle(grid_t *grid, int x, int y)
+{
+    history_t *history = grid->history;
+    size_t oldest;
+    cell_record_t *record = NULL;
+
+    if (history == NULL || history->overflowed || history->tick_count == 0)
+        return;
+
+    oldest = history->tick_starts[history->tick_first];
+
+    /* Make room by throwing away the oldest ticks */
+    while (history->record_head - oldest == history->record_cap) {
+        if (history->tick_count == 1) {
+            /* This tick alone is too big to undo, so forget everything */
+            drop_oldest_tick(history);
+            history->overflowed = true;
+            return;
+        }
+
+        drop_oldest_tick(history);
+        oldest = history->tick_starts[history->tick_first];
+    }
+
+    record = &history->records[history->record_head % history->record_cap];
+    read_cell(grid, get_index(grid, x, y), record);
+    history->record_head++;
+}
+
+void
+record_mass(grid_t *grid, int x, int y, float mass)
+{
+    history_t *history = grid->history;
+    size_t head = history->record_head;
+
+    record_particle(grid, x, y);
+
+    if (history->record_head != head)
+        history->records[head % history->record_cap].mass = mass;
+}
+
+void
+record_wind(grid_t *grid, bool stepping)
+{
+    history_t *history = grid->history;
+    extras_t *extras = NULL;
+    size_t size;
+
+    if (history == NULL || history->overflowed || history->tick_count == 0
+        || history->solver_saved)
+        return;
+
+    extras = &history->extras[(history->tick_first + history->tick_count - 1)
+                              % history->tick_cap];
+    size = extras->size;
+
+    if (!history->wind_saved) {
+        save_wind(grid->wind, extras);
+        history->wind_saved = true;
+
+        if (!stepping) {
+            save_wind_solver(grid->wind, false, extras);
+            history->solver_saved = true;
+        }
+    }
+    else {
+        /* It's changing again, so save what step_wind handed the gas */
+        save_wind_solver(grid->wind, true, extras);
+        history->solver_saved = true;
+    }
+
+    fit_extras(history, extras->size - size);
+}
+
+void
+release_keyframe(keyframe_t *keyframe)
+{
+    int i;
+
+    for (i = 0; i < keyframe->chunk_count; i++)
+        release_chunk(keyframe->chunks[i]);
+
+    keyframe->chunk_count = 0;
+}
+
+void
+drop_future_keyframes(history_t *history)
+{
+    while (history->keyframe_count > 0
+           && history->keyframes[history->keyframe_count - 1].tick
+              > history->tick) {
+        history->keyframe_count--;
+        release_keyframe(&history->keyframes[history->keyframe_count]);
+    }
+}
+
+void
+reset_history(history_t *history)
+{
+    while (history->tick_count > 0)
+        drop_oldest_tick(history);
+
+    while (history->keyframe_count > 0) {
+        history->keyframe_count--;
+        release_keyframe(&history->keyframes[history->keyframe_count]);
+    }
+
+    history->overflowed = false;
+}
+
+void
+drop_oldest_tick(history_t *history)
+{
+    free_tick_extras(history, history->tick_first);
+    history->tick_first = (history->tick_first + 1) % history->tick_cap;
+    history->tick_count--;
+}
+
+void
+free_tick_extras(history_t *history, int slot)
+{
+    extras_t *extras = &history->extras[slot];
+
+    history->extra_bytes -= extras->size;
+    free(extras->data);
+    extras->data = NULL;
+    extras->size = 0;
+    extras->capacity = 0;
+}
+
+void
+fit_extras(history_t *history, size_t added)
+{
+    history->extra_bytes += added;
+
+    while (history->extra_bytes > history->extra_cap
+           && history->tick_count > 0) {
+        /* This tick alone is too big to undo, so forget everything */
+        if (history->tick_count == 1)
+            history->overflowed = true;
+
+        drop_oldest_tick(history);
+    }
+}
+
+void
+put_extra(extras_t *extras, const void *data, size_t size)
+{
+    size_t capacity = extras->capacity;
+    unsigned char *bigger = NULL;
+
+    if (size == 0)
+        return;
+
+    if (extras->size + size > capacity) {
+        while (extras->size + size > capacity)
+            capacity = capacity == 0 ? 256 : capacity * 2;
+
+        bigger = realloc(extras->data, capacity);
+        if (bigger == NULL) {
+            fprintf(stderr, "Error: Could not allocate enough memory at %d in "
+                    "%s\n", __LINE__, __FILE__);
+            exit(EXIT_FAILURE);
+        }
+
+        extras->data = bigger;
+        extras->capacity = capacity;
+    }
+
+    memcpy(extras->data + extras->size, data, size);
+    extras->size += size;
+}
+
+void
+get_extra(const extras_t *extras, size_t *offset, void *data, size_t size)
+{
+    if (size == 0)
+        return;
+
+    memcpy(data, extras->data + *offset, size);
+    *offset += size;
+}
+
+void
+save_ejecta(const ejecta_t *ejecta, extras_t *extras)
+{
+    unsigned char type = EXTRA_EJECTA;
+    size_t n = ejecta->count;
+
+    put_extra(extras, &type, sizeof(type));
+    put_extra(extras, &n, sizeof(n));
+    put_extra(extras, ejecta->x, n * sizeof(*ejecta->x));
+    put_extra(extras, ejecta->y, n * sizeof(*ejecta->y));
+    put_extra(extras, ejecta->vx, n * sizeof(*ejecta->vx));
+    put_extra(extras, ejecta->vy, n * sizeof(*ejecta->vy));
+    put_extra(extras, ejecta->cell_x, n * sizeof(*ejecta->cell_x));
+    put_extra(extras, ejecta->cell_y, n * sizeof(*ejecta->cell_y));
+    put_extra(extras, ejecta->expires, n * sizeof(*ejecta->expires));
+    put_extra(extras, ejecta->particles, n * sizeof(*ejecta->particles));
+}
+
+void
+load_ejecta(ejecta_t *ejecta, const extras_t *extras, size_t *offset)
+{
+    size_t n;
+
+    get_extra(extras, offset, &n, sizeof(n));
+
+    if (!reserve_ejecta(ejecta, n)) {
+        fprintf(stderr, "Error: Could not allocate enough memory at %d in %s\n",
+                __LINE__, __FILE__);
+        exit(EXIT_FAILURE);
+    }
+
+    get_extra(extras, offset, ejecta->x, n * sizeof(*ejecta->x));
+    get_extra(extras, offset, ejecta->y, n * sizeof(*ejecta->y));
+    get_extra(extras, offset, ejecta->vx, n * sizeof(*ejecta->vx));
+    get_extra(extras, offset, ejecta->vy, n * sizeof(*ejecta->vy));
+    get_extra(extras, offset, ejecta->cell_x, n * sizeof(*ejecta->cell_x));
+    get_extra(extras, offset, ejecta->cell_y, n * sizeof(*ejecta->cell_y));
+    get_extra(extras, offset, ejecta->expires, n * sizeof(*ejecta->expires));
+    get_extra(extras, offset, ejecta->particles,
+              n * sizeof(*ejecta->particles));
+    ejecta->count = n;
+}
+
+void
+save_field(const coarse_field_t *field, extra_type type, extras_t *extras)
+{
+    unsigned char tag = type;
+    int y, rows = 0;
+
+    for (y = 0; y < field->height && field->live; y++)
+        rows += field->rows[y];
+
+    put_extra(extras, &tag, sizeof(tag));
+    put_extra(extras, &rows, sizeof(rows));
+
+    for (y = 0; y < field->height && rows > 0; y++) {
+        if (!field->rows[y])
+            continue;
+
+        put_extra(extras, &y, sizeof(y));
+        put_extra(extras, &field->cells[(size_t)y * field->width],
+                  field->width * sizeof(*field->cells));
+    }
+}
+
+void
+load_field(coarse_field_t *field, const extras_t *extras, size_t *offset)
+{
+    int y, rows;
+
+    clear_field(field);
+    get_extra(extras, offset, &rows, sizeof(rows));
+
+    for (; rows > 0; rows--) {
+        get_extra(extras, offset, &y, sizeof(y));
+        get_extra(extras, offset, &field->cells[(size_t)y * field->width],
+                  field->width * sizeof(*field->cells));
+        field->rows[y] = true;
+        field->live = true;
+    }
+}
+
+void
+save_field_changes(const coarse_field_t *field, coarse_field_t *saved,
+                   extra_type type, extras_t *extras)
+{
+    unsigned char tag = type;
+    size_t width = (size_t)field->width, start;
+    const float *now = NULL;
+    float *then = NULL;
+    int y, first, last, rows = 0;
+
+    put_extra(extras, &tag, sizeof(tag));
+    put_extra(extras, &saved->live, sizeof(saved->live));
+
+    /* How many rows changed isn't known yet, so it's filled in after */
+    start = extras->size;
+    put_extra(extras, &rows, sizeof(rows));
+
+    for (y = 0; y < field->height && (field->live || saved->live); y++) {
+        if (!field->rows[y] && !saved->rows[y])
+            continue;
+
+        now = &field->cells[y * width];
+        then = &saved->cells[y * width];
+
+        /**
+         * Heat and smoke spread out from a few spots, so what changed in a
+         * row is usually one run of cells and only that run is saved
+         */
+        first = 0;
+        last = field->width;
+
+        while (first < last && now[first] == then[first])
+            first++;
+
+        if (first == field->width && field->rows[y] == saved->rows[y])
+            continue;
+
+        while (last > first && now[last - 1] == then[last - 1])
+            last--;
+
+        put_extra(extras, &y, sizeof(y));
+        put_extra(extras, &saved->rows[y], sizeof(saved->rows[y]));
+        put_extra(extras, &first, sizeof(first));
+        put_extra(extras, &last, sizeof(last));
+
+        /* A row with nothing in it was all zeros, so there's nothing to save */
+        if (saved->rows[y])
+            put_extra(extras, &then[first], (last - first) * sizeof(*then));
+
+        memcpy(&then[first], &now[first], (last - first) * sizeof(*then));
+        saved->rows[y] = field->rows[y];
+        rows++;
+    }
+
+    memcpy(&extras->data[start], &rows, sizeof(rows));
+    saved->live = field->live;
+}
+
+void
+load_field_changes(coarse_field_t *saved, const extras_t *extras,
+                   size_t *offset)
+{
+    float *then = NULL;
+    int y, first, last, rows;
+
+    get_extra(extras, offset, &saved->live, sizeof(saved->live));
+    get_extra(extras, offset, &rows, sizeof(rows));
+
+    for (; rows > 0; rows--) {
+        get_extra(extras, offset, &y, sizeof(y));
+        get_extra(extras, offset, &saved->rows[y], sizeof(saved->rows[y]));
+        get_extra(extras, offset, &first, sizeof(first));
+        get_extra(extras, offset, &last, sizeof(last));
+        then = &saved->cells[(size_t)y * saved->width];
+
+        if (saved->rows[y])
+            get_extra(extras, offset, &then[first],
+                      (last - first) * sizeof(*then));
+        else
+            memset(&then[first], 0, (last - first) * sizeof(*then));
+    }
+}
+
+void
+save_wind(wind_field_t *wind, extras_t *extras)
+{
+    unsigned char tag = EXTRA_WIND;
+    size_t size = (size_t)wind->width * (size_t)wind->height
+                  * sizeof(*wind->vx);
+
+    /* calm belongs to the solver, which might still be working it out */
+    wait_wind(wind);
+
+    put_extra(extras, &tag, sizeof(tag));
+    put_extra(extras, &wind->still, sizeof(wind->still));
+    put_extra(extras, &wind->calm, sizeof(wind->calm));
+
+    if (!wind->still) {
+        put_extra(extras, wind->vx, size);
+        put_extra(extras, wind->vy, size);
+    }
+}
+
+void
+save_wind_solver(wind_field_t *wind, bool handed, extras_t *extras)
+{
+    unsigned char tag = EXTRA_WIND_SOLVER;
+    size_t size = (size_t)wind->width * (size_t)wind->height
+                  * sizeof(*wind->vx);
+    bool still;
+
+    wait_wind(wind);
+    still = handed ? wind->still : wind->calm;
+
+    put_extra(extras, &tag, sizeof(tag));
+    put_extra(extras, &still, sizeof(still));
+
+    if (!still) {
+        put_extra(extras, handed ? wind->vx : wind->solver_vx, size);
+        put_extra(extras, handed ? wind->vy : wind->solver_vy, size);
+    }
+}
+
+void
+load_wind(wind_field_t *wind, const extras_t *extras, size_t *offset)
+{
+    size_t size = (size_t)wind->width * (size_t)wind->height
+                  * sizeof(*wind->vx);
+
+    wait_wind(wind);
+    unshare_wind(wind);
+
+    if (wind->still) {
+        memset(wind->solver_vx, 0, size);
+        memset(wind->solver_vy, 0, size);
+    }
+    else {
+        memcpy(wind->solver_vx, wind->vx, size);
+        memcpy(wind->solver_vy, wind->vy, size);
+    }
+
+    get_extra(extras, offset, &wind->still, sizeof(wind->still));
+    get_extra(extras, offset, &wind->calm, sizeof(wind->calm));
+
+    if (wind->still) {
+        memset(wind->vx, 0, size);
+        memset(wind->vy, 0, size);
+    }
+    else {
+        get_extra(extras, offset, wind->vx, size);
+        get_extra(extras, offset, wind->vy, size);
+    }
+}
+
+void
+load_wind_solver(wind_field_t *wind, const extras_t *extras, size_t *offset)
+{
+    size_t size = (size_t)wind->width * (size_t)wind->height
+                  * sizeof(*wind->vx);
+    bool still;
+
+    wait_wind(wind);
+    unshare_wind(wind);
+    get_extra(extras, offset, &still, sizeof(still));
+
+    if (still) {
+        memset(wind->solver_vx, 0, size);
+        memset(wind->solver_vy, 0, size);
+    }
+    else {
+        get_extra(extras, offset, wind->solver_vx, size);
+        get_extra(extras, offset, wind->solver_vy, size);
+    }
+}
+
+void
+save_extras(const grid_t *grid, extras_t *extras)
+{
+    unsigned char tag = EXTRA_RNG;
+
+    /* Replaying from here has to roll the same numbers as the first time */
+    put_extra(extras, &tag, sizeof(tag));
+    put_extra(extras, &grid->rng, sizeof(grid->rng));
+    save_ejecta(&grid->ejecta, extras);
+}
+
+void
+load_extras(grid_t *grid, const extras_t *extras)
+{
+    size_t offset = 0;
+    unsigned char type;
+
+    while (offset < extras->size) {
+        get_extra(extras, &offset, &type, sizeof(type));
+
+        switch (type) {
+            case EXTRA_EJECTA:
+                load_ejecta(&grid->ejecta, extras, &offset);
+                break;
+            case EXTRA_HEAT:
+                load_field(&grid->heat, extras, &offset);
+                break;
+            case EXTRA_HEAT_CHANGES:
+                load_field_changes(&grid->history->heat, extras, &offset);
+                break;
+            case EXTRA_SMOKE:
+                load_field(&grid->smoke, extras, &offset);
+                break;
+            case EXTRA_SMOKE_CHANGES:
+                load_field_changes(&grid->history->smoke, extras, &offset);
+                break;
+            case EXTRA_WIND:
+                load_wind(grid->wind, extras, &offset);
+                break;
+            case EXTRA_WIND_SOLVER:
+                load_wind_solver(grid->wind, extras, &offset);
+                break;
+            case EXTRA_RNG:
+                get_extra(extras, &offset, &grid->rng, sizeof(grid->rng));
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+bool
+step_back_history(grid_t *grid)
+{
+    history_t *history = grid->history;
+    size_t start;
+    cell_record_t *record = NULL;
+    int slot;
+
+    if (history == NULL || history->tick_count == 0)
+        return false;
+
+    slot = (history->tick_first + history->tick_count - 1) % history->tick_cap;
+    start = history->tick_starts[slot];
+
+    /**
+     * Timers that get put back are due after the tick being undone, so the
+     * clock has to go back first
+     */
+    grid->timers.now--;
+
+    /**
+     * The ejecta, heat, smoke and random numbers go back to how they were when
+     * the tick started, and so does the wind if the tick changed it. The heat
+     * and smoke the tick started with are the history's copies, and the
+     * tick's changes take those back to the tick before
+     */
+    copy_field(&grid->heat, &history->heat);
+    copy_field(&grid->smoke, &history->smoke);
+    load_extras(grid, &history->extras[slot]);
+
+    /**
+     * Blasts still waiting to go off aren't in the extras, but the
+     * explosives that set them off are put back
+     */
+    grid->blasts.count = 0;
+
+    /* Undo in reverse so cells changed twice end up with the oldest value */
+    while (history->record_head > start) {
+        history->record_head--;
+        record = &history->records[history->record_head % history->record_cap];
+        write_cell(grid, record);
+    }
+
+    free_tick_extras(history, slot);
+    history->tick_count--;
+    history->tick--;
+    drop_future_keyframes(history);
+
+    return true;
+}
+
+bool
+restore_keyframe(grid_t *grid)
+{
+    history_t *history = grid->history;
+    keyframe_t *kf = NULL;
+    bool pressure = grid->pressure;
+    int i, slot;
+
+    if (history == NULL || history->keyframe_count == 0)
+        return false;
+
+    kf = &history->keyframes[history->keyframe_count - 1];
+
+    /**
+     * The keyframe is the state at the start of its tick, so that tick goes.
+     * The extras are put back along the way only so the history's copies of
+     * the heat and smoke go back with them, the keyframe replaces the rest
+     * after
+     */
+    while (history->tick_count > 0 && history->tick >= kf->tick) {
+        slot = (history->tick_first + history->tick_count - 1)
+               % history->tick_cap;
+        load_extras(grid, &history->extras[slot]);
+        history->record_head = history->tick_starts[slot];
+        free_tick_extras(history, slot);
+        history->tick_count--;
+        history->tick--;
+    }
+
+    history->tick = kf->tick - 1;
+
+    if (!copy_velocity_table(&grid->velocities, &kf->velocities)
+        || !copy_timer_wheel(&grid->timers, &kf->timers)) {
+        fprintf(stderr, "Error: Could not allocate enough memory at %d in %s\n",
+                __LINE__, __FILE__);
+        exit(EXIT_FAILURE);
+    }
+
+    /**
+     * Grab the keyframe's chunk before releasing ours in case they're shared.
+     * Only the chunks that aren't the keyframe's any more have to be labelled
+     * again
+     */
+    for (i = 0; i < grid->chunk_count; i++) {
+        if (grid->chunks[i] == kf->chunks[i])
+            continue;
+
+        if (grid->bodies.chunks != NULL)
+            grid->bodies.dirty[i] = true;
+        if (grid->structures.chunks != NULL)
+            grid->structures.dirty[i] = true;
+        if (grid->circuits.chunks != NULL)
+            grid->circuits.dirty[i] = true;
+
+        kf->chunks[i]->refs++;
+        release_chunk(grid->chunks[i]);
+        grid->chunks[i] = kf->chunks[i];
+    }
+
+    /* Water stays in whichever mode it's in now */
+    grid->pressure = kf->pressure;
+    set_pressure_water(grid, pressure);
+
+    memset(grid->settled, 0,
+           (get_storage_count(grid) + 63) / 64 * sizeof(*grid->settled));
+
+    grid->blasts.count = 0;
+    load_extras(grid, &kf->extras);
+    drop_future_keyframes(history);
+
+    return true;
+}
+
+bool
+is_particle_empty(const particle_t *particle)
+{
+    return particle->mat_type == MAT_EMPTY;
+}
+
+bool 
+is_particle_static(const particle_t *particle)
+{
+    return get_particle_elem(particle) == ELEM_STATIC;
+}
+
+bool 
+is_particle_solid(const particle_t *particle)
+{
+    return get_particle_elem(particle) == ELEM_SOLID;
+}
+
+bool 
+is_particle_liquid(const particle_t *particle)
+{
+    return get_particle_elem(particle) == ELEM_LIQUID;
+}
+
+bool 
+is_particle_gas(const particle_t *particle)
+{
+    return get_particle_elem(particle) == ELEM_GAS;
+}
+
+bool
+is_pos_empty(const grid_t *grid, int x, int y)
+{
+    if (x < 0 || x >= grid->width || y < 0 || y >= grid->height)
+        return false;
+
+    return !test_plane(grid, PLANE_OCCUPIED, x, y);
+}
+
+bool 
+is_pos_static(const grid_t *grid, int x, int y)
+{
+    if (x < 0 || x >= grid->width || y < 0 || y >= grid->height)
+        return false;
+
+    return test_plane(grid, ELEM_STATIC, x, y);
+}
+
+bool 
+is_pos_solid(const grid_t *grid, int x, int y)
+{
+    if (x < 0 || x >= grid->width || y < 0 || y >= grid->height)
+        return false;
+
+    return test_plane(grid, ELEM_SOLID, x, y);
+}
+
+bool 
+is_pos_liquid(const grid_t *grid, int x, int y)
+{
+    if (x < 0 || x >= grid->width || y < 0 || y >= grid->height)
+        return false;
+
+    return test_plane(grid, ELEM_LIQUID, x, y);
+}
+
+bool 
+is_pos_gas(const grid_t *grid, int x, int y)
+{
+    if (x < 0 || x >= grid->width || y < 0 || y >= grid->height)
+        return false;
+
+    return test_plane(grid, ELEM_GAS, x, y);
+}
+
+void update_empty(grid_t *grid, int x, int y)
+{
+    const particle_t *curr_particle = get_particle(grid, x, y);
+
+    if (curr_particle == NULL)
+        return;
+
+    set_updated(grid, x, y, true);
+}
+
+void
+update_sand(grid_t *grid, int x, int y)
+{
+    int below = y - 1;
+    int left  = x - 1, right = x + 1;
+    const particle_t *curr_particle = get_particle(grid, x, y);
+
+    if (curr_particle == NULL)
+        return;
+
+    if (fly_particle(grid, x, y))
+        return;
+
+    if (y == 0) {
+        set_updated(grid, x, y, true);
+        return;
+    }
+
+    if (drop_column(grid, x, y))
+        return;
+    
+    if (is_pos_empty(grid, x, below)) {
+        swap_particles(grid, x, y, x, below);
+        start_falling(grid, x, below);
+    }
+    else if (is_pos_liquid(grid, x, below) || is_pos_gas(grid, x, below)) {
+        swap_particles(grid, x, y, x, below);
+    }
+    else if ((is_pos_empty(grid, left, below)
+             || is_pos_liquid(grid, left, below)
+             || is_pos_gas(grid, left, below))
+             && !is_pos_static(grid, x, below)) {
+        swap_particles(grid, x, y, left, below);
+    }
+    else if ((is_pos_empty(grid, right, below)
+             || is_pos_liquid(grid, right, below)
+             || is_pos_gas(grid, right, below))
+             && !is_pos_static(grid, x, below)) {
+        swap_particles(grid, x, y, right, below);
+    }
+
+    set_updated(grid, x, y, true);
+}
+
+void 
+update_water(grid_t *grid, int x, int y)
+{
+    int below = y - 1;
+    int left  = x - 1, right = x + 1;
+    const particle_t *curr_particle = get_particle(grid, x, y);
+
+    if (curr_particle == NULL)
+        return;
+
+    /* In pressure mode, update_pressure moves all of the water at once */
+    if (grid->pressure) {
+        set_settled(grid, x, y, true);
+        set_updated(grid, x, y, true);
+        return;
+    }
+
+    if (fly_particle(grid, x, y))
+        return;
+
+    if (drop_column(grid, x, y))
+        return;
+
+    if (is_pos_empty(grid, x, below)) {
+        swap_particles(grid, x, y, x, below);
+        start_falling(grid, x, below);
+    }
+    else if (is_pos_gas(grid, x, below)
+             || get_particle_type_pos(grid, x, below) == MAT_OIL) {
+        swap_particles(grid, x, y, x, below);
+    }
+    else if ((is_pos_empty(grid, left, below)
+             || is_pos_gas(grid, left, below)
+             || get_particle_type_pos(grid, left, below) == MAT_OIL)
+             && !is_pos_static(grid, x, below)) {
+        swap_particles(grid, x, y, left, below);
+    }
+    else if ((is_pos_empty(grid, right, below)
+             || is_pos_gas(grid, right, below)
+             || get_particle_type_pos(grid, right, below) == MAT_OIL)
+             && !is_pos_static(grid, x, below)) {
+        swap_particles(grid, x, y, right, below);
+    }
+    else if (is_pos_empty(grid, left, y)) {
+        swap_particles(grid, x, y, find_dispersal(grid, x, y, -1,
+                                                  dispersion_rates[MAT_WATER]),
+                       y);
+    }
+    else if (is_pos_gas(grid, left, y)
+             || get_particle_type_pos(grid, left, y) == MAT_OIL) {
+        swap_particles(grid, x, y, left, y);
+    }
+    else if (is_pos_empty(grid, right, y)) {
+        swap_particles(grid, x, y, find_dispersal(grid, x, y, 1,
+                                                  dispersion_rates[MAT_WATER]),
+                       y);
+    }
+    else if (is_pos_gas(grid, right, y)
+             || get_particle_type_pos(grid, right, y) == MAT_OIL) {
+        swap_particles(grid, x, y, right, y);
+    }
+    else {
+        /* Nothing it looked at can move it, so it rests until one changes */
+        set_settled(grid, x, y, true);
+    }
+
+    set_updated(grid, x, y, true);
+}
+
+void
+update_smoke(grid_t *grid, int x, int y)
+{
+    int above = y + 1;
+    int left = x - 1, right = x + 1;
+    const particle_t *curr_particle = get_particle(grid, x, y);
+
+    if (curr_particle == NULL)
+        return;
+
+    /**
+     * Smoke that drifts into the thick of the smoke field joins it, and so
+     * does smoke packed in tight with other gas
+     */
+    if ((get_field(&grid->smoke, x, y) >= SMOKE_DENSE
+         && !is_smoke_edge(&grid->smoke, x >> FIELD_SHIFT, y >> FIELD_SHIFT))
+        || count_field_cell(grid, ELEM_GAS, x >> FIELD_SHIFT,
+                            y >> FIELD_SHIFT) >= SMOKE_PACKED) {
+        absorb_smoke(grid, x, y);
+        return;
+    }
+
+    /* Where there's wind, it decides where the smoke goes */
+    if (blow_gas(grid, x, y))
+        return;
+
+    if (y == grid->height) {
+        set_updated(grid, x, y, true);
+        return;
+    }
+
+    if (is_pos_empty(grid, x, above)) {
+        swap_particles(grid, x, y, x, above);
+    }
+    else if (is_pos_empty(grid, left, above)
+             && !is_pos_static(grid, x, above)) {
+        swap_particles(grid, x, y, left, above);
+    }
+    else if (is_pos_empty(grid, right, above)
+             && !is_pos_static(grid, x, above)) {
+        swap_particles(grid, x, y, right, above);
+    }
+    else if (is_pos_empty(grid, left, y)) {
+        swap_particles(grid, x, y, left, y);
+    }
+    else if (is_pos_empty(grid, right, y)) {
+        swap_particles(grid, x, y, right, y);
+    }
+
+    set_updated(grid, x, y, true);
+}
+
+void
+update_oil(grid_t *grid, int x, int y)
+{
+    int r = 0;
+    int above = y + 1, below = y - 1;
+    int left = x - 1, right = x + 1;
+    const particle_t *curr_particle = get_particle(grid, x, y);
+    const particle_t *temp_particle = NULL;
+
+    if (curr_particle == NULL)
+        return;
+
+    /**
+     * There are 8 checks of the particles around the oil to see if they are
+     * flames/fire. There might be some clean way to do this, but I don't know
+     * it, so for now, ugliness.
+     *
+     * Anyway, this code basically just gives the oil a chance to ignite if it's
+     * near a flame or something burning. If the oil ignites, it adds a "fire"
+     * particle and gives it the oil's propereties (liquid element and velocity)
+     */
+    temp_particle = get_particle(grid, left, below);
+    if (temp_particle != NULL && (get_particle_type(temp_particle) == MAT_FLAME
+        || get_particle_type(temp_particle) == MAT_FIRE)) {
+        /* 75% chance to ignite */
+        r = grid_rand(grid) % 4;
+        if (r != 0)
+            ignite_particle(grid, x, y, ELEM_LIQUID);
+    }
+
+    temp_particle = get_particle(grid, x, below);
+    if (temp_particle != NULL && (get_particle_type(temp_particle) == MAT_FLAME
+        || get_particle_type(temp_particle) == MAT_FIRE)) {
+        /* 75% chance to ignite */
+        r = grid_rand(grid) % 4;
+        if (r != 0)
+            ignite_particle(grid, x, y, ELEM_LIQUID);
+    }
+
+    temp_particle = get_particle(grid, right, below);
+    if (temp_particle != NULL && (get_particle_type(temp_particle) == MAT_FLAME
+        || get_particle_type(temp_particle) == MAT_FIRE)) {
+        /* 75% chance to ignite */
+        r = grid_rand(grid) % 4;
+        if (r != 0)
+            ignite_particle(grid, x, y, ELEM_LIQUID);
+    }
+
+    temp_particle = get_particle(grid, left, y);
+    if (temp_particle != NULL && (get_particle_type(temp_particle) == MAT_FLAME
+        || get_particle_type(temp_particle) == MAT_FIRE)) {
+        /* 75% chance to ignite */
+        r = grid_rand(grid) % 4;
+        if (r != 0)
+            ignite_particle(grid, x, y, ELEM_LIQUID);
+    }
+
+    temp_particle = get_particle(grid, right, y);
+    if (temp_particle != NULL && (get_particle_type(temp_particle) == MAT_FLAME
+        || get_particle_type(temp_particle) == MAT_FIRE)) {
+        /* 75% chance to ignite */
+        r = grid_rand(grid) % 4;
+        if (r != 0)
+            ignite_particle(grid, x, y, ELEM_LIQUID);
+    }
+
+    temp_particle = get_particle(grid, left, above);
+    if (temp_particle != NULL && (get_particle_type(temp_particle) == MAT_FLAME
+        || get_particle_type(temp_particle) == MAT_FIRE)) {
+        /* 75% chance to ignite */
+        r = grid_rand(grid) % 4;
+        if (r != 0)
+            ignite_particle(grid, x, y, ELEM_LIQUID);
+    }
+
+    temp_particle = get_particle(grid, x, above);
+    if (temp_particle != NULL && (get_particle_type(temp_particle) == MAT_FLAME
+        || get_particle_type(temp_particle) == MAT_FIRE)) {
+        /* 75% chance to ignite */
+        r = grid_rand(grid) % 4;
+        if (r != 0)
+            ignite_particle(grid, x, y, ELEM_LIQUID);
+    }
+
+    temp_particle = get_particle(grid, right, above);
+    if (temp_particle != NULL && (get_particle_type(temp_particle) == MAT_FLAME
+        || get_particle_type(temp_particle) == MAT_FIRE)) {
+        /* 75% chance to ignite */
+        r = grid_rand(grid) % 4;
+        if (r != 0)
+            ignite_particle(grid, x, y, ELEM_LIQUID);
+    }
+
+    /* It can also catch fire from the heat of a fire that isn't touching it */
+    if (get_particle_type_pos(grid, x, y) == MAT_OIL
+        && get_field(&grid->heat, x, y) >= HEAT_IGNITION
+        && grid_rand(grid) % HEAT_IGNITION_ODDS == 0)
+        ignite_particle(grid, x, y, ELEM_LIQUID);
+
+    /* Moves the oil like a regular liquid */
+    if (fly_particle(grid, x, y))
+        return;
+
+    if (is_pos_empty(grid, x, below)) {
+        swap_particles(grid, x, y, x, below);
+        start_falling(grid, x, below);
+    }
+    else if ((is_pos_empty(grid, left, below)
+             || is_pos_gas(grid, left, below))
+             && !is_pos_static(grid, x, below)) {
+        swap_particles(grid, x, y, left, below);
+    }
+    else if ((is_pos_empty(grid, right, below)
+             || is_pos_gas(grid, right, below))
+             && !is_pos_static(grid, x, below)) {
+        swap_particles(grid, x, y, right, below);
+    }
+    else if (is_pos_empty(grid, left, y)) {
+        swap_particles(grid, x, y, find_dispersal(grid, x, y, -1,
+                                                  dispersion_rates[MAT_OIL]),
+                       y);
+    }
+    else if (is_pos_empty(grid, right, y)) {
+        swap_particles(grid, x, y, find_dispersal(grid, x, y, 1,
+                                                  dispersion_rates[MAT_OIL]),
+                       y);
+    }
+
+    set_updated(grid, x, y, true);
+}
+
+void
+update_wall(grid_t *grid, int x, int y)
+{
+    const particle_t *curr_particle = get_particle(grid, x, y);
+
+    if (curr_particle == NULL)
+        return;
+
+    /* Wall that came loose (see collapse_structures) falls like sand */
+    if (get_particle_elem(curr_particle) == ELEM_SOLID) {
+        update_sand(grid, x, y);
+        return;
+    }
+
+    set_updated(grid, x, y, true);
+}
+
+void
+update_wood(grid_t *grid, int x, int y)
+{
+    int r;
+    int above = y + 1, below = y - 1;
+    int  left = x - 1, right = x + 1;
+    const particle_t *curr_particle = get_particle(grid, x, y);
+    const particle_t *temp_particle = NULL;
+
+    if (curr_particle == NULL)
+        return;
+
+    temp_particle = get_particle(grid, left, below);
+    if (temp_particle != NULL && (get_particle_type(temp_particle) == MAT_FLAME
+        || get_particle_type(temp_particle) == MAT_FIRE)) {
+        /* 50% chance to ignite */
+        r = grid_rand(grid) % 2;
+        if (r == 0)
+            ignite_particle(grid, x, y, get_particle_elem(curr_particle));
+    }
+
+    temp_particle = get_particle(grid, x, below);
+    if (temp_particle != NULL && (get_particle_type(temp_particle) == MAT_FLAME
+        || get_particle_type(temp_particle) == MAT_FIRE)) {
+        /* 50% chance to ignite */
+        r = grid_rand(grid) % 2;
+        if (r == 0)
+            ignite_particle(grid, x, y, get_particle_elem(curr_particle));
+    }
+
+    temp_particle = get_particle(grid, right, below);
+    if (temp_particle != NULL && (get_particle_type(temp_particle) == MAT_FLAME
+        || get_particle_type(temp_particle) == MAT_FIRE)) {
+        /* 50% chance to ignite */
+        r = grid_rand(grid) % 2;
+        if (r == 0)
+            ignite_particle(grid, x, y, get_particle_elem(curr_particle));
+    }
+
+    temp_particle = get_particle(grid, left, y);
+    if (temp_particle != NULL && (get_particle_type(temp_particle) == MAT_FLAME
+        || get_particle_type(temp_particle) == MAT_FIRE)) {
+        /* 50% chance to ignite */
+        r = grid_rand(grid) % 2;
+        if (r == 0)
+            ignite_particle(grid, x, y, get_particle_elem(curr_particle));
+    }
+
+    temp_particle = get_particle(grid, right, y);
+    if (temp_particle != NULL && (get_particle_type(temp_particle) == MAT_FLAME
+        || get_particle_type(temp_particle) == MAT_FIRE)) {
+        /* 50% chance to ignite */
+        r = grid_rand(grid) % 2;
+        if (r == 0)
+            ignite_particle(grid, x, y, get_particle_elem(curr_particle));
+    }
+
+    temp_particle = get_particle(grid, left, above);
+    if (temp_particle != NULL && (get_particle_type(temp_particle) == MAT_FLAME
+        || get_particle_type(temp_particle) == MAT_FIRE)) {
+        /* 50% chance to ignite */
+        r = grid_rand(grid) % 2;
+        if (r == 0)
+            ignite_particle(grid, x, y, get_particle_elem(curr_particle));
+    }
+
+    temp_particle = get_particle(grid, x, above);
+    if (temp_particle != NULL && (get_particle_type(temp_particle) == MAT_FLAME
+        || get_particle_type(temp_particle) == MAT_FIRE)) {
+        /* 50% chance to ignite */
+        r = grid_rand(grid) % 2;
+        if (r == 0)
+            ignite_particle(grid, x, y, get_particle_elem(curr_particle));
+    }
+
+    temp_particle = get_particle(grid, right, above);
+    if (temp_particle != NULL && (get_particle_type(temp_particle) == MAT_FLAME
+        || get_particle_type(temp_particle) == MAT_FIRE)) {
+        /* 50% chance to ignite */
+        r = grid_rand(grid) % 2;
+        if (r == 0)
+            ignite_particle(grid, x, y, get_particle_elem(curr_particle));
+    }
+
+    /* Or from the heat of one that isn't */
+    if (get_particle_type_pos(grid, x, y) == MAT_WOOD
+        && get_field(&grid->heat, x, y) >= HEAT_IGNITION
+        && grid_rand(grid) % HEAT_IGNITION_ODDS == 0)
+        ignite_particle(grid, x, y, get_particle_elem(curr_particle));
+
+    /* Wood that came loose falls like sand (until it catches fire) */
+    curr_particle = get_particle(grid, x, y);
+    if (curr_particle->mat_type == MAT_WOOD
+        && get_particle_elem(curr_particle) == ELEM_SOLID) {
+        update_sand(grid, x, y);
+        return;
+    }
+
+    set_updated(grid, x, y, true);
+}
+
+void
+update_fire(grid_t *grid, int x, int y)
+{
+    /**
+     * Fire doesn't move. Burning out is done by advance_timers and the
+     * flicker is done when drawing (see get_particle_color)
+     */
+    add_to_field(&grid->heat, x, y, HEAT_FIRE);
+
+    if (grid->light != NULL)
+        add_light(grid, x, y);
+
+    set_updated(grid, x, y, true);
+}
+
+void
+update_flame(grid_t *grid, int x, int y)
+{
+    int above = y + 1;
+    int left = x - 1, right = x + 1;
+    const particle_t *curr_particle = get_particle(grid, x, y);
+
+    if (curr_particle == NULL)
+        return;
+
+    if (grid->light != NULL)
+        add_light(grid, x, y);
+
+    /* Where there's wind, it decides where the flame goes */
+    if (blow_gas(grid, x, y))
+        return;
+
+    if (is_pos_empty(grid, x, above)) {
+        swap_particles(grid, x, y, x, above);
+    }
+    else if (is_pos_empty(grid, left, above)
+             && !is_pos_static(grid, x, above)) {
+        swap_particles(grid, x, y, left, above);
+    }
+    else if (is_pos_empty(grid, right, above)
+             && !is_pos_static(grid, x, above)) {
+        swap_particles(grid, x, y, right, above);
+    }
+    else if (is_pos_empty(grid, left, y)) {
+        swap_particles(grid, x, y, left, y);
+    }
+    else if (is_pos_empty(grid, right, y)) {
+        swap_particles(grid, x, y, right, y);
+    }
+
+    set_updated(grid, x, y, true);
+}
+
+void
+update_powder(grid_t *grid, int x, int y)
+{
+    int dx, dy;
+    material_type m;
+
+    for (dy = -1; dy <= 1; dy++) {
+        for (dx = -1; dx <= 1; dx++) {
+            m = get_particle_type_pos(grid, x + dx, y + dy);
+
+            if (m == MAT_FIRE || m == MAT_FLAME) {
+                detonate_particle(grid, x, y);
+                return;
+            }
+        }
+    }
+
+    if (get_field(&grid->heat, x, y) >= HEAT_IGNITION) {
+        detonate_particle(grid, x, y);
+        return;
+    }
+
+    update_sand(grid, x, y);
+}
+
+void
+update_wire(grid_t *grid, int x, int y)
+{
+    int dx, dy;
+    bool powered;
+    const particle_t *curr_particle = get_particle(grid, x, y);
+    const particle_t *temp_particle = NULL;
+
+    if (curr_particle == NULL)
+        return;
+
+    /**
+     * Nothing's powered without a battery, so circuits are only tracked
+     * once there's been one. After this they're kept up to date every tick
+     */
+    if (curr_particle->mat_type == MAT_BATTERY
+        && grid->circuits.chunks == NULL)
+        update_regions(grid, &grid->circuits, NULL);
+
+    powered = is_powered(grid, x, y);
+
+    for (dy = -1; dy <= 1 && powered; dy++) {
+        for (dx = -1; dx <= 1; dx++) {
+            temp_particle = get_particle(grid, x + dx, y + dy);
+            if (temp_particle == NULL)
+                continue;
+
+            switch (temp_particle->mat_type) {
+                case MAT_POWDER:
+                    detonate_particle(grid, x + dx, y + dy);
+                    break;
+                case MAT_WOOD:
+                case MAT_OIL:
+                    if (grid_rand(grid) % SPARK_ODDS == 0) {
+                        ignite_particle(grid, x + dx, y + dy,
+                                        get_particle_elem(temp_particle));
+                    }
+                    break;
+                default:
+                    break;
+            }
+        }
+    }
+
+    /* Wire that came loose falls like sand */
+    curr_particle = get_particle(grid, x, y);
+    if (get_particle_elem(curr_particle) == ELEM_SOLID) {
+        update_sand(grid, x, y);
+        return;
+    }
+
+    set_updated(grid, x, y, true);
+}
+
+bool
+is_powered(const grid_t *grid, int x, int y)
+{
+    const regions_t *circuits = &grid->circuits;
+    uint64_t id;
+
+    if (circuits->chunks == NULL || !get_piece_at(grid, circuits, x, y, &id))
+        return false;
+
+    return get_piece(circuits, get_piece(circuits, id)->parent)->powered;
+}
+
+void
+start_falling(grid_t *grid, int x, int y)
+{
+    /* It fell a cell this tick, so that's the speed it starts with */
+    if (is_pos_empty(grid, x, y - 1))
+        set_velocity(grid, x, y, (Vector2){0.0f, -1.0f});
+}
+
+bool
+fly_particle(grid_t *grid, int x, int y)
+{
+    Vector2 velocity;
+    int x1 = x, y1 = y;
+    int x2, y2, dx, dy, sx, sy, error, e2;
+    int next_x = x, next_y = y;
+
+    if (!get_velocity(grid, x, y, &velocity))
+        return false;
+
+    velocity.y -= GRAVITY;
+
+    if (velocity.x > MAX_SPEED)
+        velocity.x = MAX_SPEED;
+    if (velocity.x < -MAX_SPEED)
+        velocity.x = -MAX_SPEED;
+    if (velocity.y > MAX_SPEED)
+        velocity.y = MAX_SPEED;
+    if (velocity.y < -MAX_SPEED)
+        velocity.y = -MAX_SPEED;
+
+    /* Anything under a cell a tick is left for the next ticks to build up */
+    x2 = x + (int)velocity.x;
+    y2 = y + (int)velocity.y;
+
+    dx = abs(x2 - x1);
+    sx = x1 < x2 ? 1 : -1;
+    dy = -abs(y2 - y1);
+    sy = y1 < y2 ? 1 : -1;
+    error = dx + dy;
+
+    /**
+     * Same line walk as particle_line, except it stops on the last empty
+     * cell before the first full one. Only the occupancy plane is looked at,
+     * so the cells it flies over are never touched
+     */
+    while (x1 != x2 || y1 != y2) {
+        next_x = x1;
+        next_y = y1;
+        e2 = 2 * error;
+
+        if (e2 >= dy) {
+            error += dy;
+            next_x += sx;
+        }
+
+        if (e2 <= dx) {
+            error += dx;
+            next_y += sy;
+        }
+
+        if (!is_pos_empty(grid, next_x, next_y))
+            break;
+
+        x1 = next_x;
+        y1 = next_y;
+    }
+
+    /* Hitting a liquid hard enough throws a drop of it back up */
+    if ((x1 != x2 || y1 != y2) && velocity.y <= -SPLASH_SPEED
+        && is_pos_liquid(grid, next_x, next_y)) {
+        launch_particle(grid, next_x, next_y,
+                        (Vector2){(grid_rand(grid) % 5 - 2) * 0.5f,
+                                  velocity.y * -0.25f});
+    }
+
+    if (x1 == x && y1 == y && (x1 != x2 || y1 != y2)) {
+        clear_velocity(grid, x, y);
+        return false;
+    }
+
+    /* The velocity goes along with the particle when it's swapped */
+    if (x1 == x2 && y1 == y2)
+        set_velocity(grid, x, y, velocity);
+    else
+        clear_velocity(grid, x, y);
+
+    if (x1 != x || y1 != y)
+        swap_particles(grid, x, y, x1, y1);
+
+    set_updated(grid, x, y, true);
+
+    return true;
+}
+
+void
+init_ejecta(ejecta_t *ejecta)
+{
+    ejecta->block = NULL;
+    ejecta->x = NULL;
+    ejecta->y = NULL;
+    ejecta->vx = NULL;
+    ejecta->vy = NULL;
+    ejecta->cell_x = NULL;
+    ejecta->cell_y = NULL;
+    ejecta->expires = NULL;
+    ejecta->particles = NULL;
+    ejecta->count = 0;
+    ejecta->capacity = 0;
+}
+
+bool
+reserve_ejecta(ejecta_t *ejecta, size_t capacity)
+{
+    ejecta_t bigger;
+    char *next = NULL;
+
+    if (capacity <= ejecta->capacity)
+        return true;
+
+    /* Biggest members first so every array stays aligned */
+    bigger.block = malloc(capacity * (4 * sizeof(float) + 2 * sizeof(int)
+                                      + sizeof(uint32_t)
+                                      + sizeof(particle_t)));
+    if (bigger.block == NULL)
+        return false;
+
+    next = bigger.block;
+    bigger.x = (float *)next;
+    next += capacity * sizeof(float);
+    bigger.y = (float *)next;
+    next += capacity * sizeof(float);
+    bigger.vx = (float *)next;
+    next += capacity * sizeof(float);
+    bigger.vy = (float *)next;
+    next += capacity * sizeof(float);
+    bigger.cell_x = (int *)next;
+    next += capacity * sizeof(int);
+    bigger.cell_y = (int *)next;
+    next += capacity * sizeof(int);
+    bigger.expires = (uint32_t *)next;
+    next += capacity * sizeof(uint32_t);
+    bigger.particles = (particle_t *)next;
+    bigger.count = 0;
+    bigger.capacity = capacity;
+
+    copy_ejecta(&bigger, ejecta);
+    free(ejecta->block);
+    *ejecta = bigger;
+
+    return true;
+}
+
+bool
+copy_ejecta(ejecta_t *dest, const ejecta_t *src)
+{
+    size_t n = src->count;
+
+    if (!reserve_ejecta(dest, n))
+        return false;
+
+    if (n > 0) {
+        memcpy(dest->x, src->x, n * sizeof(*dest->x));
+        memcpy(dest->y, src->y, n * sizeof(*dest->y));
+        memcpy(dest->vx, src->vx, n * sizeof(*dest->vx));
+        memcpy(dest->vy, src->vy, n * sizeof(*dest->vy));
+        memcpy(dest->cell_x, src->cell_x, n * sizeof(*dest->cell_x));
+        memcpy(dest->cell_y, src->cell_y, n * sizeof(*dest->cell_y));
+        memcpy(dest->expires, src->expires, n * sizeof(*dest->expires));
+        memcpy(dest->particles, src->particles, n * sizeof(*dest->particles));
+    }
+
+    dest->count = n;
+
+    return true;
+}
+
+void
+launch_particle(grid_t *grid, int x, int y, Vector2 velocity)
+{
+    ejecta_t *ejecta = &grid->ejecta;
+    const particle_t *p = get_particle(grid, x, y);
+    uint32_t life_time;
+    size_t i;
+
+    if (p == NULL || p->mat_type == MAT_EMPTY)
+        return;
+
+    if (ejecta->count == ejecta->capacity
+        && !reserve_ejecta(ejecta, ejecta->capacity == 0
+                                   ? 64 : ejecta->capacity * 2)) {
+        fprintf(stderr, "Error: Could not allocate enough memory at %d in %s\n",
+                __LINE__, __FILE__);
+        exit(EXIT_FAILURE);
+    }
+
+    i = ejecta->count++;
+    life_time = get_life_time(grid, x, y);
+
+    ejecta->x[i] = x + 0.5f;
+    ejecta->y[i] = y + 0.5f;
+    ejecta->vx[i] = velocity.x;
+    ejecta->vy[i] = velocity.y;
+    ejecta->cell_x[i] = x;
+    ejecta->cell_y[i] = y;
+    ejecta->expires[i] = life_time > 0 ? grid->timers.now + life_time : 0;
+    ejecta->particles[i] = *p;
+    ejecta->particles[i].state &= ~STATE_HAS_VELOCITY;
+
+    remove_particle(grid, x, y);
+}
+
+void
+update_ejecta(grid_t *grid)
+{
+    ejecta_t *ejecta = &grid->ejecta;
+    float *restrict px = ejecta->x, *restrict py = ejecta->y;
+    float *restrict vx = ejecta->vx, *restrict vy = ejecta->vy;
+    size_t i, n = ejecta->count;
+    int x1, y1, x2, y2, dx, dy, sx, sy, error, e2;
+    int next_x, next_y;
+    bool blocked;
+
+    /**
+     * The arrays never overlap and no particle depends on another, so the
+     * compiler is free to do this a vector of particles at a time
+     */
+    for (i = 0; i < n; i++) {
+        vy[i] -= GRAVITY;
+        vy[i] = vy[i] < -EJECTA_MAX_SPEED ? -EJECTA_MAX_SPEED : vy[i];
+        px[i] += vx[i];
+        py[i] += vy[i];
+    }
+
+    i = 0;
+    while (i < ejecta->count) {
+        x1 = ejecta->cell_x[i];
+        y1 = ejecta->cell_y[i];
+        x2 = (int)px[i] - (px[i] < 0.0f);
+        y2 = (int)py[i] - (py[i] < 0.0f);
+
+        dx = abs(x2 - x1);
+        sx = x1 < x2 ? 1 : -1;
+        dy = -abs(y2 - y1);
+        sy = y1 < y2 ? 1 : -1;
+        error = dx + dy;
+        blocked = false;
+
+        /* The same walk as fly_particle, but above the grid is open too */
+        while (x1 != x2 || y1 != y2) {
+            next_x = x1;
+            next_y = y1;
+            e2 = 2 * error;
+
+            if (e2 >= dy) {
+                error += dy;
+                next_x += sx;
+            }
+
+            if (e2 <= dx) {
+                error += dx;
+                next_y += sy;
+            }
+
+            if (next_x < 0 || next_x >= grid->width
+                || (next_y < grid->height
+                    && !is_pos_empty(grid, next_x, next_y))) {
+                blocked = true;
+                break;
+            }
+
+            x1 = next_x;
+            y1 = next_y;
+        }
+
+        ejecta->cell_x[i] = x1;
+        ejecta->cell_y[i] = y1;
+
+        if (!blocked) {
+            i++;
+        }
+        else if (y1 >= grid->height) {
+            /* Hit the side above the grid, so it just drops from there */
+            px[i] = x1 + 0.5f;
+            py[i] = y1 + 0.5f;
+            vx[i] = 0.0f;
+            i++;
+        }
+        else if (!land_ejecta(grid, i, x1, y1)) {
+            /* If it did land, the last one is in spot i now */
+            i++;
+        }
+    }
+}
+
+bool
+land_ejecta(grid_t *grid, size_t i, int x, int y)
+{
+    ejecta_t *ejecta = &grid->ejecta;
+    size_t last = ejecta->count - 1;
+    uint32_t life_time = 0;
+
+    while (y < grid->height && !is_pos_empty(grid, x, y))
+        y++;
+
+    if (y == grid->height) {
+        ejecta->x[i] = x + 0.5f;
+        ejecta->y[i] = y + 0.5f;
+        ejecta->vx[i] = 0.0f;
+        ejecta->vy[i] = 0.0f;
+        ejecta->cell_x[i] = x;
+        ejecta->cell_y[i] = y;
+        return false;
+    }
+
+    /* A timer that ran out in the air goes off as soon as it can */
+    if (ejecta->expires[i] != 0) {
+        life_time = ejecta->expires[i] > grid->timers.now
+                    ? ejecta->expires[i] - grid->timers.now : 1;
+    }
+
+    set_particle(grid, x, y, &ejecta->particles[i], life_time);
+
+    ejecta->x[i] = ejecta->x[last];
+    ejecta->y[i] = ejecta->y[last];
+    ejecta->vx[i] = ejecta->vx[last];
+    ejecta->vy[i] = ejecta->vy[last];
+    ejecta->cell_x[i] = ejecta->cell_x[last];
+    ejecta->cell_y[i] = ejecta->cell_y[last];
+    ejecta->expires[i] = ejecta->expires[last];
+    ejecta->particles[i] = ejecta->particles[last];
+    ejecta->count--;
+
+    return true;
+}
+
+int
+find_dispersal(const grid_t *grid, int x, int y, int direction, int rate)
+{
+    int i, to = x;
+
+    for (i = 0; i < rate; i++) {
+        if (!is_pos_empty(grid, to + direction, y))
+            break;
+
+        to += direction;
+    }
+
+    return to;
+}
+
+void
+set_pressure_water(grid_t *grid, bool enabled)
+{
+    chunk_t *chunk = NULL;
+    int i, x, y;
+
+    if (!enabled) {
+        /* A chunk shared with another grid might still be in pressure mode */
+        for (i = 0; i < grid->chunk_count; i++) {
+            chunk = grid->chunks[i];
+
+            if (chunk->refs == 1) {
+                free(chunk->mass);
+                chunk->mass = NULL;
+            }
+        }
+
+        grid->pressure = false;
+        return;
+    }
+
+    if (grid->pressure)
+        return;
+
+    for (i = 0; i < grid->chunk_count; i++) {
+        chunk = get_chunk_mut(grid, (size_t)i << grid->chunk_shift);
+
+        if (chunk->mass == NULL)
+            alloc_chunk_mass(chunk);
+    }
+
+    grid->pressure = true;
+
+    for (y = 0; y < grid->height; y++) {
+        for (x = 0; x < grid->width; x++) {
+            set_mass(grid, x, y, get_particle_type_pos(grid, x, y) == MAT_WATER
+                                 ? 1.0f : 0.0f);
+        }
+    }
+}
+
+float
+get_mass(const grid_t *grid, int x, int y)
+{
+    return grid->chunks[y >> CHUNK_SHIFT]->mass[get_plane_bit(grid, x, y)];
+}
+
+void
+set_mass(grid_t *grid, int x, int y, float mass)
+{
+    get_mass_row(grid, y)[x] = mass;
+}
+
+float *
+get_mass_row(grid_t *grid, int y)
+{
+    chunk_t *chunk = get_chunk_mut(grid, get_index(grid, 0, y));
+
+    return &chunk->mass[get_plane_bit(grid, 0, y)];
+}
+
+void
+update_pressure(grid_t *grid)
+{
+    const chunk_t *chunk = NULL;
+    const particle_t *p = NULL;
+    particle_t water = {MAT_WATER, ELEM_LIQUID};
+    particle_t empty = {MAT_EMPTY, ELEM_EMPTY};
+    history_t *history = grid->history;
+    float *row = NULL, *before = NULL;
+    float mass;
+    int low = grid->height, high = -1;
+    int i, step, x, y;
+    size_t w, count;
+
+    /* Only the chunks with liquid in them have anything to flow */
+    for (i = 0; i < grid->chunk_count; i++) {
+        chunk = grid->chunks[i];
+
+        for (w = 0; w < chunk->plane_words; w++) {
+            if (chunk->planes[ELEM_LIQUID * chunk->plane_words + w] != 0)
+                break;
+        }
+
+        if (w < chunk->plane_words) {
+            if (low == grid->height)
+                low = i * CHUNK_ROWS;
+            high = i * CHUNK_ROWS + CHUNK_ROWS - 1;
+        }
+    }
+
+    if (high < 0)
+        return;
+
+    /* Each round can move water two rows up or down */
+    low -= 2 * PRESSURE_STEPS;
+    high += 2 * PRESSURE_STEPS;
+    if (low < 0)
+        low = 0;
+    if (high > grid->height - 1)
+        high = grid->height - 1;
+
+    /**
+     * Mark what blocks the water. The masses of water and empty cells are
+     * kept up to date by set_particle and swap_particles, so they're only
+     * fixed up here in case a blocked cell's -1 was swapped into them
+     */
+    for (y = low; y <= high; y++) {
+        row = get_mass_row(grid, y);
+
+        for (x = 0; x < grid->width; x++) {
+            if (!test_plane(grid, PLANE_OCCUPIED, x, y)) {
+                if (row[x] < 0.0f)
+                    row[x] = 0.0f;
+            }
+            else if (get_particle_type_pos(grid, x, y) != MAT_WATER) {
+                row[x] = -1.0f;
+            }
+            else if (row[x] <= 0.0f) {
+                row[x] = 1.0f;
+            }
+        }
+    }
+
+    /* Keep the masses from before the flow so the ones that change are logged */
+    if (history != NULL) {
+        count = (size_t)(high - low + 1) * (size_t)grid->width;
+
+        if (count > history->mass_capacity) {
+            before = realloc(history->masses, count * sizeof(*before));
+            if (before == NULL) {
+                fprintf(stderr, "Error: Could not allocate enough memory at %d "
+                        "in %s\n", __LINE__, __FILE__);
+                exit(EXIT_FAILURE);
+            }
+
+            history->masses = before;
+            history->mass_capacity = count;
+        }
+
+        before = history->masses;
+
+        for (y = low; y <= high; y++) {
+            memcpy(&before[(size_t)(y - low) * (size_t)grid->width],
+                   get_mass_row(grid, y), grid->width * sizeof(*before));
+        }
+    }
+
+    for (step = 0; step < PRESSURE_STEPS; step++) {
+        for (i = 0; i < 2; i++) {
+            for (y = low + ((low + i) & 1); y < high; y += 2) {
+                flow_pressure_rows(get_mass_row(grid, y),
+                                   get_mass_row(grid, y + 1), grid->width);
+            }
+        }
+
+        for (y = low; y <= high; y++) {
+            row = get_mass_row(grid, y);
+            flow_pressure_row(row, 0, grid->width);
+            flow_pressure_row(row, 1, grid->width);
+            level_pressure_row(row, grid->width);
+        }
+    }
+
+    for (y = low; y <= high && before != NULL; y++) {
+        row = &before[(size_t)(y - low) * (size_t)grid->width];
+
+        for (x = 0; x < grid->width; x++) {
+            if (get_mass(grid, x, y) != row[x])
+                record_mass(grid, x, y, row[x]);
+        }
+    }
+
+    /* Cells become water or stop being water to match their mass */
+    for (y = low; y <= high; y++) {
+        for (x = 0; x < grid->width; x++) {
+            mass = get_mass(grid, x, y);
+            if (mass < 0.0f)
+                continue;
+
+            p = get_particle(grid, x, y);
+
+            /* set_particle resets the mass, so it's put back afterwards */
+            if (p->mat_type == MAT_EMPTY && mass >= PRESSURE_MIN_MASS) {
+                set_particle(grid, x, y, &water, 0);
+                set_mass(grid, x, y, mass);
+            }
+            else if (p->mat_type == MAT_WATER && mass < PRESSURE_MIN_MASS) {
+                set_particle(grid, x, y, &empty, 0);
+                set_mass(grid, x, y, mass);
+            }
+        }
+    }
+}
+
+void
+flow_pressure_rows(float *restrict lower, float *restrict upper, int width)
+{
+    int x;
+    float low, high, total, bottom, squeezed, split, open;
+
+    /**
+     * gcc won't turn most branches on floats into selects without
+     * -fno-trapping-math, so every case is worked out and the comparisons are
+     * turned into 0 or 1 and multiplied in instead (clamps are fine as they
+     * are). That way the loop vectorizes at -O3
+     */
+    for (x = 0; x < width; x++) {
+        low = lower[x];
+        high = upper[x];
+        total = low + high;
+        squeezed = (1.0f + total * PRESSURE_COMPRESSION)
+                   / (1.0f + PRESSURE_COMPRESSION);
+        split = (total + PRESSURE_COMPRESSION) / 2.0f;
+
+        bottom = total + (float)(total > 1.0f) * (squeezed - total);
+        bottom += (float)(total >= 2.0f + PRESSURE_COMPRESSION)
+                  * (split - bottom);
+
+        /* Going past even lets the water carry on instead of creeping */
+        bottom = low + PRESSURE_RELAXATION * (bottom - low);
+        bottom = bottom < 0.0f ? 0.0f : bottom;
+        bottom = bottom > total ? total : bottom;
+
+        /* Blocked cells are negative and stay as they are */
+        open = (float)((low >= 0.0f) & (high >= 0.0f));
+        lower[x] = low + open * (bottom - low);
+        upper[x] = high + open * (total - bottom - high);
+    }
+}
+
+void
+flow_pressure_row(float *row, int first, int width)
+{
+    int i;
+    float *pairs = row + first;
+    float left, right, total, even, open;
+
+    /* Written the same way as flow_pressure_rows so that it vectorizes */
+    for (i = 0; i < (width - first) / 2; i++) {
+        left = pairs[2 * i];
+        right = pairs[2 * i + 1];
+        total = left + right;
+
+        even = left + PRESSURE_RELAXATION * (total / 2.0f - left);
+        even = even < 0.0f ? 0.0f : even;
+        even = even > total ? total : even;
+
+        open = (float)((left >= 0.0f) & (right >= 0.0f));
+        pairs[2 * i] = left + open * (even - left);
+        pairs[2 * i + 1] = right + open * (total - even - right);
+    }
+}
+
+void
+level_pressure_row(float *row, int width)
+{
+    int start, x;
+    double total;
+    float average;
+
+    /* The total is a double so long runs don't lose water to rounding */
+    for (start = 0; start < width; start = x + 1) {
+        total = 0.0;
+
+        for (x = start; x < width && row[x] >= 1.0f; x++)
+            total += row[x];
+
+        if (x - start < 2)
+            continue;
+
+        average = (float)(total / (x - start));
+        for (; start < x; start++)
+            row[start] = average;
+    }
+}
+
+void
+init_regions(regions_t *regions, int plane, int source)
+{
+    regions->plane = plane;
+    regions->source = source;
+    regions->chunks = NULL;
+    regions->chunk_count = 0;
+    regions->pending = NULL;
+    regions->dirty = NULL;
+    regions->touched = NULL;
+    regions->count = 0;
+    regions->largest = 0;
+    regions->rescan = false;
+}
+
+void
+free_regions(regions_t *regions)
+{
+    int i;
+
+    for (i = 0; i < regions->chunk_count; i++) {
+        free(regions->chunks[i].labels);
+        free(regions->chunks[i].pieces);
+        free(regions->chunks[i].links);
+    }
+
+    free(regions->chunks);
+    free(regions->pending);
+    free(regions->dirty);
+    free(regions->touched);
+    init_regions(regions, regions->plane, regions->source);
+}
+
+void
+match_regions(grid_t *grid, regions_t *regions, const regions_t *other)
+{
+    int i;
+
+    if (other->chunks == NULL) {
+        free_regions(regions);
+        return;
+    }
+
+    if (regions->chunks == NULL)
+        alloc_regions(grid, regions);
+
+    for (i = 0; i < grid->chunk_count; i++) {
+        copy_region_chunk(&regions->chunks[i], &other->chunks[i],
+                          grid->chunks[i]->count);
+        regions->dirty[i] = other->dirty[i];
+        regions->touched[i] = other->touched[i];
+    }
+
+    regions->count = other->count;
+    regions->largest = other->largest;
+    regions->rescan = other->rescan;
+}
+
+void
+copy_region_chunk(region_chunk_t *dest, const region_chunk_t *src,
+                  size_t count)
+{
+    void *pieces = dest->pieces, *links = dest->links;
+
+    if (src->labels == NULL) {
+        free(dest->labels);
+        free(dest->pieces);
+        free(dest->links);
+        dest->labels = NULL;
+        dest->pieces = NULL;
+        dest->count = 0;
+        dest->capacity = 0;
+        dest->links = NULL;
+        dest->link_count = 0;
+        dest->link_capacity = 0;
+        return;
+    }
+
+    if (dest->labels == NULL)
+        dest->labels = malloc(count * sizeof(*dest->labels));
+
+    if (src->count > dest->capacity)
+        pieces = realloc(dest->pieces, src->count * sizeof(*dest->pieces));
+
+    if (src->link_count > dest->link_capacity)
+        links = realloc(dest->links, src->link_count * sizeof(*dest->links));
+
+    if (dest->labels == NULL
+        || (src->count > 0 && pieces == NULL)
+        || (src->link_count > 0 && links == NULL)) {
+        fprintf(stderr, "Error: Could not allocate enough memory at %d in %s\n",
+                __LINE__, __FILE__);
+        exit(EXIT_FAILURE);
+    }
+
+    dest->pieces = pieces;
+    dest->links = links;
+
+    if (src->count > dest->capacity)
+        dest->capacity = src->count;
+
+    if (src->link_count > dest->link_capacity)
+        dest->link_capacity = src->link_count;
+
+    memcpy(dest->labels, src->labels, count * sizeof(*dest->labels));
+
+    if (src->count > 0)
+        memcpy(dest->pieces, src->pieces, src->count * sizeof(*dest->pieces));
+
+    if (src->link_count > 0)
+        memcpy(dest->links, src->links, src->link_count * sizeof(*dest->links));
+
+    dest->count = src->count;
+    dest->link_count = src->link_count;
+}
+
+void
+alloc_regions(grid_t *grid, regions_t *regions)
+{
+    int i;
+
+    regions->chunks = calloc(grid->chunk_count, sizeof(*regions->chunks));
+    regions->chunk_count = grid->chunk_count;
+    regions->pending = malloc(grid->chunk_count * sizeof(*regions->pending));
+    regions->dirty = malloc(grid->chunk_count * sizeof(*regions->dirty));
+    regions->touched = calloc(grid->chunk_count, sizeof(*regions->touched));
+
+    if (regions->chunks == NULL || regions->pending == NULL
+        || regions->dirty == NULL || regions->touched == NULL) {
+        fprintf(stderr, "Error: Could not allocate enough memory at %d in "
+                "%s\n", __LINE__, __FILE__);
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < grid->chunk_count; i++)
+        regions->dirty[i] = true;
+}
+
+bool
+update_regions(grid_t *grid, regions_t *regions, worker_pool_t *pool)
+{
+    region_task_t task = {grid, regions};
+    region_chunk_t *part = NULL;
+    region_piece_t *piece = NULL, *root = NULL;
+    uint64_t id, region;
+    int pending = 0;
+    int i, x;
+    uint32_t k;
+
+    if (regions->chunks == NULL)
+        alloc_regions(grid, regions);
+
+    for (i = 0; i < grid->chunk_count; i++) {
+        if (regions->dirty[i])
+            regions->pending[pending++] = i;
+    }
+
+    /* Nothing changed, so neither did the regions */
+    if (pending == 0)
+        return false;
+
+    /* The regions the dirty chunks were in might have been split up */
+    for (i = 0; i < pending; i++) {
+        part = &regions->chunks[regions->pending[i]];
+
+        for (k = 0; k < part->count; k++)
+            touch_region(regions, part->pieces[k].parent);
+    }
+
+    if (pool != NULL && pending > 1) {
+        run_tasks(pool, pending, label_region_chunk, &task);
+    }
+    else {
+        for (i = 0; i < pending; i++)
+            label_region_chunk(&task, i);
+    }
+
+    /**
+     * The edges next to a dirty chunk are looked at again, and a clean piece
+     * touching a new one is in a region that's changed
+     */
+    for (i = 1; i < grid->chunk_count; i++) {
+        if (!regions->dirty[i] && !regions->dirty[i - 1])
+            continue;
+
+        link_region_chunk(grid, regions, i);
+        part = &regions->chunks[i];
+
+        for (k = 0; k < part->link_count && !regions->dirty[i - 1]; k++) {
+            piece = &regions->chunks[i - 1].pieces[part->links[k].below];
+
+            if (!regions->dirty[piece->parent >> 32])
+                touch_region(regions, piece->parent);
+        }
+
+        for (k = 0; k < part->link_count && !regions->dirty[i]; k++) {
+            piece = &part->pieces[part->links[k].piece];
+
+            if (!regions->dirty[piece->parent >> 32])
+                touch_region(regions, piece->parent);
+        }
+    }
+
+    /**
+     * The pieces of the changed regions start out on their own again, the
+     * ones in dirty chunks already being new. A piece's parent is its root,
+     * which might be in a dirty chunk and gone
+     */
+    for (i = 0; i < grid->chunk_count; i++) {
+        if (!regions->touched[i] && !regions->dirty[i])
+            continue;
+
+        regions->touched[i] = true;
+        part = &regions->chunks[i];
+
+        for (k = 0; k < part->count && !regions->dirty[i]; k++) {
+            piece = &part->pieces[k];
+
+            if (regions->dirty[piece->parent >> 32]
+                || get_piece(regions, piece->parent)->stale) {
+                piece->parent = ((uint64_t)i << 32) | k;
+                piece->stale = true;
+            }
+        }
+    }
+
+    /* Changed pieces touching across the edge between two chunks are joined */
+    for (i = 1; i < grid->chunk_count; i++) {
+        if (!regions->touched[i])
+            continue;
+
+        part = &regions->chunks[i];
+
+        for (k = 0; k < part->link_count; k++) {
+            if (part->pieces[part->links[k].piece].stale) {
+                join_pieces(regions,
+                            ((uint64_t)i << 32) | part->links[k].piece,
+                            ((uint64_t)(i - 1) << 32) | part->links[k].below);
+            }
+        }
+    }
+
+    /**
+     * A region's root is its first piece, so it's always reached before the
+     * rest of its pieces, and the pieces are all pointed straight at it so
+     * looking up a cell's region doesn't have to follow a path
+     */
+    for (i = 0; i < grid->chunk_count; i++) {
+        if (!regions->touched[i])
+            continue;
+
+        for (k = 0; k < regions->chunks[i].count; k++) {
+            piece = &regions->chunks[i].pieces[k];
+
+            if (!piece->stale)
+                continue;
+
+            id = ((uint64_t)i << 32) | k;
+            region = find_piece(regions, id);
+            piece->parent = region;
+            root = get_piece(regions, region);
+
+            if (region == id) {
+                root->volume = 0;
+                root->grounded = false;
+                root->powered = false;
+                regions->count++;
+            }
+
+            root->volume += piece->size;
+            root->high = i;
+            root->powered |= piece->sourced;
+
+            if (root->volume > regions->largest)
+                regions->largest = root->volume;
+        }
+    }
+
+    /* The bottom row is the first row of the first chunk */
+    part = &regions->chunks[0];
+
+    for (x = 0; x < grid->width && regions->touched[0]; x++) {
+        if (part->labels != NULL && part->labels[x] != 0) {
+            piece = &part->pieces[part->labels[x] - 1];
+
+            if (piece->stale)
+                get_piece(regions, piece->parent)->grounded = true;
+        }
+    }
+
+    for (i = 0; i < grid->chunk_count; i++) {
+        for (k = 0; k < regions->chunks[i].count && regions->touched[i]; k++)
+            regions->chunks[i].pieces[k].stale = false;
+
+        regions->dirty[i] = false;
+        regions->touched[i] = false;
+    }
+
+    /* The biggest region might have shrunk, so it's looked for again */
+    if (regions->rescan) {
+        regions->largest = 0;
+        regions->rescan = false;
+
+        for (i = 0; i < grid->chunk_count; i++) {
+            part = &regions->chunks[i];
+
+            for (k = 0; k < part->count; k++) {
+                if (part->pieces[k].parent == (((uint64_t)i << 32) | k)
+                    && part->pieces[k].volume > regions->largest)
+                    regions->largest = part->pieces[k].volume;
+            }
+        }
+    }
+
+    return true;
+}
+
+void
+touch_region(regions_t *regions, uint64_t root)
+{
+    region_piece_t *piece = get_piece(regions, root);
+    int i;
+
+    if (piece->stale)
+        return;
+
+    piece->stale = true;
+    regions->count--;
+
+    if (piece->volume == regions->largest)
+        regions->rescan = true;
+
+    for (i = (int)(root >> 32); i <= piece->high; i++)
+        regions->touched[i] = true;
+}
+
+void
+link_region_chunk(grid_t *grid, regions_t *regions, int chunk)
+{
+    region_chunk_t *part = &regions->chunks[chunk];
+    const region_chunk_t *below = &regions->chunks[chunk - 1];
+    size_t top = (size_t)(CHUNK_ROWS - 1) << grid->stride_shift;
+    region_link_t link, *links = NULL;
+    int x;
+
+    part->link_count = 0;
+
+    if (part->count == 0 || below->count == 0)
+        return;
+
+    /**
+     * A chunk's first row is right above the last row of the chunk below it.
+     * Runs of the same two pieces side by side only need linking once
+     */
+    for (x = 0; x < grid->width; x++) {
+        if (part->labels[x] == 0 || below->labels[top + x] == 0)
+            continue;
+
+        link.piece = part->labels[x] - 1;
+        link.below = below->labels[top + x] - 1;
+
+        if (part->link_count > 0
+            && part->links[part->link_count - 1].piece == link.piece
+            && part->links[part->link_count - 1].below == link.below)
+            continue;
+
+        if (part->link_count == part->link_capacity) {
+            part->link_capacity = part->link_capacity == 0
+                                  ? 16 : part->link_capacity * 2;
+            links = realloc(part->links,
+                            part->link_capacity * sizeof(*links));
+
+            if (links == NULL) {
+                fprintf(stderr, "Error: Could not allocate enough memory at "
+                        "%d in %s\n", __LINE__, __FILE__);
+                exit(EXIT_FAILURE);
+            }
+
+            part->links = links;
+        }
+
+        part->links[part->link_count++] = link;
+    }
+}
+
+void
+label_region_chunk(void *ctx, int task)
+{
+    grid_t *grid = ((region_task_t *)ctx)->grid;
+    regions_t *regions = ((region_task_t *)ctx)->regions;
+    int chunk = regions->pending[task];
+    const chunk_t *cells = grid->chunks[chunk];
+    region_chunk_t *part = &regions->chunks[chunk];
+    region_piece_t *piece = NULL;
+    uint32_t *labels = NULL;
+    int bottom = chunk * CHUNK_ROWS;
+    int top = bottom + CHUNK_ROWS;
+    int x, y;
+    size_t stride = (size_t)1 << grid->stride_shift;
+    size_t i, w;
+
+    if (top > grid->height)
+        top = grid->height;
+
+    /* A chunk without any of the element doesn't need labels at all */
+    for (w = 0; w < cells->plane_words; w++) {
+        if (cells->planes[regions->plane * cells->plane_words + w] != 0)
+            break;
+    }
+
+    if (w == cells->plane_words) {
+        free(part->labels);
+        free(part->pieces);
+        free(part->links);
+        part->labels = NULL;
+        part->pieces = NULL;
+        part->count = 0;
+        part->capacity = 0;
+        part->links = NULL;
+        part->link_count = 0;
+        part->link_capacity = 0;
+        return;
+    }
+
+    if (part->labels == NULL) {
+        part->labels = malloc(cells->count * sizeof(*part->labels));
+
+        if (part->labels == NULL) {
+            fprintf(stderr, "Error: Could not allocate enough memory at %d "
+                    "in %s\n", __LINE__, __FILE__);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    labels = part->labels;
+
+    /**
+     * Each cell joins the ones to its left and below it in the chunk. Until
+     * the pieces are worked out, the labels are the union-find's parents
+     */
+    for (y = bottom; y < top; y++) {
+        for (x = 0; x < grid->width; x++) {
+            i = get_plane_bit(grid, x, y);
+
+            if (!test_plane(grid, regions->plane, x, y)) {
+                labels[i] = REGION_NONE;
+                continue;
+            }
+
+            labels[i] = (uint32_t)i;
+
+            if (x > 0 && labels[i - 1] != REGION_NONE)
+                join_sets(labels, (uint32_t)(i - 1), (uint32_t)i);
+            if (i >= stride && labels[i - stride] != REGION_NONE)
+                join_sets(labels, (uint32_t)(i - stride), (uint32_t)i);
+        }
+    }
+
+    /**
+     * A cell's parent always comes before it, so by the time a cell is
+     * reached its parent is labelled with their piece. A cell that's its own
+     * parent is the first cell of a new piece
+     */
+    part->count = 0;
+
+    for (y = bottom; y < top; y++) {
+        for (x = 0; x < grid->width; x++) {
+            i = get_plane_bit(grid, x, y);
+
+            if (labels[i] == REGION_NONE) {
+                labels[i] = 0;
+                continue;
+            }
+
+            if (labels[i] != i) {
+                labels[i] = labels[labels[i]];
+                piece = &part->pieces[labels[i] - 1];
+            }
+            else {
+                if (part->count == part->capacity)
+                    grow_region_chunk(part);
+
+                piece = &part->pieces[part->count];
+                piece->parent = ((uint64_t)chunk << 32) | part->count;
+                piece->size = 0;
+                piece->sourced = false;
+                piece->stale = true;
+                labels[i] = ++part->count;
+            }
+
+            piece->size++;
+
+            if (regions->source >= 0
+                && test_plane(grid, regions->source, x, y))
+                piece->sourced = true;
+        }
+    }
+}
+
+void
+grow_region_chunk(region_chunk_t *part)
+{
+    uint32_t capacity = part->capacity == 0 ? 16 : part->capacity * 2;
+    region_piece_t *pieces = realloc(part->pieces,
+                                     capacity * sizeof(*pieces));
+
+    if (pieces == NULL) {
+        fprintf(stderr, "Error: Could not allocate enough memory at %d in %s\n",
+                __LINE__, __FILE__);
+        exit(EXIT_FAILURE);
+    }
+
+    part->pieces = pieces;
+    part->capacity = capacity;
+}
+
+void
+update_liquid_bodies(grid_t *grid, worker_pool_t *pool)
+{
+    update_regions(grid, &grid->bodies, pool);
+}
+
+uint32_t
+find_root(uint32_t *parents, uint32_t i)
+{
+    while (parents[i] != i) {
+        parents[i] = parents[parents[i]];
+        i = parents[i];
+    }
+
+    return i;
+}
+
+void
+join_sets(uint32_t *parents, uint32_t a, uint32_t b)
+{
+    a = find_root(parents, a);
+    b = find_root(parents, b);
+
+    if (a < b)
+        parents[b] = a;
+    else if (b < a)
+        parents[a] = b;
+}
+
+region_piece_t *
+get_piece(const regions_t *regions, uint64_t id)
+{
+    return &regions->chunks[id >> 32].pieces[(uint32_t)id];
+}
+
+uint64_t
+find_piece(regions_t *regions, uint64_t id)
+{
+    region_piece_t *piece = get_piece(regions, id);
+
+    while (piece->parent != id) {
+        piece->parent = get_piece(regions, piece->parent)->parent;
+        id = piece->parent;
+        piece = get_piece(regions, id);
+    }
+
+    return id;
+}
+
+void
+join_pieces(regions_t *regions, uint64_t a, uint64_t b)
+{
+    a = find_piece(regions, a);
+    b = find_piece(regions, b);
+
+    if (a < b)
+        get_piece(regions, b)->parent = a;
+    else if (b < a)
+        get_piece(regions, a)->parent = b;
+}
+
+bool
+get_piece_at(const grid_t *grid, const regions_t *regions, int x, int y,
+             uint64_t *id)
+{
+    int chunk = y >> CHUNK_SHIFT;
+    const region_chunk_t *part = &regions->chunks[chunk];
+    uint32_t label;
+
+    if (part->labels == NULL)
+        return false;
+
+    label = part->labels[get_plane_bit(grid, x, y)];
+
+    if (label == 0)
+        return false;
+
+    *id = ((uint64_t)chunk << 32) | (label - 1);
+
+    return true;
+}
+
+uint64_t
+get_liquid_body(const grid_t *grid, int x, int y)
+{
+    uint64_t id;
+
+    if (grid->bodies.chunks == NULL
+        || !get_piece_at(grid, &grid->bodies, x, y, &id))
+        return 0;
+
+    return get_piece(&grid->bodies, id)->parent + 1;
+}
+
+size_t
+get_liquid_body_volume(const grid_t *grid, uint64_t body)
+{
+    return get_piece(&grid->bodies, body - 1)->volume;
+}
+
+void
+set_structural_integrity(grid_t *grid, bool enabled)
+{
+    if (!enabled)
+        free_regions(&grid->structures);
+    else if (grid->structures.chunks == NULL)
+        collapse_structures(grid);
+}
+
+void
+collapse_structures(grid_t *grid)
+{
+    regions_t *structures = &grid->structures;
+    const region_chunk_t *part = NULL;
+    uint64_t id;
+    uint32_t k;
+    bool loose;
+    int i, x, y, top;
+
+    if (!update_regions(grid, structures, NULL))
+        return;
+
+    for (i = 0; i < grid->chunk_count; i++) {
+        part = &structures->chunks[i];
+        loose = false;
+
+        for (k = 0; k < part->count && !loose; k++)
+            loose = !get_piece(structures, part->pieces[k].parent)->grounded;
+
+        if (!loose)
+            continue;
+
+        top = i * CHUNK_ROWS + CHUNK_ROWS;
+        if (top > grid->height)
+            top = grid->height;
+
+        for (y = i * CHUNK_ROWS; y < top; y++) {
+            for (x = 0; x < grid->width; x++) {
+                if (!get_piece_at(grid, structures, x, y, &id))
+                    continue;
+
+                id = get_piece(structures, id)->parent;
+
+                if (!get_piece(structures, id)->grounded)
+                    loosen_particle(grid, x, y);
+            }
+        }
+    }
+}
+
+void
+loosen_particle(grid_t *grid, int x, int y)
+{
+    record_particle(grid, x, y);
+    set_particle_elem(get_particle_mut(grid, x, y), ELEM_SOLID);
+    update_planes(grid, x, y);
+}
+
+void
+init_field(coarse_field_t *field)
+{
+    field->block = NULL;
+    field->cells = NULL;
+    field->next = NULL;
+    field->rows = NULL;
+    field->next_rows = NULL;
+    field->width = 0;
+    field->height = 0;
+    field->live = false;
+}
+
+void
+alloc_field(coarse_field_t *field, int width, int height)
+{
+    field->width = (width + (1 << FIELD_SHIFT) - 1) >> FIELD_SHIFT;
+    field->height = (height + (1 << FIELD_SHIFT) - 1) >> FIELD_SHIFT;
+    field->live = false;
+    set_field_block(field, new_field_block(field->width, field->height));
+}
+
+void
+free_field(coarse_field_t *field)
+{
+    if (field->block != NULL)
+        release_field_block(field->block);
+
+    init_field(field);
+}
+
+void
+copy_field(coarse_field_t *dest, const coarse_field_t *src)
+{
+    /* Only the rows with anything in them are copied, the rest are cleared */
+    int y;
+    size_t width = (size_t)src->width;
+
+    /* Whatever dest shares is about to be replaced, so it isn't copied */
+    if (dest->block->refs > 1)
+        set_field_block(dest, new_field_block(dest->width, dest->height));
+
+    for (y = 0; y < src->height; y++) {
+        if (src->rows[y]) {
+            memcpy(&dest->cells[y * width], &src->cells[y * width],
+                   width * sizeof(*dest->cells));
+        }
+        else if (dest->rows[y]) {
+            memset(&dest->cells[y * width], 0, width * sizeof(*dest->cells));
+        }
+
+        dest->rows[y] = src->rows[y];
+    }
+
+    dest->live = src->live;
+}
+
+field_block_t *
+new_field_block(int width, int height)
+{
+    field_block_t *block = malloc(sizeof(*block));
+
+    if (block == NULL) {
+        fprintf(stderr, "Error: Could not allocate enough memory at %d in %s\n",
+                __LINE__, __FILE__);
+        exit(EXIT_FAILURE);
+    }
+
+    block->refs = 1;
+    block->cells = calloc(2 * (size_t)width * (size_t)height,
+                          sizeof(*block->cells));
+    block->rows = calloc(2 * (size_t)height, sizeof(*block->rows));
+
+    if (block->cells == NULL || block->rows == NULL) {
+        fprintf(stderr, "Error: Could not allocate enough memory at %d in %s\n",
+                __LINE__, __FILE__);
+        exit(EXIT_FAILURE);
+    }
+
+    return block;
+}
+
+void
+release_field_block(field_block_t *block)
+{
+    block->refs--;
+
+    if (block->refs == 0) {
+        free(block->cells);
+        free(block->rows);
+        free(block);
+    }
+}
+
+void
+set_field_block(coarse_field_t *field, field_block_t *block)
+{
+    size_t count = (size_t)field->width * (size_t)field->height;
+
+    if (field->block != NULL)
+        release_field_block(field->block);
+
+    field->block = block;
+    field->cells = block->cells;
+    field->next = block->cells + count;
+    field->rows = block->rows;
+    field->next_rows = block->rows + field->height;
+}
+
+void
+share_field(coarse_field_t *dest, const coarse_field_t *src)
+{
+    /* Grab the block first in case it's already the one dest has */
+    src->block->refs++;
+
+    if (dest->block != NULL)
+        release_field_block(dest->block);
+
+    /* The cells might have been swapped with next, so they're copied */
+    dest->block = src->block;
+    dest->cells = src->cells;
+    dest->next = src->next;
+    dest->rows = src->rows;
+    dest->next_rows = src->next_rows;
+    dest->width = src->width;
+    dest->height = src->height;
+    dest->live = src->live;
+}
+
+void
+unshare_field(coarse_field_t *field)
+{
+    coarse_field_t shared = *field;
+
+    if (field->block->refs == 1)
+        return;
+
+    /* Copying into a new block leaves next empty, which is what it expects */
+    field->block = NULL;
+    set_field_block(field, new_field_block(field->width, field->height));
+    copy_field(field, &shared);
+    release_field_block(shared.block);
+}
+
+void
+clear_field(coarse_field_t *field)
+{
+    int y;
+
+    /* Nothing needs emptying in a block no one else is using yet */
+    if (field->block->refs > 1) {
+        set_field_block(field, new_field_block(field->width, field->height));
+        field->live = false;
+        return;
+    }
+
+    if (!field->live)
+        return;
+
+    for (y = 0; y < field->height; y++) {
+        if (field->rows[y]) {
+            memset(&field->cells[(size_t)y * field->width], 0,
+                   field->width * sizeof(*field->cells));
+            field->rows[y] = false;
+        }
+    }
+
+    field->live = false;
+}
+
+void
+add_to_field(coarse_field_t *field, int x, int y, float amount)
+{
+    int fy = y >> FIELD_SHIFT;
+
+    field->cells[(size_t)fy * field->width + (x >> FIELD_SHIFT)] += amount;
+    field->rows[fy] = true;
+    field->live = true;
+}
+
+float
+get_field(const coarse_field_t *field, int x, int y)
+{
+    return field->cells[(size_t)(y >> FIELD_SHIFT) * field->width
+                        + (x >> FIELD_SHIFT)];
+}
+
+void
+update_heat(grid_t *grid)
+{
+    coarse_field_t *heat = &grid->heat;
+    int bands = (heat->height + HEAT_BAND_ROWS - 1) / HEAT_BAND_ROWS;
+    int i;
+    float *cells;
+    bool *rows;
+
+    if (!heat->live)
+        return;
+
+    if (grid->pool != NULL && bands > 1) {
+        run_tasks(grid->pool, bands, diffuse_heat_band, grid);
+    }
+    else {
+        for (i = 0; i < bands; i++)
+            diffuse_heat_band(grid, i);
+    }
+
+    cells = heat->cells;
+    heat->cells = heat->next;
+    heat->next = cells;
+
+    rows = heat->rows;
+    heat->rows = heat->next_rows;
+    heat->next_rows = rows;
+
+    heat->live = false;
+    for (i = 0; i < heat->height && !heat->live; i++)
+        heat->live = heat->rows[i];
+}
+
+void
+diffuse_heat_band(void *ctx, int task)
+{
+    coarse_field_t *heat = &((grid_t *)ctx)->heat;
+    size_t width = (size_t)heat->width;
+    int top = task * HEAT_BAND_ROWS + HEAT_BAND_ROWS;
+    int y;
+    const float *row, *below, *above;
+
+    if (top > heat->height)
+        top = heat->height;
+
+    for (y = task * HEAT_BAND_ROWS; y < top; y++) {
+        /* Heat only gets into a row from itself or the rows next to it */
+        if (heat->rows[y] || (y > 0 && heat->rows[y - 1])
+            || (y + 1 < heat->height && heat->rows[y + 1])) {
+            row = &heat->cells[y * width];
+            below = y > 0 ? row - width : row;
+            above = y + 1 < heat->height ? row + width : row;
+
+            heat->next_rows[y] = diffuse_heat_row(&heat->next[y * width], row,
+                                                  below, above, heat->width);
+        }
+        else if (heat->next_rows[y]) {
+            /* It's cold, but next still has whatever was there before */
+            memset(&heat->next[y * width], 0, width * sizeof(*heat->next));
+            heat->next_rows[y] = false;
+        }
+    }
+}
+
+bool
+diffuse_heat_row(float *restrict out, const float *restrict row,
+                 const float *restrict below, const float *restrict above,
+                 int width)
+{
+    int x, live = 0, keep;
+    float v;
+
+    for (x = 1; x < width - 1; x++) {
+        v = row[x] + HEAT_DIFFUSION * (row[x - 1] + row[x + 1] + below[x]
+                                       + above[x] - 4.0f * row[x]);
+        v *= HEAT_COOLING;
+
+        keep = v >= HEAT_MIN;
+        out[x] = keep ? v : 0.0f;
+        live |= keep;
+    }
+
+    /* The ends are their own neighbors, so no heat flows out the sides */
+    for (x = 0; x < width; x += width > 1 ? width - 1 : 1) {
+        v = row[x] + HEAT_DIFFUSION * (row[x > 0 ? x - 1 : x]
+                                       + row[x + 1 < width ? x + 1 : x]
+                                       + below[x] + above[x] - 4.0f * row[x]);
+        v *= HEAT_COOLING;
+
+        keep = v >= HEAT_MIN;
+        out[x] = keep ? v : 0.0f;
+        live |= keep;
+    }
+
+    return live != 0;
+}
+
+wind_field_t *
+new_wind_field(int width, int height)
+{
+    wind_field_t *wind = malloc(sizeof(*wind));
+    size_t count;
+
+    if (wind == NULL) {
+        fprintf(stderr, "Error: Could not allocate enough memory at %d in %s\n",
+                __LINE__, __FILE__);
+        exit(EXIT_FAILURE);
+    }
+
+    init_wind_field(wind, (width + (1 << WIND_SHIFT) - 1) >> WIND_SHIFT,
+                    (height + (1 << WIND_SHIFT) - 1) >> WIND_SHIFT);
+    count = (size_t)wind->width * (size_t)wind->height;
+
+    set_wind_block(wind, new_wind_block(count));
+    alloc_wind_scratch(wind);
+
+    return wind;
+}
+
+void
+init_wind_field(wind_field_t *wind, int width, int height)
+{
+    wind->block = NULL;
+    wind->vx = NULL;
+    wind->vy = NULL;
+    wind->solver_vx = NULL;
+    wind->solver_vy = NULL;
+    wind->heat = NULL;
+    wind->scratch_vx = NULL;
+    wind->scratch_vy = NULL;
+    wind->pressure = NULL;
+    wind->divergence = NULL;
+    wind->width = width;
+    wind->height = height;
+    wind->calm = true;
+    wind->still = true;
+    wind->threaded = false;
+    wind->busy = false;
+    wind->quitting = false;
+
+    pthread_mutex_init(&wind->lock, NULL);
+    pthread_cond_init(&wind->work_ready, NULL);
+    pthread_cond_init(&wind->work_done, NULL);
+}
+
+wind_field_t *
+fork_wind_field(wind_field_t *wind)
+{
+    wind_field_t *fork = malloc(sizeof(*fork));
+
+    if (fork == NULL) {
+        fprintf(stderr, "Error: Could not allocate enough memory at %d in %s\n",
+                __LINE__, __FILE__);
+        exit(EXIT_FAILURE);
+    }
+
+    init_wind_field(fork, wind->width, wind->height);
+    copy_wind_field(fork, wind);
+
+    return fork;
+}
+
+wind_block_t *
+new_wind_block(size_t count)
+{
+    wind_block_t *block = malloc(sizeof(*block));
+
+    if (block == NULL) {
+        fprintf(stderr, "Error: Could not allocate enough memory at %d in %s\n",
+                __LINE__, __FILE__);
+        exit(EXIT_FAILURE);
+    }
+
+    block->refs = 1;
+    block->v = calloc(6 * count, sizeof(*block->v));
+
+    if (block->v == NULL) {
+        fprintf(stderr, "Error: Could not allocate enough memory at %d in %s\n",
+                __LINE__, __FILE__);
+        exit(EXIT_FAILURE);
+    }
+
+    return block;
+}
+
+void
+release_wind_block(wind_block_t *block)
+{
+    block->refs--;
+
+    if (block->refs == 0) {
+        free(block->v);
+        free(block);
+    }
+}
+
+void
+set_wind_block(wind_field_t *wind, wind_block_t *block)
+{
+    size_t count = (size_t)wind->width * (size_t)wind->height;
+
+    if (wind->block != NULL)
+        release_wind_block(wind->block);
+
+    wind->block = block;
+    wind->vx = block->v;
+    wind->vy = block->v + count;
+    wind->solver_vx = block->v + 2 * count;
+    wind->solver_vy = block->v + 3 * count;
+    wind->scratch_vx = block->v + 4 * count;
+    wind->scratch_vy = block->v + 5 * count;
+}
+
+void
+share_wind_block(wind_field_t *dest, const wind_field_t *src)
+{
+    /* Grab the block first in case it's already the one dest has */
+    src->block->refs++;
+
+    if (dest->block != NULL)
+        release_wind_block(dest->block);
+
+    /* The solver might have swapped its arrays around, so they're copied */
+    dest->block = src->block;
+    dest->vx = src->vx;
+    dest->vy = src->vy;
+    dest->solver_vx = src->solver_vx;
+    dest->solver_vy = src->solver_vy;
+    dest->scratch_vx = src->scratch_vx;
+    dest->scratch_vy = src->scratch_vy;
+}
+
+void
+unshare_wind(wind_field_t *wind)
+{
+    size_t count = (size_t)wind->width * (size_t)wind->height;
+    size_t size = count * sizeof(*wind->vx);
+    wind_block_t *block = NULL;
+
+    if (wind->block->refs == 1)
+        return;
+
+    block = new_wind_block(count);
+    memcpy(block->v, wind->vx, size);
+    memcpy(block->v + count, wind->vy, size);
+    memcpy(block->v + 2 * count, wind->solver_vx, size);
+    memcpy(block->v + 3 * count, wind->solver_vy, size);
+
+    set_wind_block(wind, block);
+}
+
+void
+alloc_wind_scratch(wind_field_t *wind)
+{
+    size_t count = (size_t)wind->width * (size_t)wind->height;
+
+    if (wind->heat != NULL)
+        return;
+
+    wind->heat = calloc(count, sizeof(*wind->heat));
+    wind->pressure = calloc(count, sizeof(*wind->pressure));
+    wind->divergence = calloc(count, sizeof(*wind->divergence));
+
+    if (wind->heat == NULL || wind->pressure == NULL
+        || wind->divergence == NULL) {
+        fprintf(stderr, "Error: Could not allocate enough memory at %d in %s\n",
+                __LINE__, __FILE__);
+        exit(EXIT_FAILURE);
+    }
+}
+
+void
+destroy_wind_field(wind_field_t *wind)
+{
+    if (wind->threaded) {
+        pthread_mutex_lock(&wind->lock);
+        wind->quitting = true;
+        pthread_cond_signal(&wind->work_ready);
+        pthread_mutex_unlock(&wind->lock);
+
+        pthread_join(wind->thread, NULL);
+    }
+
+    pthread_cond_destroy(&wind->work_done);
+    pthread_cond_destroy(&wind->work_ready);
+    pthread_mutex_destroy(&wind->lock);
+
+    release_wind_block(wind->block);
+    free(wind->heat);
+    free(wind->pressure);
+    free(wind->divergence);
+    free(wind);
+}
+
+void
+start_wind_thread(wind_field_t *wind)
+{
+    if (wind->threaded)
+        return;
+
+    if (pthread_create(&wind->thread, NULL, wind_main, wind) != 0) {
+        fprintf(stderr, "Error: Could not start the wind thread at %d in %s\n",
+                __LINE__, __FILE__);
+        exit(EXIT_FAILURE);
+    }
+
+    wind->threaded = true;
+}
+
+void *
+wind_main(void *arg)
+{
+    wind_field_t *wind = arg;
+
+    pthread_mutex_lock(&wind->lock);
+
+    while (1) {
+        while (!wind->quitting && !wind->busy)
+            pthread_cond_wait(&wind->work_ready, &wind->lock);
+
+        if (wind->quitting)
+            break;
+
+        /* The grid leaves the solver's arrays alone until it's done */
+        pthread_mutex_unlock(&wind->lock);
+        solve_wind(wind);
+        pthread_mutex_lock(&wind->lock);
+
+        wind->busy = false;
+        pthread_cond_broadcast(&wind->work_done);
+    }
+
+    pthread_mutex_unlock(&wind->lock);
+
+    return NULL;
+}
+
+void
+wait_wind(wind_field_t *wind)
+{
+    if (!wind->threaded)
+        return;
+
+    pthread_mutex_lock(&wind->lock);
+
+    while (wind->busy)
+        pthread_cond_wait(&wind->work_done, &wind->lock);
+
+    pthread_mutex_unlock(&wind->lock);
+}
+
+void
+copy_wind_field(wind_field_t *dest, wind_field_t *src)
+{
+    wait_wind(dest);
+    wait_wind(src);
+
+    share_wind_block(dest, src);
+    dest->calm = src->calm;
+    dest->still = src->still;
+}
+
+void
+clear_wind(wind_field_t *wind)
+{
+    size_t size = (size_t)wind->width * (size_t)wind->height
+                  * sizeof(*wind->vx);
+
+    wait_wind(wind);
+
+    if (!wind->calm || !wind->still)
+        unshare_wind(wind);
+
+    if (!wind->calm) {
+        memset(wind->solver_vx, 0, size);
+        memset(wind->solver_vy, 0, size);
+        wind->calm = true;
+    }
+
+    if (!wind->still) {
+        memset(wind->vx, 0, size);
+        memset(wind->vy, 0, size);
+        wind->still = true;
+    }
+}
+
+void
+step_wind(grid_t *grid)
+{
+    wind_field_t *wind = grid->wind;
+    const coarse_field_t *heat = &grid->heat;
+    size_t size = (size_t)wind->width * (size_t)wind->height
+                  * sizeof(*wind->vx);
+    int ratio = 1 << (WIND_SHIFT - FIELD_SHIFT);
+    int x, y, hx, hy, top, right;
+    float total;
+
+    wait_wind(wind);
+    record_wind(grid, true);
+
+    /* Nothing's blowing, and nothing will be until something heats up */
+    if (wind->calm && !heat->live) {
+        clear_wind(wind);
+        return;
+    }
+
+    unshare_wind(wind);
+    alloc_wind_scratch(wind);
+
+    memcpy(wind->vx, wind->solver_vx, size);
+    memcpy(wind->vy, wind->solver_vy, size);
+    wind->still = false;
+
+    /* The solver gets its own copy of the heat, averaged over each wind cell */
+    if (!heat->live)
+        memset(wind->heat, 0, size);
+
+    for (y = 0; y < wind->height && heat->live; y++) {
+        top = (y + 1) * ratio < heat->height ? (y + 1) * ratio : heat->height;
+
+        for (x = 0; x < wind->width; x++) {
+            right = (x + 1) * ratio < heat->width ? (x + 1) * ratio
+                                                  : heat->width;
+            total = 0.0f;
+
+            for (hy = y * ratio; hy < top; hy++) {
+                if (!heat->rows[hy])
+                    continue;
+
+                for (hx = x * ratio; hx < right; hx++)
+                    total += heat->cells[(size_t)hy * heat->width + hx];
+            }
+
+            wind->heat[(size_t)y * wind->width + x] = total
+                                                      / (ratio * ratio);
+        }
+    }
+
+    if (wind->threaded) {
+        pthread_mutex_lock(&wind->lock);
+        wind->busy = true;
+        pthread_cond_signal(&wind->work_ready);
+        pthread_mutex_unlock(&wind->lock);
+    }
+    else {
+        solve_wind(wind);
+    }
+}
+
+void
+solve_wind(wind_field_t *wind)
+{
+    int width = wind->width, height = wind->height;
+    int x, y, k, left, right, below, above;
+    size_t i, count = (size_t)width * (size_t)height;
+    float *vx = wind->solver_vx, *vy = wind->solver_vy;
+    float *p = wind->pressure, *div = wind->divergence;
+    float back_x, back_y, speed, fastest = 0.0f;
+    bool hot = false;
+
+    /* Hot air rises */
+    for (i = 0; i < count; i++) {
+        vy[i] += WIND_BUOYANCY * wind->heat[i];
+        hot |= wind->heat[i] > 0.0f;
+    }
+
+    /**
+     * The wind carries itself along. Each cell looks back along its wind to
+     * find what blows into it, which can't blow up however fast it gets
+     */
+    for (y = 0; y < height; y++) {
+        for (x = 0; x < width; x++) {
+            i = (size_t)y * width + x;
+            back_x = x - vx[i] / (1 << WIND_SHIFT);
+            back_y = y - vy[i] / (1 << WIND_SHIFT);
+
+            wind->scratch_vx[i] = sample_wind(vx, width, height,
+                                              back_x, back_y);
+            wind->scratch_vy[i] = sample_wind(vy, width, height,
+                                              back_x, back_y);
+        }
+    }
+
+    wind->solver_vx = wind->scratch_vx;
+    wind->solver_vy = wind->scratch_vy;
+    wind->scratch_vx = vx;
+    wind->scratch_vy = vy;
+    vx = wind->solver_vx;
+    vy = wind->solver_vy;
+
+    /**
+     * Air can't pile up anywhere, so whatever flows into a cell more than
+     * out of it is pushed back out by the pressure. The pressure is solved
+     * for with a few rounds of Gauss-Seidel, with the edges as walls
+     */
+    for (y = 0; y < height; y++) {
+        for (x = 0; x < width; x++) {
+            i = (size_t)y * width + x;
+            left = x > 0 ? -1 : 0;
+            right = x + 1 < width ? 1 : 0;
+            below = y > 0 ? -width : 0;
+            above = y + 1 < height ? width : 0;
+
+            div[i] = -0.5f * (vx[i + right] - vx[i + left]
+                              + vy[i + above] - vy[i + below]);
+            p[i] = 0.0f;
+        }
+    }
+
+    for (k = 0; k < WIND_PRESSURE_STEPS; k++) {
+        for (y = 0; y < height; y++) {
+            for (x = 0; x < width; x++) {
+                i = (size_t)y * width + x;
+                left = x > 0 ? -1 : 0;
+                right = x + 1 < width ? 1 : 0;
+                below = y > 0 ? -width : 0;
+                above = y + 1 < height ? width : 0;
+
+                p[i] = (div[i] + p[i + left] + p[i + right] + p[i + below]
+                        + p[i + above]) * 0.25f;
+            }
+        }
+    }
+
+    for (y = 0; y < height; y++) {
+        for (x = 0; x < width; x++) {
+            i = (size_t)y * width + x;
+            left = x > 0 ? -1 : 0;
+            right = x + 1 < width ? 1 : 0;
+            below = y > 0 ? -width : 0;
+            above = y + 1 < height ? width : 0;
+
+            vx[i] -= 0.5f * (p[i + right] - p[i + left]);
+            vy[i] -= 0.5f * (p[i + above] - p[i + below]);
+
+            /* Nothing blows through the edges */
+            if (left == 0 || right == 0)
+                vx[i] = 0.0f;
+            if (below == 0 || above == 0)
+                vy[i] = 0.0f;
+
+            vx[i] = clamp_wind(vx[i] * WIND_DAMPING);
+            vy[i] = clamp_wind(vy[i] * WIND_DAMPING);
+
+            speed = vx[i] < 0.0f ? -vx[i] : vx[i];
+            fastest = speed > fastest ? speed : fastest;
+            speed = vy[i] < 0.0f ? -vy[i] : vy[i];
+            fastest = speed > fastest ? speed : fastest;
+        }
+    }
+
+    /* Once it's died down and there's nothing to stir it up, it stops */
+    wind->calm = !hot && fastest < WIND_MIN_SPEED;
+    if (wind->calm) {
+        memset(vx, 0, count * sizeof(*vx));
+        memset(vy, 0, count * sizeof(*vy));
+    }
+}
+
+float
+sample_wind(const float *v, int width, int height, float x, float y)
+{
+    int x0, y0, x1, y1;
+    float fx, fy;
+
+    if (x < 0.0f)
+        x = 0.0f;
+    if (x > width - 1)
+        x = (float)(width - 1);
+    if (y < 0.0f)
+        y = 0.0f;
+    if (y > height - 1)
+        y = (float)(height - 1);
+
+    x0 = (int)x;
+    y0 = (int)y;
+    x1 = x0 + 1 < width ? x0 + 1 : x0;
+    y1 = y0 + 1 < height ? y0 + 1 : y0;
+    fx = x - x0;
+    fy = y - y0;
+
+    return (v[(size_t)y0 * width + x0] * (1.0f - fx)
+            + v[(size_t)y0 * width + x1] * fx) * (1.0f - fy)
+           + (v[(size_t)y1 * width + x0] * (1.0f - fx)
+              + v[(size_t)y1 * width + x1] * fx) * fy;
+}
+
+float
+clamp_wind(float v)
+{
+    if (v > WIND_MAX_SPEED)
+        return WIND_MAX_SPEED;
+    if (v < -WIND_MAX_SPEED)
+        return -WIND_MAX_SPEED;
+
+    return v;
+}
+
+Vector2
+get_wind(const grid_t *grid, int x, int y)
+{
+    const wind_field_t *wind = grid->wind;
+    size_t i = (size_t)(y >> WIND_SHIFT) * wind->width + (x >> WIND_SHIFT);
+
+    return (Vector2){wind->vx[i], wind->vy[i]};
+}
+
+int
+round_randomly(grid_t *grid, float v)
+{
+    int whole = (int)v;
+    float fraction = v - whole;
+
+    /* The fraction is how likely it is to go a cell further */
+    if (fraction < 0.0f) {
+        if ((float)(grid_rand(grid) % 1024) < -fraction * 1024.0f)
+            whole--;
+    }
+    else if (fraction > 0.0f) {
+        if ((float)(grid_rand(grid) % 1024) < fraction * 1024.0f)
+            whole++;
+    }
+
+    return whole;
+}
+
+bool
+blow_gas(grid_t *grid, int x, int y)
+{
+    Vector2 wind = get_wind(grid, x, y);
+    int dx, dy, step, steps, next_x, next_y, to_x = x, to_y = y;
+
+    if (wind.x < WIND_MIN_SPEED && wind.x > -WIND_MIN_SPEED
+        && wind.y < WIND_MIN_SPEED && wind.y > -WIND_MIN_SPEED)
+        return false;
+
+    /* Gas rises a cell a tick on its own and the wind takes it from there */
+    dx = round_randomly(grid, wind.x);
+    dy = round_randomly(grid, wind.y) + 1;
+    steps = dx < 0 ? -dx : dx;
+    steps = dy > steps ? dy : -dy > steps ? -dy : steps;
+
+    /* It goes as far along the way as it can before running into anything */
+    for (step = 1; step <= steps; step++) {
+        next_x = x + dx * step / steps;
+        next_y = y + dy * step / steps;
+
+        if (!is_pos_empty(grid, next_x, next_y))
+            break;
+
+        to_x = next_x;
+        to_y = next_y;
+    }
+
+    if (to_x == x && to_y == y)
+        return false;
+
+    swap_particles(grid, x, y, to_x, to_y);
+
+    return true;
+}
+
+void
+absorb_smoke(grid_t *grid, int x, int y)
+{
+    remove_particle(grid, x, y);
+    add_to_field(&grid->smoke, x, y, 1.0f);
+}
+
+bool
+is_smoke_edge(const coarse_field_t *smoke, int x, int y)
+{
+    const float *cell = &smoke->cells[(size_t)y * smoke->width + x];
+
+    return (x > 0 && cell[-1] < SMOKE_DENSE)
+           || (x + 1 < smoke->width && cell[1] < SMOKE_DENSE)
+           || (y > 0 && cell[-smoke->width] < SMOKE_DENSE)
+           || (y + 1 < smoke->height && cell[smoke->width] < SMOKE_DENSE);
+}
+
+int
+count_field_cell(const grid_t *grid, int plane, int x, int y)
+{
+    const chunk_t *chunk = NULL;
+    const uint64_t mask = ((uint64_t)1 << (1 << FIELD_SHIFT)) - 1;
+    size_t bit;
+    int row, count = 0;
+
+    x <<= FIELD_SHIFT;
+
+    /* The cell's particles in a row are all in the same word of the plane */
+    for (row = y << FIELD_SHIFT; row < (y + 1) << FIELD_SHIFT; row++) {
+        if (row >= grid->height)
+            break;
+
+        chunk = grid->chunks[row >> CHUNK_SHIFT];
+        bit = get_plane_bit(grid, x, row);
+        count += __builtin_popcountll((chunk->planes[plane * chunk->plane_words
+                                                     + bit / 64]
+                                       >> (bit % 64)) & mask);
+    }
+
+    return count;
+}
+
+void
+update_smoke_field(grid_t *grid)
+{
+    coarse_field_t *smoke = &grid->smoke;
+    size_t width = (size_t)smoke->width;
+    size_t i;
+    int x, y;
+    float amount, *cells;
+    bool *rows, row_live;
+    Vector2 wind;
+
+    if (!smoke->live)
+        return;
+
+    /* The smoke drifts up and along with the wind, thinning out as it goes */
+    for (y = 0; y < smoke->height; y++) {
+        if (!smoke->rows[y])
+            continue;
+
+        for (x = 0; x < smoke->width; x++) {
+            amount = smoke->cells[y * width + x] * SMOKE_DISSIPATION;
+            if (amount <= 0.0f)
+                continue;
+
+            wind = get_wind(grid, x << FIELD_SHIFT, y << FIELD_SHIFT);
+            spread_smoke(grid, x, y,
+                         x + wind.x / (1 << FIELD_SHIFT),
+                         y + (wind.y + 1.0f) / (1 << FIELD_SHIFT), amount);
+        }
+
+        memset(&smoke->cells[y * width], 0, width * sizeof(*smoke->cells));
+        smoke->rows[y] = false;
+    }
+
+    cells = smoke->cells;
+    smoke->cells = smoke->next;
+    smoke->next = cells;
+
+    rows = smoke->rows;
+    smoke->rows = smoke->next_rows;
+    smoke->next_rows = rows;
+
+    /**
+     * Particles only come back out where the smoke is thin or at the edges of
+     * the plume, so the inside of a big plume costs a cell at a time
+     */
+    smoke->live = false;
+
+    for (y = 0; y < smoke->height; y++) {
+        if (!smoke->rows[y])
+            continue;
+
+        row_live = false;
+
+        for (x = 0; x < smoke->width; x++) {
+            i = y * width + x;
+            amount = smoke->cells[i];
+            if (amount <= 0.0f)
+                continue;
+
+            /* Whatever thin smoke can't let out is too little to keep */
+            if (amount < SMOKE_THIN) {
+                release_smoke(grid, x, y, round_randomly(grid, amount));
+                amount = 0.0f;
+            }
+            else if (is_smoke_edge(smoke, x, y)) {
+                amount -= release_smoke(grid, x, y,
+                                        round_randomly(grid, amount
+                                                             * SMOKE_RELEASE));
+            }
+
+            smoke->cells[i] = amount;
+            row_live |= amount > 0.0f;
+        }
+
+        smoke->rows[y] = row_live;
+        smoke->live |= row_live;
+    }
+}
+
+void
+spread_smoke(grid_t *grid, int x, int y, float to_x, float to_y, float amount)
+{
+    coarse_field_t *smoke = &grid->smoke;
+    int cell_x[4], cell_y[4];
+    float weights[4], fx, fy;
+    int k;
+
+    if (to_x < 0.0f)
+        to_x = 0.0f;
+    if (to_x > smoke->width - 1)
+        to_x = (float)(smoke->width - 1);
+    if (to_y < 0.0f)
+        to_y = 0.0f;
+    if (to_y > smoke->height - 1)
+        to_y = (float)(smoke->height - 1);
+
+    /* It's split between the four cells around where it ends up */
+    cell_x[0] = cell_x[2] = (int)to_x;
+    cell_y[0] = cell_y[1] = (int)to_y;
+    cell_x[1] = cell_x[3] = cell_x[0] + 1 < smoke->width ? cell_x[0] + 1
+                                                         : cell_x[0];
+    cell_y[2] = cell_y[3] = cell_y[0] + 1 < smoke->height ? cell_y[0] + 1
+                                                          : cell_y[0];
+    fx = to_x - cell_x[0];
+    fy = to_y - cell_y[0];
+    weights[0] = (1.0f - fx) * (1.0f - fy);
+    weights[1] = fx * (1.0f - fy);
+    weights[2] = (1.0f - fx) * fy;
+    weights[3] = fx * fy;
+
+    for (k = 0; k < 4; k++) {
+        if (weights[k] <= 0.0f)
+            continue;
+
+        /* Smoke doesn't go through walls, so that part stays where it is */
+        if (count_field_cell(grid, ELEM_STATIC, cell_x[k], cell_y[k]) > 0) {
+            cell_x[k] = x;
+            cell_y[k] = y;
+        }
+
+        smoke->next[(size_t)cell_y[k] * smoke->width + cell_x[k]] +=
+            amount * weights[k];
+        smoke->next_rows[cell_y[k]] = true;
+    }
+}
 
-        if (IsMouseButtonDown(MOUSE_BUTTON_LEFT)) {
-            particle_line(grid, prev_pos[0], prev_pos[1],
-                                curr_pos[0], curr_pos[1], curr_mat);
+int
+release_smoke(grid_t *grid, int x, int y, int count)
+{
+    int released = 0, tries, px, py;
+    int mask = (1 << FIELD_SHIFT) - 1;
+
+    /* It gets a couple of tries per particle to find empty spots */
+    for (tries = 0; released < count && tries < count * 2; tries++) {
+        px = (x << FIELD_SHIFT) + (int)(grid_rand(grid) & mask);
+        py = (y << FIELD_SHIFT) + (int)(grid_rand(grid) & mask);
+
+        if (is_pos_empty(grid, px, py)) {
+            add_particle(grid, px, py, MAT_SMOKE);
+            released++;
         }
-        else if (IsMouseButtonDown(MOUSE_BUTTON_RIGHT)) {
-            particle_line(grid, prev_pos[0], prev_pos[1],
-                                curr_pos[0], curr_pos[1], MAT_EMPTY);
+    }
+
+    return released;
+}
+
+double
+get_field_total(const coarse_field_t *field)
+{
+    double total = 0.0;
+    size_t i, width = (size_t)field->width;
+    int y;
+
+    for (y = 0; y < field->height; y++) {
+        if (!field->rows[y])
+            continue;
+
+        for (i = y * width; i < (y + 1) * width; i++)
+            total += field->cells[i];
+    }
+
+    return total;
+}
+
+void
+init_blasts(blasts_t *blasts)
+{
+    blast_ray_t *ray = NULL;
+    int r, step, along;
+    float to_x, to_y, length;
+
+    for (r = 0; r < BLAST_RAYS; r++) {
+        ray = &blasts->rays[r];
+
+        /* Each ray goes to one of the cells around the edge of the reach */
+        along = r % (2 * BLAST_RADIUS) - BLAST_RADIUS;
+
+        switch (r / (2 * BLAST_RADIUS)) {
+            case 0:
+                to_x = along;
+                to_y = -BLAST_RADIUS;
+                break;
+            case 1:
+                to_x = BLAST_RADIUS;
+                to_y = along;
+                break;
+            case 2:
+                to_x = -along;
+                to_y = BLAST_RADIUS;
+                break;
+            default:
+                to_x = -BLAST_RADIUS;
+                to_y = -along;
+                break;
         }
 
-        if (IsKeyPressed(KEY_C))
-            clear_grid(grid);
+        length = sqrtf(to_x * to_x + to_y * to_y);
+        ray->cost = length / BLAST_RADIUS;
+        ray->direction.x = to_x / length;
+        ray->direction.y = to_y / length;
 
-        /**
-         * @note Two separate loops are used for grid updates. One for the
-         * actual particle interactions and a second for drawing particles.
-         * This is for simplicity because moving particles then drawing them
-         * was hard logic that I'm too dumb to figure out.
-         * Until I figure out how to update AND draw within the same loop
-         * again, this will have to be two loops
-         */
-        for (y = 0; y < grid_h; y++) {
-            for (x = 0; x < grid_w; x++) {
-                curr_particle = get_particle(grid, x, y);
+        for (step = 0; step < BLAST_RADIUS; step++) {
+            ray->x[step] = (signed char)floorf(to_x * (step + 1) / BLAST_RADIUS
+                                               + 0.5f);
+            ray->y[step] = (signed char)floorf(to_y * (step + 1) / BLAST_RADIUS
+                                               + 0.5f);
+        }
+    }
 
-                if (curr_particle == NULL)
-                    continue;
+    blasts->queue = NULL;
+    blasts->count = 0;
+    blasts->capacity = 0;
+    blasts->hits = NULL;
+    blasts->hit_counts = NULL;
+    blasts->hit_capacity = 0;
+}
 
-                if (curr_particle->has_been_updated)
-                    continue;
+void
+free_blasts(blasts_t *blasts)
+{
+    free(blasts->queue);
+    free(blasts->hits);
+    free(blasts->hit_counts);
+    init_blasts(blasts);
+}
 
-                curr_particle->update_func(grid, x, y);
-            }
+bool
+copy_blasts(blasts_t *dest, const blasts_t *src)
+{
+    blast_t *queue = dest->queue;
+
+    if (src->count > dest->capacity) {
+        queue = realloc(dest->queue, src->count * sizeof(*queue));
+
+        if (queue == NULL)
+            return false;
+
+        dest->queue = queue;
+        dest->capacity = src->count;
+    }
+
+    if (src->count > 0)
+        memcpy(queue, src->queue, src->count * sizeof(*queue));
+
+    dest->count = src->count;
+
+    return true;
+}
+
+void
+detonate_particle(grid_t *grid, int x, int y)
+{
+    blasts_t *blasts = &grid->blasts;
+    blast_t *queue = NULL;
+    size_t capacity;
+
+    if (blasts->count == blasts->capacity) {
+        capacity = blasts->capacity == 0 ? 64 : blasts->capacity * 2;
+        queue = realloc(blasts->queue, capacity * sizeof(*queue));
+
+        if (queue == NULL) {
+            fprintf(stderr, "Error: Could not allocate enough memory at %d in "
+                    "%s\n", __LINE__, __FILE__);
+            exit(EXIT_FAILURE);
         }
 
-        BeginDrawing();
-            ClearBackground((Color){64, 64, 64, 255});
+        blasts->queue = queue;
+        blasts->capacity = capacity;
+    }
 
-            /* UI drawing code */
-            DrawRectangle(0, grid_h, scr_w, scr_h - grid_h, DARKBLUE);
-            DrawFPS(4, grid_h);
-            DrawRectangle(4, grid_h + 20, 40, 40, get_color_from_mat(curr_mat));
+    remove_particle(grid, x, y);
 
-            for (y = 0; y < grid_h; y++) {
-                for (x = 0; x < grid_w; x++) {
-                    curr_particle = get_particle(grid, x, y);
+    blasts->queue[blasts->count].x = x;
+    blasts->queue[blasts->count].y = y;
+    blasts->count++;
+}
 
-                    if (curr_particle == NULL)
-                        continue;
+void
+update_blasts(grid_t *grid)
+{
+    blasts_t *blasts = &grid->blasts;
+    size_t n = blasts->count, i;
+    int h;
+    const blast_hit_t *hit = NULL;
+    blast_hit_t *hits = NULL;
+    int *hit_counts = NULL;
+
+    if (n == 0)
+        return;
 
-                    curr_particle->has_been_updated = false;
-                    DrawPixel(x, grid_w - 1 - y, curr_particle->color);
-                }
-            }
+    if (n > blasts->hit_capacity) {
+        hits = realloc(blasts->hits, n * BLAST_MAX_HITS * sizeof(*hits));
+        if (hits != NULL)
+            blasts->hits = hits;
 
-            for (i = 1; i < MAT_COUNT; i++) {
-                DrawRectangle(30 + 20 * i, grid_h + 20, 15, 15,
-                              get_color_from_mat(i));
+        hit_counts = realloc(blasts->hit_counts, n * sizeof(*hit_counts));
+        if (hit_counts != NULL)
+            blasts->hit_counts = hit_counts;
+
+        if (hits == NULL || hit_counts == NULL) {
+            fprintf(stderr, "Error: Could not allocate enough memory at %d in "
+                    "%s\n", __LINE__, __FILE__);
+            exit(EXIT_FAILURE);
+        }
+
+        blasts->hit_capacity = n;
+    }
+
+    if (grid->pool != NULL && n > 1) {
+        run_tasks(grid->pool, (int)n, cast_blast, grid);
+    }
+    else {
+        for (i = 0; i < n; i++)
+            cast_blast(grid, (int)i);
+    }
+
+    /* Blasts that overlap can hit the same cell, which the first one empties */
+    for (i = 0; i < n; i++) {
+        for (h = 0; h < blasts->hit_counts[i]; h++) {
+            hit = &blasts->hits[i * BLAST_MAX_HITS + (size_t)h];
+
+            switch (get_particle_type_pos(grid, hit->x, hit->y)) {
+                case MAT_EMPTY:
+                    break;
+                case MAT_POWDER:
+                    /* It joins the end of the queue, so it's left for later */
+                    detonate_particle(grid, hit->x, hit->y);
+                    break;
+                case MAT_SMOKE:
+                case MAT_FLAME:
+                    remove_particle(grid, hit->x, hit->y);
+                    break;
+                default:
+                    /* Wood that's thrown comes down as loose wood */
+                    if (is_pos_static(grid, hit->x, hit->y))
+                        loosen_particle(grid, hit->x, hit->y);
+
+                    launch_particle(grid, hit->x, hit->y, hit->velocity);
+                    break;
             }
-        EndDrawing();
+        }
 
-        prev_pos[0] = curr_pos[0];
-        prev_pos[1] = curr_pos[1];
+        add_to_field(&grid->heat, blasts->queue[i].x, blasts->queue[i].y,
+                     BLAST_HEAT);
+        add_particle(grid, blasts->queue[i].x, blasts->queue[i].y, MAT_FLAME);
     }
 
-    destroy_grid(grid);
-    CloseWindow();
-    return 0;
+    /**
+     * What's left is what these blasts set off, which goes off next tick. A
+     * long chain goes off over a few ticks instead of all in one
+     */
+    blasts->count -= n;
+    memmove(blasts->queue, blasts->queue + n,
+            blasts->count * sizeof(*blasts->queue));
 }
 
-grid_t *
-new_empty_grid(void)
+void
+cast_blast(void *ctx, int task)
 {
-    grid_t *grid = malloc(sizeof(*grid));
+    grid_t *grid = ctx;
+    const blast_t *blast = &grid->blasts.queue[task];
+    const blast_ray_t *ray = NULL;
+    blast_hit_t *hits = &grid->blasts.hits[(size_t)task * BLAST_MAX_HITS];
+    short seen[BLAST_MAX_HITS];
+    float strengths[BLAST_MAX_HITS];
+    int r, step, x, y, cell, hit, count = 0;
+    float strength;
+
+    /* Which of the hits each cell in reach is, plus one, or 0 if it isn't */
+    memset(seen, 0, sizeof(seen));
+
+    for (r = 0; r < BLAST_RAYS; r++) {
+        ray = &grid->blasts.rays[r];
+        strength = BLAST_RADIUS;
+
+        for (step = 0; step < BLAST_RADIUS; step++) {
+            strength -= ray->cost;
+            if (strength <= 0.0f)
+                break;
 
-    grid->width = 0;
-    grid->height = 0;
-    grid->arr = NULL;
+            x = blast->x + ray->x[step];
+            y = blast->y + ray->y[step];
 
-    return grid;
+            if (x < 0 || x >= grid->width || y < 0 || y >= grid->height)
+                break;
+
+            if (!test_plane(grid, PLANE_OCCUPIED, x, y))
+                continue;
+
+            /* Walls that have come loose are just rubble */
+            if (test_plane(grid, ELEM_STATIC, x, y)
+                && get_particle(grid, x, y)->mat_type == MAT_WALL) {
+                strength -= BLAST_WALL_COST;
+                continue;
+            }
+
+            /**
+             * Rays overlap near the middle, so a cell can be hit by lots of
+             * them. It's thrown by whichever hit it hardest
+             */
+            cell = (ray->y[step] + BLAST_RADIUS) * (2 * BLAST_RADIUS + 1)
+                   + ray->x[step] + BLAST_RADIUS;
+
+            if (seen[cell] == 0) {
+                hit = count++;
+                seen[cell] = (short)count;
+                hits[hit].x = x;
+                hits[hit].y = y;
+                strengths[hit] = 0.0f;
+            }
+            else {
+                hit = seen[cell] - 1;
+            }
+
+            if (strength > strengths[hit]) {
+                strengths[hit] = strength;
+                hits[hit].velocity.x = ray->direction.x * BLAST_SPEED
+                                       * strength / BLAST_RADIUS;
+                hits[hit].velocity.y = ray->direction.y * BLAST_SPEED
+                                       * strength / BLAST_RADIUS;
+            }
+
+            strength -= BLAST_CELL_COST;
+        }
+    }
+
+    grid->blasts.hit_counts[task] = count;
 }
 
-grid_t *
-new_grid(int width, int height)
+void
+set_lighting(grid_t *grid, bool enabled)
 {
-    grid_t *grid = malloc(sizeof(*grid));
+    if (!enabled && grid->light != NULL) {
+        destroy_light_map(grid->light);
+        grid->light = NULL;
+    }
+    else if (enabled && grid->light == NULL) {
+        grid->light = new_light_map(grid->width, grid->height);
+    }
+}
 
-    grid->width = width;
-    grid->height = height;
-    grid->arr = calloc(width * height, sizeof(*grid->arr));
+light_map_t *
+new_light_map(int width, int height)
+{
+    light_map_t *light = malloc(sizeof(*light));
 
-    if (grid->arr == NULL) {
+    if (light == NULL) {
         fprintf(stderr, "Error: Could not allocate enough memory at %d in %s\n",
                 __LINE__, __FILE__);
         exit(EXIT_FAILURE);
     }
 
-    clear_grid(grid);
+    init_light_map(light, (width + (1 << FIELD_SHIFT) - 1) >> FIELD_SHIFT,
+                   (height + (1 << FIELD_SHIFT) - 1) >> FIELD_SHIFT);
+    set_light_block(light, new_light_block((size_t)light->width
+                                           * (size_t)light->height));
 
-    return grid;
+    return light;
 }
 
 void
-init_grid(grid_t *grid, int width, int height)
+init_light_map(light_map_t *light, int width, int height)
 {
-    grid->width = width;
-    grid->height = height;
-    grid->arr = calloc(width * height, sizeof(*grid->arr));
+    light->block = NULL;
+    light->levels = NULL;
+    light->shown = NULL;
+    light->emit = NULL;
+    light->next_emit = NULL;
+    light->opaque = NULL;
+    light->queued = NULL;
+    light->remove_queue = NULL;
+    light->add_queue = NULL;
+    light->changes = NULL;
+    light->change_levels = NULL;
+    light->add_head = 0;
+    light->add_tail = 0;
+    light->change_count = 0;
+    light->width = width;
+    light->height = height;
+    light->dark = true;
+    light->threaded = false;
+    light->busy = false;
+    light->quitting = false;
+
+    pthread_mutex_init(&light->lock, NULL);
+    pthread_cond_init(&light->work_ready, NULL);
+    pthread_cond_init(&light->work_done, NULL);
+}
 
-    if (grid->arr == NULL) {
+light_map_t *
+fork_light_map(light_map_t *light)
+{
+    light_map_t *fork = malloc(sizeof(*fork));
+
+    if (fork == NULL) {
         fprintf(stderr, "Error: Could not allocate enough memory at %d in %s\n",
                 __LINE__, __FILE__);
         exit(EXIT_FAILURE);
     }
 
-    clear_grid(grid);
+    init_light_map(fork, light->width, light->height);
+    copy_light_map(fork, light);
+
+    return fork;
 }
 
-void
-destroy_grid(grid_t *grid)
+light_block_t *
+new_light_block(size_t count)
 {
-    free(grid->arr);
-    grid->arr = NULL;
+    light_block_t *block = malloc(sizeof(*block));
 
-    free(grid);
-    grid = NULL;
+    if (block == NULL) {
+        fprintf(stderr, "Error: Could not allocate enough memory at %d in %s\n",
+                __LINE__, __FILE__);
+        exit(EXIT_FAILURE);
+    }
+
+    block->refs = 1;
+    block->levels = calloc(4 * count, sizeof(*block->levels));
+    block->flags = calloc(2 * count, sizeof(*block->flags));
+    block->queues = malloc(4 * count * sizeof(*block->queues));
+
+    if (block->levels == NULL || block->flags == NULL
+        || block->queues == NULL) {
+        fprintf(stderr, "Error: Could not allocate enough memory at %d in %s\n",
+                __LINE__, __FILE__);
+        exit(EXIT_FAILURE);
+    }
+
+    return block;
 }
 
 void
-clear_grid(grid_t *grid)
+release_light_block(light_block_t *block)
 {
-    int x, y;
-    particle_t empty_particle = {
-        MAT_EMPTY,
-        ELEM_EMPTY,
-        0.0f,
-        (Vector2){0.0f, 0.0f},
-        BLANK,
-        false,
-        update_empty
-    };
+    block->refs--;
 
-    for (y = 0; y < grid->height; y++) {
-        for (x = 0; x < grid->width; x++) {
-            set_particle(grid, x, y, &empty_particle);
-        }
+    if (block->refs == 0) {
+        free(block->levels);
+        free(block->flags);
+        free(block->queues);
+        free(block);
     }
 }
 
-particle_t *
-get_particle(const grid_t *grid, int x, int y)
+void
+set_light_block(light_map_t *light, light_block_t *block)
 {
-    if (x < 0 || x >= grid->width || y < 0 || y >= grid->height)
-        return NULL;
-
-    return &grid->arr[y * grid->width + x];
+    size_t count = (size_t)light->width * (size_t)light->height;
+
+    if (light->block != NULL)
+        release_light_block(light->block);
+
+    light->block = block;
+    light->levels = block->levels;
+    light->shown = block->levels + count;
+    light->emit = block->levels + 2 * count;
+    light->next_emit = block->levels + 3 * count;
+    light->opaque = block->flags;
+    light->queued = block->flags + count;
+    light->remove_queue = block->queues;
+    light->add_queue = block->queues + count;
+    light->changes = block->queues + 2 * count;
+    light->change_levels = block->queues + 3 * count;
 }
 
 void
-set_particle(grid_t *grid, int x, int y, particle_t *p)
+unshare_light(light_map_t *light)
 {
-    int index = y * grid->width + x;
+    size_t count = (size_t)light->width * (size_t)light->height;
+    light_block_t *block = NULL;
 
-    if (index < 0 || index > grid->width * grid->height)
+    if (light->block->refs == 1)
         return;
 
-    grid->arr[index].mat_type = p->mat_type;
-    grid->arr[index].elem_type = p->elem_type;
-    grid->arr[index].velocity = p->velocity;
-    grid->arr[index].has_been_updated = p->has_been_updated;
-    grid->arr[index].life_time = p->life_time;
-    grid->arr[index].color = p->color;
-    grid->arr[index].update_func = p->update_func;
+    /* Nothing's queued between steps, so only the light itself is copied */
+    wait_light(light);
+    block = new_light_block(count);
+    memcpy(block->levels, light->levels, 4 * count * sizeof(*block->levels));
+    memcpy(block->flags, light->opaque, count * sizeof(*block->flags));
+
+    set_light_block(light, block);
 }
 
-material_type
-get_particle_type(const particle_t *p)
+void
+destroy_light_map(light_map_t *light)
 {
-    return p->mat_type;
+    if (light->threaded) {
+        pthread_mutex_lock(&light->lock);
+        light->quitting = true;
+        pthread_cond_signal(&light->work_ready);
+        pthread_mutex_unlock(&light->lock);
+
+        pthread_join(light->thread, NULL);
+    }
+
+    pthread_cond_destroy(&light->work_done);
+    pthread_cond_destroy(&light->work_ready);
+    pthread_mutex_destroy(&light->lock);
+
+    release_light_block(light->block);
+    free(light);
 }
 
-material_type
-get_particle_type_pos(const grid_t *grid, int x, int y)
+void
+start_light_thread(light_map_t *light)
 {
-    /* TODO: Fix this */
-    if (x < 0 || x >= grid->width || y < 0 || y >= grid->height)
-        return MAT_EMPTY;
+    if (light->threaded)
+        return;
 
-    return get_particle(grid, x, y)->mat_type;
+    if (pthread_create(&light->thread, NULL, light_main, light) != 0) {
+        fprintf(stderr, "Error: Could not start the light thread at %d in %s\n",
+                __LINE__, __FILE__);
+        exit(EXIT_FAILURE);
+    }
+
+    light->threaded = true;
 }
 
-void
-add_particle(grid_t *grid, int x, int y, material_type m)
+void *
+light_main(void *arg)
 {
-    particle_t part;
+    light_map_t *light = arg;
 
-    if (!is_pos_empty(grid, x, y))
-        return;
+    pthread_mutex_lock(&light->lock);
 
-    part.mat_type = m;
-    part.velocity = (Vector2){0.0f, 0.0f};
-    part.has_been_updated = false;
+    while (1) {
+        while (!light->quitting && !light->busy)
+            pthread_cond_wait(&light->work_ready, &light->lock);
 
-    switch (m) {
-        case MAT_SAND:
-            part.elem_type = ELEM_SOLID;
-            part.life_time = 0.0f;
-            part.color = YELLOW;
-            part.update_func = update_sand;
-            break;
-        case MAT_WATER:
-            part.elem_type = ELEM_LIQUID;
-            part.life_time = 0.0f;
-            part.color = SKYBLUE;
-            part.color.a = 128;
-            part.update_func = update_water;
-            break;
-        case MAT_SMOKE:
-            part.elem_type = ELEM_GAS;
-            part.life_time = 3.0f;
-            part.color = GRAY;
-            part.update_func = update_smoke;
-            break;
-        case MAT_OIL:
-            part.elem_type = ELEM_LIQUID;
-            part.life_time = 3.0f;
-            part.color = BLACK;
-            part.update_func = update_oil;
-            break;
-        case MAT_WALL:
-            part.elem_type = ELEM_STATIC;
-            part.life_time = 0.0f;
-            part.color = LIGHTGRAY;
-            part.update_func = update_wall;
-            break;
-        case MAT_WOOD:
-            part.elem_type = ELEM_STATIC;
-            part.life_time = 7.5f;
-            part.color = (Color){66, 27, 4, 255};
-            part.update_func = update_wood;
-            break;
-        case MAT_FIRE:
-            part.elem_type = ELEM_SOLID;
-            part.life_time = 8.0f;
-            part.color = RED;
-            part.update_func = update_fire;
-            break;
-        case MAT_FLAME:
-            part.elem_type = ELEM_GAS;
-            part.life_time = 1.5f;
-            part.color = ORANGE;
-            part.update_func = update_flame;
-            break;
-        default:
+        if (light->quitting)
             break;
+
+        /* The grid leaves the levels alone until it's done */
+        pthread_mutex_unlock(&light->lock);
+        relight(light);
+        pthread_mutex_lock(&light->lock);
+
+        light->busy = false;
+        pthread_cond_broadcast(&light->work_done);
     }
 
-    set_particle(grid, x, y, &part);
+    pthread_mutex_unlock(&light->lock);
+
+    return NULL;
 }
 
 void
-remove_particle(grid_t *grid, int x, int y)
+wait_light(light_map_t *light)
 {
-    particle_t empty_particle;
-
-    if (is_pos_empty(grid, x,  y))
+    if (!light->threaded)
         return;
 
-    empty_particle.mat_type = MAT_EMPTY;
-    empty_particle.elem_type = ELEM_EMPTY;
-    empty_particle.life_time = 0.0f;
-    empty_particle.velocity = (Vector2){0.0f, 0.0f};
-    empty_particle.color = BLANK;
-    empty_particle.has_been_updated = false;
-    empty_particle.update_func = update_empty;
+    pthread_mutex_lock(&light->lock);
 
-    set_particle(grid, x, y, &empty_particle);
+    while (light->busy)
+        pthread_cond_wait(&light->work_done, &light->lock);
+
+    pthread_mutex_unlock(&light->lock);
 }
 
 void
-swap_particles(grid_t *grid, int x1, int y1, int x2, int y2)
+copy_light_map(light_map_t *dest, light_map_t *src)
 {
-    int index1 = y1 * grid->width + x1;
-    int index2 = y2 * grid->width + x2;
+    wait_light(dest);
+    wait_light(src);
 
-    particle_t temp = grid->arr[index1];
-    grid->arr[index1] = grid->arr[index2];
-    grid->arr[index2] = temp;
+    /* Grab the block first in case it's already the one dest has */
+    src->block->refs++;
+    set_light_block(dest, src->block);
+    dest->dark = src->dark;
+}
+
+void
+add_light(grid_t *grid, int x, int y)
+{
+    light_map_t *light = grid->light;
+    unsigned char *count = &light->next_emit[(size_t)(y >> FIELD_SHIFT)
+                                             * light->width
+                                             + (x >> FIELD_SHIFT)];
 
-    grid->arr[index1].has_been_updated = true;
-    grid->arr[index2].has_been_updated = true;
+    /* A cell only has 1 << 2 * FIELD_SHIFT particles, so this never wraps */
+    (*count)++;
 }
 
 void
-particle_line(grid_t *grid, int x1, int y1, int x2, int y2, material_type m)
+step_light(grid_t *grid)
 {
-    if (x1 > grid->width)
-        x1 = grid->width;
-    if (x2 > grid->width)
-        x2 = grid->width;
-    if (y1 > grid->height)
-        y1 = grid->height;
-    if (y2 > grid->height)
-        y2 = grid->height;
+    light_map_t *light = grid->light;
+    size_t i, count = (size_t)light->width * (size_t)light->height;
+    int x, y, emit;
+    bool opaque, burning = false;
 
-    int dx = abs(x2 - x1);
-    int sx = x1 < x2 ? 1 : -1;
-    int dy = -abs(y2 - y1);
-    int sy = y1 < y2 ? 1 : -1;
-    int error = dx + dy;
-    int e2;
+    wait_light(light);
 
-    /** 
-     * The if-else checks containing the while loops used to be within the
-     * loops. They were moved out here as a little bit of optimization because
-     * the check only needs to be done once to decide if a particle is getting
-     * added or removed. Having it within the loop made it check ever iteration,
-     * which was largely unnecessary. This does make the code uglier, but who
-     * cares
+    memcpy(light->shown, light->levels, count * sizeof(*light->shown));
+
+    for (i = 0; i < count && !burning; i++)
+        burning = light->next_emit[i] > 0;
+
+    /**
+     * What blocks light doesn't matter while there's none, and whatever's
+     * changed by the time there is gets picked up then
+     */
+    if (!burning && light->dark)
+        return;
+
+    light->change_count = 0;
+
+    for (y = 0; y < light->height; y++) {
+        for (x = 0; x < light->width; x++) {
+            i = (size_t)y * light->width + x;
+
+            emit = light->next_emit[i] == 0 ? 0
+                   : LIGHT_EMIT + light->next_emit[i];
+            if (emit > LIGHT_MAX)
+                emit = LIGHT_MAX;
+
+            opaque = count_field_cell(grid, ELEM_STATIC, x, y)
+                     + count_field_cell(grid, ELEM_SOLID, x, y)
+                     >= LIGHT_OPAQUE;
+
+            if (emit == light->emit[i] && opaque == light->opaque[i])
+                continue;
+
+            /**
+             * A cell only puts out what was lit through it if it lets out
+             * less light than it did. An opaque cell only lets out its own
+             */
+            light->changes[light->change_count] = (int)i;
+            light->change_levels[light->change_count] =
+                emit < light->emit[i] || (opaque && !light->opaque[i])
+                ? (light->opaque[i] ? light->emit[i] : light->levels[i])
+                : -1;
+            light->change_count++;
+
+            light->emit[i] = (unsigned char)emit;
+            light->opaque[i] = opaque;
+        }
+    }
+
+    memset(light->next_emit, 0, count * sizeof(*light->next_emit));
+    light->dark = !burning;
+
+    if (light->change_count == 0)
+        return;
+
+    if (light->threaded) {
+        pthread_mutex_lock(&light->lock);
+        light->busy = true;
+        pthread_cond_signal(&light->work_ready);
+        pthread_mutex_unlock(&light->lock);
+    }
+    else {
+        relight(light);
+    }
+}
+
+void
+relight(light_map_t *light)
+{
+    unsigned char *levels = light->levels, *emit = light->emit;
+    const bool *opaque = light->opaque;
+    size_t count = (size_t)light->width * (size_t)light->height;
+    size_t remove_head = 0, remove_tail = 0, k;
+    int i, n, d, cell, level, out;
+    int near[4];
+
+    /**
+     * Both queues are rings as long as the map. A cell is only put out once
+     * (it's left with its own light, which can't be put out again), and a
+     * cell is never in add_queue twice at once (see queue_light)
      */
-    if (m == MAT_EMPTY) {
-        while (1) {
-            remove_particle(grid, x1, y1);
-            if (x1 == x2 && y1 == y2)
-                break;
+    light->add_head = 0;
+    light->add_tail = 0;
 
-            e2 = 2 * error;
+    for (k = 0; k < light->change_count; k++) {
+        cell = light->changes[k];
 
-            if (e2 >= dy) {
-                if (x1 == x2)
-                    break;
+        /* A cell to put out and how much light it let out are packed */
+        if (light->change_levels[k] >= 0) {
+            light->remove_queue[remove_tail++ % count] =
+                cell << 4 | light->change_levels[k];
+            levels[cell] = emit[cell];
+        }
+        else if (levels[cell] < emit[cell]) {
+            levels[cell] = emit[cell];
+        }
 
-                error += dy;
-                x1 += sx;
-            }
+        /* It might let light through from around it now too */
+        queue_light(light, cell);
+        get_light_neighbors(light, cell, near);
 
-            if (e2 <= dx) {
-                if (y1 == y2)
-                    break;
+        for (d = 0; d < 4; d++) {
+            if (near[d] >= 0 && levels[near[d]] > 0)
+                queue_light(light, near[d]);
+        }
+    }
 
-                error += dx;
-                y1 += sy;
+    while (remove_head < remove_tail) {
+        i = light->remove_queue[remove_head++ % count];
+        cell = i >> 4;
+        out = i & 0xf;
+
+        get_light_neighbors(light, cell, near);
+
+        for (d = 0; d < 4; d++) {
+            n = near[d];
+            if (n < 0)
+                continue;
+
+            level = levels[n];
+
+            /**
+             * Anything dimmer than what this cell let out could have been
+             * lit through it, so it's put out too. Anything at least as
+             * bright has its own way of being lit, so it lights the hole
+             * back up afterwards
+             */
+            if (level > emit[n] && level < out) {
+                light->remove_queue[remove_tail++ % count] =
+                    n << 4 | (opaque[n] ? emit[n] : level);
+                levels[n] = emit[n];
+
+                if (emit[n] > 0)
+                    queue_light(light, n);
+            }
+            else if (level > 0) {
+                queue_light(light, n);
             }
         }
     }
-    else {
-        while (1) {
-            add_particle(grid, x1, y1, m);
-            if (x1 == x2 && y1 == y2)
-                break;
 
-            e2 = 2 * error;
+    while (light->add_head < light->add_tail) {
+        cell = light->add_queue[light->add_head++ % count];
+        light->queued[cell] = false;
 
-            if (e2 >= dy) {
-                if (x1 == x2)
-                    break;
+        out = opaque[cell] ? emit[cell] : levels[cell];
+        if (out <= 1)
+            continue;
 
-                error += dy;
-                x1 += sx;
-            }
+        get_light_neighbors(light, cell, near);
 
-            if (e2 <= dx) {
-                if (y1 == y2)
-                    break;
+        for (d = 0; d < 4; d++) {
+            n = near[d];
 
-                error += dx;
-                y1 += sy;
+            if (n >= 0 && levels[n] < out - 1) {
+                levels[n] = (unsigned char)(out - 1);
+                queue_light(light, n);
             }
         }
     }
 }
 
-bool
-is_particle_empty(const particle_t *particle)
+void
+queue_light(light_map_t *light, int cell)
 {
-    return particle->mat_type == MAT_EMPTY;
-}
+    if (light->queued[cell])
+        return;
 
-bool 
-is_particle_static(const particle_t *particle)
-{
-    return particle->elem_type == ELEM_STATIC;
+    light->queued[cell] = true;
+    light->add_queue[light->add_tail++
+                     % ((size_t)light->width * (size_t)light->height)] = cell;
 }
 
-bool 
-is_particle_solid(const particle_t *particle)
+void
+get_light_neighbors(const light_map_t *light, int cell, int near[4])
 {
-    return particle->elem_type == ELEM_SOLID;
-}
+    int x = cell % light->width, y = cell / light->width;
 
-bool 
-is_particle_liquid(const particle_t *particle)
-{
-    return particle->elem_type == ELEM_LIQUID;
+    near[0] = x > 0 ? cell - 1 : -1;
+    near[1] = x < light->width - 1 ? cell + 1 : -1;
+    near[2] = y > 0 ? cell - light->width : -1;
+    near[3] = y < light->height - 1 ? cell + light->width : -1;
 }
 
-bool 
-is_particle_gas(const particle_t *particle)
+int
+get_light(const light_map_t *light, int x, int y)
 {
-    return particle->elem_type == ELEM_GAS;
+    return light->shown[(size_t)(y >> FIELD_SHIFT) * light->width
+                        + (x >> FIELD_SHIFT)];
 }
 
-bool
-is_pos_empty(const grid_t *grid, int x, int y)
+material_type 
+next_material(material_type m)
 {
-    if (x < 0 || x >= grid->width || y < 0 || y >= grid->height)
-        return false;
+    if (m == MAT_COUNT - 1)
+        m = 0;
 
-    return is_particle_empty(get_particle(grid, x, y));
+    return m + 1;
 }
 
-bool 
-is_pos_static(const grid_t *grid, int x, int y)
+material_type 
+prev_material(material_type m)
 {
-    if (x < 0 || x >= grid->width || y < 0 || y >= grid->height)
-        return false;
+    if (m == 1)
+        m = MAT_COUNT;
 
-    return is_particle_static(get_particle(grid, x, y));
+    return m - 1;
 }
 
-bool 
-is_pos_solid(const grid_t *grid, int x, int y)
+Color
+get_color_from_mat(material_type m)
 {
-    if (x < 0 || x >= grid->width || y < 0 || y >= grid->height)
-        return false;
-
-    return is_particle_solid(get_particle(grid, x, y));
+    switch (m) {
+        case MAT_SAND:  return YELLOW;
+        case MAT_WATER: return SKYBLUE;
+        case MAT_SMOKE: return GRAY;
+        case MAT_OIL:   return BLACK;
+        case MAT_WALL:  return LIGHTGRAY;
+        case MAT_WOOD:  return (Color){66, 27, 4, 255};
+        case MAT_FIRE:  return RED;
+        case MAT_FLAME: return ORANGE;
+        case MAT_POWDER: return (Color){56, 56, 64, 255};
+        case MAT_WIRE: return (Color){184, 115, 51, 255};
+        case MAT_BATTERY: return (Color){32, 160, 64, 255};
+        default:        return BLANK;
+    }
 }
 
-bool 
-is_pos_liquid(const grid_t *grid, int x, int y)
+bool
+parse_size(const char *str, int *w, int *h)
 {
-    if (x < 0 || x >= grid->width || y < 0 || y >= grid->height)
-        return false;
+    char *end = NULL;
+    long new_w, new_h;
 
-    return is_particle_liquid(get_particle(grid, x, y));
-}
+    errno = 0;
+    new_w = strtol(str, &end, 10);
 
-bool 
-is_pos_gas(const grid_t *grid, int x, int y)
-{
-    if (x < 0 || x >= grid->width || y < 0 || y >= grid->height)
+    if (end == str || *end != 'x' || errno == ERANGE)
         return false;
 
-    return is_particle_gas(get_particle(grid, x, y));
-}
+    str = end + 1;
+    new_h = strtol(str, &end, 10);
 
-void update_empty(grid_t *grid, int x, int y)
-{
-    particle_t *curr_particle = get_particle(grid, x, y);
+    if (end == str || *end != '\0' || errno == ERANGE)
+        return false;
 
-    if (curr_particle == NULL)
-        return;
+    if (new_w < 1 || new_w > MAX_SIZE || new_h < 1 || new_h > MAX_SIZE)
+        return false;
+
+    *w = (int)new_w;
+    *h = (int)new_h;
 
-    curr_particle->has_been_updated = true;
+    return true;
 }
 
-void
-update_sand(grid_t *grid, int x, int y)
+bool
+parse_int(const char *str, int *value)
 {
-    int below = y - 1;
-    int left  = x - 1, right = x + 1;
-    particle_t *curr_particle = get_particle(grid, x, y);
-
-    if (curr_particle == NULL)
-        return;
-
-    if (y == 0) {
-        curr_particle->has_been_updated = true;
-        return;
-    }
-    
-    if (is_pos_empty(grid, x, below)
-        || is_pos_liquid(grid, x, below)
-        || is_pos_gas(grid, x, below)) {
-        swap_particles(grid, x, y, x, below);
-    }
-    else if ((is_pos_empty(grid, left, below)
-             || is_pos_liquid(grid, left, below)
-             || is_pos_gas(grid, left, below))
-             && !is_pos_static(grid, x, below)) {
-        swap_particles(grid, x, y, left, below);
-    }
-    else if ((is_pos_empty(grid, right, below)
-             || is_pos_liquid(grid, right, below)
-             || is_pos_gas(grid, right, below))
-             && !is_pos_static(grid, x, below)) {
-        swap_particles(grid, x, y, right, below);
-    }
+    char *end = NULL;
+    long number;
 
-    curr_particle->has_been_updated = true;
-}
+    errno = 0;
+    number = strtol(str, &end, 10);
 
-void 
-update_water(grid_t *grid, int x, int y)
-{
-    int below = y - 1;
-    int left  = x - 1, right = x + 1;
-    particle_t *curr_particle = get_particle(grid, x, y);
+    if (end == str || *end != '\0' || errno == ERANGE)
+        return false;
 
-    if (curr_particle == NULL)
-        return;
+    if (number < INT_MIN || number > INT_MAX)
+        return false;
 
-    if (is_pos_empty(grid, x, below)
-        || is_pos_gas(grid, x, below)
-        || get_particle_type_pos(grid, x, below) == MAT_OIL) {
-        swap_particles(grid, x, y, x, below);
-    }
-    else if ((is_pos_empty(grid, left, below)
-             || is_pos_gas(grid, left, below)
-             || get_particle_type_pos(grid, left, below) == MAT_OIL)
-             && !is_pos_static(grid, x, below)) {
-        swap_particles(grid, x, y, left, below);
-    }
-    else if ((is_pos_empty(grid, right, below)
-             || is_pos_gas(grid, right, below)
-             || get_particle_type_pos(grid, right, below) == MAT_OIL)
-             && !is_pos_static(grid, x, below)) {
-        swap_particles(grid, x, y, right, below);
-    }
-    else if (is_pos_empty(grid, left, y)
-             || is_pos_gas(grid, left, y)
-             || get_particle_type_pos(grid, left, y) == MAT_OIL) {
-        swap_particles(grid, x, y, left, y);
-    }
-    else if (is_pos_empty(grid, right, y)
-             || is_pos_gas(grid, right, y)
-             || get_particle_type_pos(grid, right, y) == MAT_OIL) {
-        swap_particles(grid, x, y, right, y);
-    }
+    *value = (int)number;
 
-    curr_particle->has_been_updated = true;
+    return true;
 }
 
-void
-update_smoke(grid_t *grid, int x, int y)
+bool
+parse_seed(const char *str, uint32_t *seed)
 {
-    int above = y + 1;
-    int left = x - 1, right = x + 1;
-    particle_t *curr_particle = get_particle(grid, x, y);
+    char *end = NULL;
+    unsigned long long number;
 
-    if (curr_particle == NULL)
-        return;
-
-    if (y == grid->height) {
-        curr_particle->has_been_updated = true;
-        return;
-    }
+    /* strtoull would happily wrap a negative number around */
+    if (*str < '0' || *str > '9')
+        return false;
 
-    curr_particle->life_time -= (float)rand() / (float)(RAND_MAX / 0.1f);
+    errno = 0;
+    number = strtoull(str, &end, 10);
 
-    if (curr_particle->life_time <= 0.0f) {
-        remove_particle(grid, x, y);
-        curr_particle->has_been_updated = true;
-        return;
-    }
+    if (*end != '\0' || errno == ERANGE || number > UINT32_MAX)
+        return false;
 
-    if (is_pos_empty(grid, x, above)) {
-        swap_particles(grid, x, y, x, above);
-    }
-    else if (is_pos_empty(grid, left, above)
-             && !is_pos_static(grid, x, above)) {
-        swap_particles(grid, x, y, left, above);
-    }
-    else if (is_pos_empty(grid, right, above)
-             && !is_pos_static(grid, x, above)) {
-        swap_particles(grid, x, y, right, above);
-    }
-    else if (is_pos_empty(grid, left, y)) {
-        swap_particles(grid, x, y, left, y);
-    }
-    else if (is_pos_empty(grid, right, y)) {
-        swap_particles(grid, x, y, right, y);
-    }
+    *seed = (uint32_t)number;
 
-    curr_particle->has_been_updated = true;
+    return true;
 }
 
 void
-update_oil(grid_t *grid, int x, int y)
+fill_frame(const grid_t *grid, Color *frame, int view_x, int view_y,
+           int view_w, int view_h)
 {
-    int r = 0;
-    int above = y + 1, below = y - 1;
-    int left = x - 1, right = x + 1;
-    particle_t *curr_particle = get_particle(grid, x, y);
-    particle_t *temp_particle = NULL;
-    Vector2 temp_vel = curr_particle->velocity;
-
-    if (curr_particle == NULL)
-        return;
-
-    /**
-     * There are 8 checks of the particles around the oil to see if they are
-     * flames/fire. There might be some clean way to do this, but I don't know
-     * it, so for now, ugliness.
-     *
-     * Anyway, this code basically just gives the oil a chance to ignite if it's
-     * near a flame or something burning. If the oil ignites, it adds a "fire"
-     * particle and gives it the oil's propereties (liquid element and velocity)
-     */
-    temp_particle = get_particle(grid, left, below);
-    if (temp_particle != NULL && (get_particle_type(temp_particle) == MAT_FLAME
-        || get_particle_type(temp_particle) == MAT_FIRE)) {
-        /* 75% chance to ignite */
-        r = rand() % 4;
-        if (r != 0) {
-            remove_particle(grid, x, y);
-            add_particle(grid, x,  y, MAT_FIRE);
-            curr_particle->elem_type = ELEM_LIQUID;
-            curr_particle->velocity = temp_vel;
+    int x, y, shade;
+    size_t i;
+    float mass, density;
+    Color *row = NULL;
+
+    for (y = 0; y < view_h; y++) {
+        row = &frame[(size_t)(view_h - 1 - y) * (size_t)view_w];
+
+        for (x = 0; x < view_w; x++)
+            row[x] = get_particle_color(get_particle(grid, view_x + x,
+                                                     view_y + y));
+
+        /* Powered wire glows */
+        for (x = 0; x < view_w && grid->circuits.chunks != NULL; x++) {
+            if (get_particle_type_pos(grid, view_x + x, view_y + y)
+                == MAT_WIRE && is_powered(grid, view_x + x, view_y + y))
+                row[x] = GOLD;
         }
-    }
-
-    temp_particle = get_particle(grid, x, below);
-    if (temp_particle != NULL && (get_particle_type(temp_particle) == MAT_FLAME
-        || get_particle_type(temp_particle) == MAT_FIRE)) {
-        /* 75% chance to ignite */
-        r = rand() % 4;
-        if (r != 0) {
-            remove_particle(grid, x, y);
-            add_particle(grid, x,  y, MAT_FIRE);
-            curr_particle->elem_type = ELEM_LIQUID;
-            curr_particle->velocity = temp_vel;
-        }
-    }
-
-    temp_particle = get_particle(grid, right, below);
-    if (temp_particle != NULL && (get_particle_type(temp_particle) == MAT_FLAME
-        || get_particle_type(temp_particle) == MAT_FIRE)) {
-        /* 75% chance to ignite */
-        r = rand() % 4;
-        if (r != 0) {
-            remove_particle(grid, x, y);
-            add_particle(grid, x,  y, MAT_FIRE);
-            curr_particle->elem_type = ELEM_LIQUID;
-            curr_particle->velocity = temp_vel;
-        }
-    }
-
-    temp_particle = get_particle(grid, left, y);
-    if (temp_particle != NULL && (get_particle_type(temp_particle) == MAT_FLAME
-        || get_particle_type(temp_particle) == MAT_FIRE)) {
-        /* 75% chance to ignite */
-        r = rand() % 4;
-        if (r != 0) {
-            remove_particle(grid, x, y);
-            add_particle(grid, x,  y, MAT_FIRE);
-            curr_particle->elem_type = ELEM_LIQUID;
-            curr_particle->velocity = temp_vel;
-        }
-    }
 
-    temp_particle = get_particle(grid, right, y);
-    if (temp_particle != NULL && (get_particle_type(temp_particle) == MAT_FLAME
-        || get_particle_type(temp_particle) == MAT_FIRE)) {
-        /* 75% chance to ignite */
-        r = rand() % 4;
-        if (r != 0) {
-            remove_particle(grid, x, y);
-            add_particle(grid, x,  y, MAT_FIRE);
-            curr_particle->elem_type = ELEM_LIQUID;
-            curr_particle->velocity = temp_vel;
+        /* Light shows up on the particles it falls on */
+        for (x = 0; x < view_w && grid->light != NULL; x++) {
+            if (row[x].a == 0)
+                continue;
+
+            shade = LIGHT_AMBIENT + (255 - LIGHT_AMBIENT)
+                    * get_light(grid->light, view_x + x, view_y + y)
+                    / LIGHT_MAX;
+            row[x].r = (unsigned char)(row[x].r * shade / 255);
+            row[x].g = (unsigned char)(row[x].g * shade / 255);
+            row[x].b = (unsigned char)(row[x].b * shade / 255);
         }
-    }
-
-    temp_particle = get_particle(grid, left, above);
-    if (temp_particle != NULL && (get_particle_type(temp_particle) == MAT_FLAME
-        || get_particle_type(temp_particle) == MAT_FIRE)) {
-        /* 75% chance to ignite */
-        r = rand() % 4;
-        if (r != 0) {
-            remove_particle(grid, x, y);
-            add_particle(grid, x,  y, MAT_FIRE);
-            curr_particle->elem_type = ELEM_LIQUID;
-            curr_particle->velocity = temp_vel;
+
+        /* The smoke field shows up in the empty cells it's over */
+        for (x = 0; x < view_w && grid->smoke.live; x++) {
+            density = get_field(&grid->smoke, view_x + x, view_y + y);
+
+            if (density > 0.0f && row[x].a == 0) {
+                row[x] = get_color_from_mat(MAT_SMOKE);
+                row[x].a = density >= SMOKE_FULL ? 255
+                           : (unsigned char)(density * 255.0f / SMOKE_FULL);
+            }
         }
-    }
 
-    temp_particle = get_particle(grid, x, above);
-    if (temp_particle != NULL && (get_particle_type(temp_particle) == MAT_FLAME
-        || get_particle_type(temp_particle) == MAT_FIRE)) {
-        /* 75% chance to ignite */
-        r = rand() % 4;
-        if (r != 0) {
-            remove_particle(grid, x, y);
-            add_particle(grid, x,  y, MAT_FIRE);
-            curr_particle->elem_type = ELEM_LIQUID;
-            curr_particle->velocity = temp_vel;
+        if (!grid->pressure)
+            continue;
+
+        /* In pressure mode, water that isn't full is fainter */
+        for (x = 0; x < view_w; x++) {
+            mass = get_mass(grid, view_x + x, view_y + y);
+
+            if (mass > 0.0f && mass < 1.0f
+                && get_particle_type_pos(grid, view_x + x, view_y + y)
+                   == MAT_WATER)
+                row[x].a = (unsigned char)(row[x].a * mass);
         }
     }
 
-    temp_particle = get_particle(grid, right, above);
-    if (temp_particle != NULL && (get_particle_type(temp_particle) == MAT_FLAME
-        || get_particle_type(temp_particle) == MAT_FIRE)) {
-        /* 75% chance to ignite */
-        r = rand() % 4;
-        if (r != 0) {
-            remove_particle(grid, x, y);
-            add_particle(grid, x,  y, MAT_FIRE);
-            curr_particle->elem_type = ELEM_LIQUID;
-            curr_particle->velocity = temp_vel;
+    for (i = 0; i < grid->ejecta.count; i++) {
+        x = grid->ejecta.cell_x[i] - view_x;
+        y = grid->ejecta.cell_y[i] - view_y;
+
+        if (x >= 0 && x < view_w && y >= 0 && y < view_h) {
+            frame[(size_t)(view_h - 1 - y) * (size_t)view_w + (size_t)x] =
+                get_particle_color(&grid->ejecta.particles[i]);
         }
     }
+}
 
-    /* Moves the oil like a regular liquid */
-    if (is_pos_empty(grid, x, below)) {
-        swap_particles(grid, x, y, x, below);
+Color
+get_particle_color(const particle_t *p)
+{
+    Color color;
+
+    switch (p->mat_type) {
+        case MAT_EMPTY:
+            return BLANK;
+
+        case MAT_WATER:
+            color = SKYBLUE;
+            color.a = 128;
+            return color;
+
+        case MAT_FIRE:
+            switch (rand() % 4) {
+                case 0:  return (Color){255, 0, 0, 255};
+                case 1:  return (Color){192, 0, 0, 255};
+                case 2:  return (Color){160, 0, 0, 255};
+                default: return (Color){64, 0, 0, 255};
+            }
+
+        default:
+            return get_color_from_mat(p->mat_type);
     }
-    else if ((is_pos_empty(grid, left, below)
-             || is_pos_gas(grid, left, below))
-             && !is_pos_static(grid, x, below)) {
-        swap_particles(grid, x, y, left, below);
+}
+
+const char *
+get_name_from_mat(material_type m)
+{
+    switch (m) {
+        case MAT_EMPTY: return "empty";
+        case MAT_SAND:  return "sand";
+        case MAT_WATER: return "water";
+        case MAT_SMOKE: return "smoke";
+        case MAT_OIL:   return "oil";
+        case MAT_WALL:  return "wall";
+        case MAT_WOOD:  return "wood";
+        case MAT_FIRE:  return "fire";
+        case MAT_FLAME: return "flame";
+        case MAT_POWDER: return "gunpowder";
+        case MAT_WIRE: return "wire";
+        case MAT_BATTERY: return "battery";
+        default:        return "unknown";
     }
-    else if ((is_pos_empty(grid, right, below)
-             || is_pos_gas(grid, right, below))
-             && !is_pos_static(grid, x, below)) {
-        swap_particles(grid, x, y, right, below);
+}
+
+worker_pool_t *
+new_worker_pool(int thread_count)
+{
+    int i;
+    worker_pool_t *pool = malloc(sizeof(*pool));
+
+    if (pool == NULL) {
+        fprintf(stderr, "Error: Could not allocate enough memory at %d in %s\n",
+                __LINE__, __FILE__);
+        exit(EXIT_FAILURE);
     }
-    else if (is_pos_empty(grid, left, y)) {
-        swap_particles(grid, x, y, left, y);
+
+    pool->thread_count = thread_count;
+    pool->threads = malloc(thread_count * sizeof(*pool->threads));
+    pool->task_func = NULL;
+    pool->task_ctx = NULL;
+    pool->task_count = 0;
+    pool->next_task = 0;
+    pool->tasks_left = 0;
+    pool->quitting = false;
+
+    if (pool->threads == NULL) {
+        fprintf(stderr, "Error: Could not allocate enough memory at %d in %s\n",
+                __LINE__, __FILE__);
+        exit(EXIT_FAILURE);
     }
-    else if (is_pos_empty(grid, right, y)) {
-        swap_particles(grid, x, y, right, y);
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work_ready, NULL);
+    pthread_cond_init(&pool->work_done, NULL);
+
+    for (i = 0; i < thread_count; i++) {
+        if (pthread_create(&pool->threads[i], NULL, worker_main, pool) != 0) {
+            fprintf(stderr, "Error: Could not start a worker thread at %d in "
+                    "%s\n", __LINE__, __FILE__);
+            exit(EXIT_FAILURE);
+        }
     }
 
-    curr_particle->has_been_updated = true;
+    return pool;
 }
 
 void
-update_wall(grid_t *grid, int x, int y)
+destroy_worker_pool(worker_pool_t *pool)
 {
-    particle_t *curr_particle = get_particle(grid, x, y);
+    int i;
 
-    if (curr_particle == NULL)
-        return;
+    wait_tasks(pool);
 
-    get_particle(grid, x, y)->has_been_updated = true;
+    pthread_mutex_lock(&pool->lock);
+    pool->quitting = true;
+    pthread_cond_broadcast(&pool->work_ready);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (i = 0; i < pool->thread_count; i++)
+        pthread_join(pool->threads[i], NULL);
+
+    pthread_cond_destroy(&pool->work_done);
+    pthread_cond_destroy(&pool->work_ready);
+    pthread_mutex_destroy(&pool->lock);
+
+    free(pool->threads);
+    free(pool);
 }
 
 void
-update_wood(grid_t *grid, int x, int y)
+start_tasks(worker_pool_t *pool, int task_count, task_funcptr func, void *ctx)
 {
-    int r;
-    int above = y + 1, below = y - 1;
-    int  left = x - 1, right = x + 1;
-    particle_t *curr_particle = get_particle(grid, x, y);
-    particle_t *temp_particle = NULL;
-    Vector2 temp_vel = curr_particle->velocity;
+    pthread_mutex_lock(&pool->lock);
+    pool->task_func = func;
+    pool->task_ctx = ctx;
+    pool->task_count = task_count;
+    pool->next_task = 0;
+    pool->tasks_left = task_count;
+    pthread_cond_broadcast(&pool->work_ready);
+    pthread_mutex_unlock(&pool->lock);
+}
 
-    if (curr_particle == NULL)
-        return;
+void
+wait_tasks(worker_pool_t *pool)
+{
+    pthread_mutex_lock(&pool->lock);
 
-    temp_particle = get_particle(grid, left, below);
-    if (temp_particle != NULL && (get_particle_type(temp_particle) == MAT_FLAME
-        || get_particle_type(temp_particle) == MAT_FIRE)) {
-        /* 50% chance to ignite */
-        r = rand() % 2;
-        if (r == 0) {
-            remove_particle(grid, x, y);
-            add_particle(grid, x,  y, MAT_FIRE);
-            curr_particle->elem_type = ELEM_STATIC;
-            curr_particle->velocity = temp_vel;
-        }
-    }
+    while (pool->tasks_left > 0)
+        pthread_cond_wait(&pool->work_done, &pool->lock);
 
-    temp_particle = get_particle(grid, x, below);
-    if (temp_particle != NULL && (get_particle_type(temp_particle) == MAT_FLAME
-        || get_particle_type(temp_particle) == MAT_FIRE)) {
-        /* 50% chance to ignite */
-        r = rand() % 2;
-        if (r == 0) {
-            remove_particle(grid, x, y);
-            add_particle(grid, x,  y, MAT_FIRE);
-            curr_particle->elem_type = ELEM_STATIC;
-            curr_particle->velocity = temp_vel;
-        }
-    }
+    pthread_mutex_unlock(&pool->lock);
+}
 
-    temp_particle = get_particle(grid, right, below);
-    if (temp_particle != NULL && (get_particle_type(temp_particle) == MAT_FLAME
-        || get_particle_type(temp_particle) == MAT_FIRE)) {
-        /* 50% chance to ignite */
-        r = rand() % 2;
-        if (r == 0) {
-            remove_particle(grid, x, y);
-            add_particle(grid, x,  y, MAT_FIRE);
-            curr_particle->elem_type = ELEM_STATIC;
-            curr_particle->velocity = temp_vel;
-        }
-    }
+void
+run_tasks(worker_pool_t *pool, int task_count, task_funcptr func, void *ctx)
+{
+    start_tasks(pool, task_count, func, ctx);
+    wait_tasks(pool);
+}
 
-    temp_particle = get_particle(grid, left, y);
-    if (temp_particle != NULL && (get_particle_type(temp_particle) == MAT_FLAME
-        || get_particle_type(temp_particle) == MAT_FIRE)) {
-        /* 50% chance to ignite */
-        r = rand() % 2;
-        if (r == 0) {
-            remove_particle(grid, x, y);
-            add_particle(grid, x,  y, MAT_FIRE);
-            curr_particle->elem_type = ELEM_STATIC;
-            curr_particle->velocity = temp_vel;
-        }
-    }
+void *
+worker_main(void *arg)
+{
+    int task;
+    task_funcptr func = NULL;
+    void *ctx = NULL;
+    worker_pool_t *pool = arg;
 
-    temp_particle = get_particle(grid, right, y);
-    if (temp_particle != NULL && (get_particle_type(temp_particle) == MAT_FLAME
-        || get_particle_type(temp_particle) == MAT_FIRE)) {
-        /* 50% chance to ignite */
-        r = rand() % 2;
-        if (r == 0) {
-            remove_particle(grid, x, y);
-            add_particle(grid, x,  y, MAT_FIRE);
-            curr_particle->elem_type = ELEM_STATIC;
-            curr_particle->velocity = temp_vel;
-        }
-    }
+    pthread_mutex_lock(&pool->lock);
 
-    temp_particle = get_particle(grid, left, above);
-    if (temp_particle != NULL && (get_particle_type(temp_particle) == MAT_FLAME
-        || get_particle_type(temp_particle) == MAT_FIRE)) {
-        /* 50% chance to ignite */
-        r = rand() % 2;
-        if (r == 0) {
-            remove_particle(grid, x, y);
-            add_particle(grid, x,  y, MAT_FIRE);
-            curr_particle->elem_type = ELEM_STATIC;
-            curr_particle->velocity = temp_vel;
-        }
-    }
+    while (1) {
+        while (!pool->quitting && pool->next_task >= pool->task_count)
+            pthread_cond_wait(&pool->work_ready, &pool->lock);
 
-    temp_particle = get_particle(grid, x, above);
-    if (temp_particle != NULL && (get_particle_type(temp_particle) == MAT_FLAME
-        || get_particle_type(temp_particle) == MAT_FIRE)) {
-        /* 50% chance to ignite */
-        r = rand() % 2;
-        if (r == 0) {
-            remove_particle(grid, x, y);
-            add_particle(grid, x,  y, MAT_FIRE);
-            curr_particle->elem_type = ELEM_STATIC;
-            curr_particle->velocity = temp_vel;
-        }
-    }
+        if (pool->quitting)
+            break;
 
-    temp_particle = get_particle(grid, right, above);
-    if (temp_particle != NULL && (get_particle_type(temp_particle) == MAT_FLAME
-        || get_particle_type(temp_particle) == MAT_FIRE)) {
-        /* 50% chance to ignite */
-        r = rand() % 2;
-        if (r == 0) {
-            remove_particle(grid, x, y);
-            add_particle(grid, x,  y, MAT_FIRE);
-            curr_particle->elem_type = ELEM_STATIC;
-            curr_particle->velocity = temp_vel;
-        }
+        task = pool->next_task++;
+        func = pool->task_func;
+        ctx = pool->task_ctx;
+
+        pthread_mutex_unlock(&pool->lock);
+        func(ctx, task);
+        pthread_mutex_lock(&pool->lock);
+
+        pool->tasks_left--;
+        if (pool->tasks_left == 0)
+            pthread_cond_broadcast(&pool->work_done);
     }
 
-    curr_particle->has_been_updated = true;
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
 }
 
 void
-update_fire(grid_t *grid, int x, int y)
+build_scenario(grid_t *grid, scenario_type scenario)
 {
-    int r = rand() % 4;
-    particle_t *curr_particle = get_particle(grid, x, y);
+    int i, x, y, x0, y0, w, h, ground;
+
+    switch (scenario) {
+        case SCENARIO_FIRE:
+            /* Clumps of wood with a few oil puddles and some fires lit */
+            for (i = 0; (size_t)i < get_cell_count(grid) / 512; i++) {
+                x0 = grid_rand(grid) % grid->width;
+                y0 = grid_rand(grid) % grid->height;
+                w = 2 + grid_rand(grid) % 12;
+                h = 2 + grid_rand(grid) % 12;
+
+                for (y = y0; y < y0 + h; y++) {
+                    for (x = x0; x < x0 + w; x++)
+                        add_particle(grid, x, y, i % 8 == 0 ? MAT_OIL
+                                                           : MAT_WOOD);
+                }
+            }
 
-    if (curr_particle == NULL)
-        return;
+            /* Light a few of the wood particles (give up after enough misses) */
+            for (i = 0, w = 0; i < 1000 && w < 4; i++) {
+                x = grid_rand(grid) % grid->width;
+                y = grid_rand(grid) % grid->height;
+
+                if (get_particle_type_pos(grid, x, y) != MAT_WOOD)
+                    continue;
 
-    switch (r) {
-        case 0:
-            curr_particle->color = (Color){255, 0, 0, 255};
+                remove_particle(grid, x, y);
+                add_particle(grid, x, y, MAT_FIRE);
+                w++;
+            }
             break;
 
-        case 1:
-            curr_particle->color = (Color){192, 0, 0, 255};
+        case SCENARIO_FLOOD:
+            /* Bumpy wall terrain with a block of water dropped on it */
+            ground = grid->height / 8;
+
+            for (x = 0; x < grid->width; x++) {
+                ground += grid_rand(grid) % 3 - 1;
+                if (ground < 1)
+                    ground = 1;
+                if (ground > grid->height / 3)
+                    ground = grid->height / 3;
+
+                for (y = 0; y < ground; y++)
+                    add_particle(grid, x, y, MAT_WALL);
+            }
+
+            x0 = grid_rand(grid) % (grid->width / 2);
+            for (y = grid->height * 2 / 3; y < grid->height; y++) {
+                for (x = x0; x < x0 + grid->width / 2; x++)
+                    add_particle(grid, x, y, MAT_WATER);
+            }
             break;
 
-        case 2:
-            curr_particle->color = (Color){160, 0, 0, 255};
+        case SCENARIO_AVALANCHE:
+            /* A few wall ledges with the top half of the world full of sand */
+            for (i = 0; i < 6; i++) {
+                x0 = grid_rand(grid) % grid->width;
+                y0 = grid->height / 8 + grid_rand(grid) % (grid->height / 3);
+                w = grid->width / 8 + grid_rand(grid) % (grid->width / 4);
+
+                for (x = x0; x < x0 + w; x++)
+                    add_particle(grid, x, y0, MAT_WALL);
+            }
+
+            for (y = grid->height / 2; y < grid->height; y++) {
+                for (x = 0; x < grid->width; x++)
+                    add_particle(grid, x, y, MAT_SAND);
+            }
             break;
 
-        case 3:
-            curr_particle->color = (Color){64, 0, 0, 255};
+        default:
             break;
     }
+}
+
+void
+run_world_task(void *ctx, int task)
+{
+    int t;
+    batch_t *batch = ctx;
+    world_stats_t *stats = &batch->stats[task];
+    world_stats_t replay;
+    grid_t *grid = new_grid(batch->width, batch->height);
+    grid_t *snapshot = NULL;
+
+    stats->seed = batch->seed + (uint32_t)task;
+    seed_grid(grid, stats->seed);
+    build_scenario(grid, batch->scenario);
+    set_pressure_water(grid, batch->pressure);
+    set_structural_integrity(grid, batch->integrity);
+
+    for (t = 0; t < batch->ticks; t++) {
+        if (t == batch->replay_tick)
+            snapshot = fork_grid(grid);
+
+        update_grid(grid);
+    }
 
-    curr_particle->life_time -= (float)rand() / (float)(RAND_MAX / 0.15f);
+    stats->ticks = batch->ticks;
+    count_world(grid, stats);
 
-    if (curr_particle->life_time <= 0.0f) {
-        remove_particle(grid, x, y);
-        if (rand() % 5 == 0) { add_particle(grid, x, y, MAT_SMOKE); }
-        curr_particle->has_been_updated = true;
-        return;
+    if (snapshot != NULL) {
+        restore_grid(grid, snapshot);
+        destroy_grid(snapshot);
+
+        for (t = batch->replay_tick; t < batch->ticks; t++)
+            update_grid(grid);
+
+        count_world(grid, &replay);
+        stats->replay_differed =
+            memcmp(replay.counts, stats->counts, sizeof(stats->counts)) != 0
+            || replay.liquid_bodies != stats->liquid_bodies
+            || replay.largest_body != stats->largest_body;
+    }
+
+    destroy_grid(grid);
+}
+
+void
+count_world(grid_t *grid, world_stats_t *stats)
+{
+    int i, x, y;
+    size_t e;
+
+    for (i = 0; i < MAT_COUNT; i++)
+        stats->counts[i] = 0;
+
+    for (y = 0; y < grid->height; y++) {
+        for (x = 0; x < grid->width; x++)
+            stats->counts[get_particle_type_pos(grid, x, y)]++;
     }
+
+    for (e = 0; e < grid->ejecta.count; e++)
+        stats->counts[grid->ejecta.particles[e].mat_type]++;
+
+    /* The smoke field counts as however many particles went into it */
+    stats->counts[MAT_SMOKE] += (size_t)(get_field_total(&grid->smoke) + 0.5);
+
+    /* This is already on a worker, so the chunks are labelled right here */
+    update_liquid_bodies(grid, NULL);
+    stats->liquid_bodies = grid->bodies.count;
+    stats->largest_body = grid->bodies.largest;
 }
 
 void
-update_flame(grid_t *grid, int x, int y)
+write_batch_stats(FILE *file, const batch_t *batch)
 {
-    int above = y + 1;
-    int left = x - 1, right = x + 1;
-    particle_t *curr_particle = get_particle(grid, x, y);
+    int i, m;
 
-    if (curr_particle == NULL)
-        return;
+    fprintf(file, "world,seed,ticks");
+    for (m = 0; m < MAT_COUNT; m++)
+        fprintf(file, ",%s", get_name_from_mat(m));
+    fprintf(file, ",liquid_bodies,largest_body\n");
 
-    curr_particle->life_time -= (float)rand() / (float)(RAND_MAX / 0.25f);
+    for (i = 0; i < batch->world_count; i++) {
+        fprintf(file, "%d,%lu,%d", i, (unsigned long)batch->stats[i].seed,
+                batch->stats[i].ticks);
 
-    if (curr_particle->life_time <= 0.0f) {
-        remove_particle(grid, x, y);
-        curr_particle->has_been_updated = true;
-        return;
+        for (m = 0; m < MAT_COUNT; m++)
+            fprintf(file, ",%zu", batch->stats[i].counts[m]);
+
+        fprintf(file, ",%zu,%zu\n", batch->stats[i].liquid_bodies,
+                batch->stats[i].largest_body);
     }
+}
 
-    if (is_pos_empty(grid, x, above)) {
-        swap_particles(grid, x, y, x, above);
+int
+batch_main(int argc, char **argv)
+{
+    int i, number, differed = 0;
+    int threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    const char *out_path = NULL;
+    FILE *out = stdout;
+    worker_pool_t *pool = NULL;
+    struct timespec start, end;
+    batch_t batch = {
+        1000,
+        128,
+        128,
+        600,
+        -1,
+        SCENARIO_FIRE,
+        false,
+        false,
+        1,
+        NULL
+    };
+
+    for (i = 2; i < argc; i++) {
+        if (i + 1 >= argc) {
+            fprintf(stderr, "Error: %s needs a value\n", argv[i]);
+            return EXIT_FAILURE;
+        }
+
+        if (strcmp(argv[i], "--worlds") == 0
+            || strcmp(argv[i], "--size") == 0
+            || strcmp(argv[i], "--ticks") == 0
+            || strcmp(argv[i], "--replay") == 0
+            || strcmp(argv[i], "--threads") == 0) {
+            if (!parse_int(argv[i + 1], &number)) {
+                fprintf(stderr, "Error: %s needs a number, not %s\n", argv[i],
+                        argv[i + 1]);
+                return EXIT_FAILURE;
+            }
+
+            if (strcmp(argv[i], "--worlds") == 0)
+                batch.world_count = number;
+            else if (strcmp(argv[i], "--size") == 0)
+                batch.width = batch.height = number;
+            else if (strcmp(argv[i], "--ticks") == 0)
+                batch.ticks = number;
+            else if (strcmp(argv[i], "--replay") == 0)
+                batch.replay_tick = number;
+            else if (number < 1) {
+                fprintf(stderr, "Error: --threads must be at least 1\n");
+                return EXIT_FAILURE;
+            }
+            else
+                threads = number;
+
+            i++;
+        }
+        else if (strcmp(argv[i], "--seed") == 0) {
+            if (!parse_seed(argv[++i], &batch.seed)) {
+                fprintf(stderr, "Error: --seed needs a number from 0 to %lu, "
+                        "not %s\n", (unsigned long)UINT32_MAX, argv[i]);
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp(argv[i], "--out") == 0)
+            out_path = argv[++i];
+        else if (strcmp(argv[i], "--scenario") == 0) {
+            i++;
+            if (strcmp(argv[i], "fire") == 0)
+                batch.scenario = SCENARIO_FIRE;
+            else if (strcmp(argv[i], "flood") == 0)
+                batch.scenario = SCENARIO_FLOOD;
+            else if (strcmp(argv[i], "avalanche") == 0)
+                batch.scenario = SCENARIO_AVALANCHE;
+            else {
+                fprintf(stderr, "Error: Unknown scenario %s\n", argv[i]);
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp(argv[i], "--water") == 0) {
+            i++;
+            if (strcmp(argv[i], "particles") == 0)
+                batch.pressure = false;
+            else if (strcmp(argv[i], "pressure") == 0)
+                batch.pressure = true;
+            else {
+                fprintf(stderr, "Error: Unknown water mode %s\n", argv[i]);
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp(argv[i], "--integrity") == 0) {
+            i++;
+            if (strcmp(argv[i], "off") == 0)
+                batch.integrity = false;
+            else if (strcmp(argv[i], "on") == 0)
+                batch.integrity = true;
+            else {
+                fprintf(stderr, "Error: Unknown integrity mode %s\n",
+                        argv[i]);
+                return EXIT_FAILURE;
+            }
+        }
+        else {
+            fprintf(stderr, "Error: Unknown option %s\n", argv[i]);
+            return EXIT_FAILURE;
+        }
     }
-    else if (is_pos_empty(grid, left, above)
-             && !is_pos_static(grid, x, above)) {
-        swap_particles(grid, x, y, left, above);
+
+    if (batch.world_count < 1) {
+        fprintf(stderr, "Error: --worlds must be at least 1\n");
+        return EXIT_FAILURE;
     }
-    else if (is_pos_empty(grid, right, above)
-             && !is_pos_static(grid, x, above)) {
-        swap_particles(grid, x, y, right, above);
+
+    if (batch.ticks < 0) {
+        fprintf(stderr, "Error: --ticks can't be negative\n");
+        return EXIT_FAILURE;
     }
-    else if (is_pos_empty(grid, left, y)) {
-        swap_particles(grid, x, y, left, y);
+
+    if (batch.replay_tick != -1
+        && (batch.replay_tick < 0 || batch.replay_tick >= batch.ticks)) {
+        fprintf(stderr, "Error: --replay must be one of the ticks run\n");
+        return EXIT_FAILURE;
     }
-    else if (is_pos_empty(grid, right, y)) {
-        swap_particles(grid, x, y, right, y);
+
+    /* The scenarios place things at fractions of the size */
+    if (batch.width < BATCH_MIN_SIZE || batch.width > MAX_SIZE) {
+        fprintf(stderr, "Error: --size must be from %d to %d\n",
+                BATCH_MIN_SIZE, MAX_SIZE);
+        return EXIT_FAILURE;
     }
 
-    curr_particle->has_been_updated = true;
-}
+    /* The number of cores can't always be found */
+    if (threads < 1)
+        threads = 1;
 
-material_type 
-next_material(material_type m)
-{
-    if (m == MAT_COUNT - 1)
-        m = 0;
+    batch.stats = calloc(batch.world_count, sizeof(*batch.stats));
+    if (batch.stats == NULL) {
+        fprintf(stderr, "Error: Could not allocate enough memory at %d in %s\n",
+                __LINE__, __FILE__);
+        exit(EXIT_FAILURE);
+    }
 
-    return m + 1;
-}
+    if (out_path != NULL) {
+        out = fopen(out_path, "w");
+        if (out == NULL) {
+            fprintf(stderr, "Error: Could not open %s\n", out_path);
+            free(batch.stats);
+            return EXIT_FAILURE;
+        }
+    }
 
-material_type 
-prev_material(material_type m)
-{
-    if (m == 1)
-        m = MAT_COUNT;
+    clock_gettime(CLOCK_MONOTONIC, &start);
 
-    return m - 1;
-}
+    pool = new_worker_pool(threads);
+    run_tasks(pool, batch.world_count, run_world_task, &batch);
+    destroy_worker_pool(pool);
 
-Color
-get_color_from_mat(material_type m)
-{
-    switch (m) {
-        case MAT_SAND:  return YELLOW;
-        case MAT_WATER: return SKYBLUE;
-        case MAT_SMOKE: return GRAY;
-        case MAT_OIL:   return BLACK;
-        case MAT_WALL:  return LIGHTGRAY;
-        case MAT_WOOD:  return (Color){66, 27, 4, 255};
-        case MAT_FIRE:  return RED;
-        case MAT_FLAME: return ORANGE;
-        default:        return BLANK;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    for (i = 0; i < batch.world_count; i++)
+        differed += batch.stats[i].replay_differed;
+
+    write_batch_stats(out, &batch);
+    fprintf(stderr, "Ran %d %s worlds of %d ticks on %d threads with the %s "
+            "layout in %.3f s\n",
+            batch.world_count, scenario_names[batch.scenario],
+            batch.ticks, threads, GRID_LAYOUT_NAME,
+            (double)(end.tv_sec - start.tv_sec)
+            + (double)(end.tv_nsec - start.tv_nsec) / 1e9);
+
+    if (batch.replay_tick != -1) {
+        fprintf(stderr, "%d of the worlds played out differently when they "
+                "were replayed from tick %d\n", differed, batch.replay_tick);
     }
+
+    if (out != stdout)
+        fclose(out);
+
+    free(batch.stats);
+
+    return EXIT_SUCCESS;
 }
 /* EOF */